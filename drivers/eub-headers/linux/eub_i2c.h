@@ -0,0 +1,369 @@
+/*
+ * Esrille Unbrick I2C Bridge Kernel Driver
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LINUX_EUB_I2C_H
+#define __LINUX_EUB_I2C_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * /dev/i2c-proxyN
+ * ----------------------------------------------------------------------------
+ *
+ * The proxy can be open in one process at a time; open() fails with EBUSY
+ * while it is. Closing it fails the transfers that have been read and
+ * not answered, and returns to the legacy mode and the raw format.
+ *
+ * Each read() returns one i2c_transfer() packed as a series of messages,
+ * each a header followed by len bytes of data, and the bridge daemon
+ * answers with a write() of the same messages with the data of read
+ * messages filled in. EUB_I2C_IOC_SET_FORMAT selects a combination of the
+ * EUB_I2C_FORMAT_* flags:
+ *
+ * EUB_I2C_FORMAT_RAW: the header holds addr, flags and len, all 16 bits,
+ * as they start struct i2c_msg.
+ *
+ * EUB_I2C_FORMAT_COMPACT: the header is a byte holding the 7 bit address
+ * shifted left by one and I2C_M_RD in bit 0, followed by the varint
+ * (len << 1 | EUB_I2C_COMPACT_FLAGS). If that bit is set, the varint
+ * (flags << 1 | EUB_I2C_COMPACT_ADDR16) follows with the remaining flags,
+ * and if that bit is set too, the 16 bit address follows, little endian,
+ * in place of the one in the first byte. Varints hold 7 bits per byte,
+ * least significant first, with bit 7 set in every byte but the last. A
+ * register read then costs 4 bytes of headers instead of 12.
+ *
+ * EUB_I2C_FORMAT_SPLIT: read messages carry no data, and the answer holds
+ * nothing but the data of the read messages, one after another, which
+ * the driver copies straight into their buffers. It needs the tagged
+ * mode, and selecting the legacy mode turns it off.
+ *
+ * EUB_I2C_FORMAT_SMBUS: with COMPACT and SPLIT, an SMBus read byte, read
+ * word or read block data, or write byte data, is packed as a single op
+ * instead of messages: the byte EUB_I2C_SMBUS_OP | EUB_I2C_SMBUS_*, the 7
+ * bit address and the command, followed by the value for a write. The
+ * answer holds the byte, the word little endian, or the count the device
+ * returned followed by that many bytes, or nothing for the write. As op
+ * bytes are the headers of messages to the reserved addresses 0x7c to
+ * 0x7f, those take the form with the 16 bit address in this format. The
+ * adapter always reports the SMBus block read, but it fails with
+ * EPROTONOSUPPORT unless the format is selected.
+ *
+ * In the legacy mode, a transfer is handed out only after the previous
+ * one has been answered, and a write() of length 0 fails the transfer.
+ *
+ * In the tagged mode, each transfer is preceded by struct
+ * eub_i2c_proxy_hdr, and the daemon may read further transfers before it
+ * answers the first. An answer carries the id of the transfer it belongs
+ * to, and a status other than 0, with len 0, fails the transfer: -EIO,
+ * -ENXIO or -ETIMEDOUT as given, and any other status with -EINVAL.
+ *
+ * In the framed mode, which EUB_I2C_IOC_SET_FRAMING selects, the driver
+ * speaks the framing the daemon has agreed on with the firmware itself.
+ * Each read() returns one frame ready for the UART, COBS encoded with its
+ * delimiter, its control byte, sequence number and CRC as the framing
+ * features call for, and the format following from them. Each write()
+ * hands over whatever the UART has received, cut anywhere; the driver
+ * decodes the frames, checks them and copies the read data of each reply
+ * straight into the messages of the transfer it belongs to. The daemon
+ * only relays bytes. No more than window transfers are handed out at a
+ * time, a transfer the firmware reports damaged goes out again with the
+ * same sequence number, and a reply that is lost or damaged leaves its
+ * transfer to time out. Transfers that do not fit in max_frame fail, as
+ * there is no fragmentation, and pushed snapshots are dropped. On leaving
+ * the mode, EUB_I2C_IOC_GET_FRAMING tells the daemon the last sequence
+ * number used.
+ *
+ * In the tagged mode, the daemon may also take transfers from and answer
+ * them into a pair of rings it maps from the proxy, set up with
+ * EUB_I2C_IOC_SET_RING. The mapping starts with struct eub_i2c_ring,
+ * followed by the submission ring at sq_off and the completion ring at
+ * cq_off, each of entries entries of entry_size bytes. An entry holds
+ * what read() and write() would return and take: struct eub_i2c_proxy_hdr
+ * and len bytes. The indices run freely and are masked with entries - 1;
+ * each has one writer, which stores it after the entry it covers, and a
+ * reader, which loads it before reading the entry. The driver puts each
+ * transfer that fits in an entry into the submission ring while it has
+ * room and sq_tail is short of sq_limit, and leaves the rest to read(),
+ * which hands them out only while sq_tail is short of sq_limit as well.
+ * The daemon sets sq_limit to sq_head plus the transfers it can send at
+ * once, so that the others keep waiting in the driver in the order of
+ * their classes. The driver takes in the answers in the completion ring,
+ * and refills the submission ring, when the daemon calls
+ * EUB_I2C_IOC_RING_UPDATE, reads or writes the proxy; the daemon calls it
+ * once for all the answers it has put in the completion ring, and the
+ * room it has made by raising sq_limit, since the last time. An answer
+ * that does not fit, or finds the ring full, goes through write().
+ *
+ * poll() reports the proxy readable while read() has a transfer to hand
+ * out, which with O_NONBLOCK fails with EAGAIN otherwise, or the
+ * submission ring is not empty, and writable while a transfer is waiting
+ * for its answer, or always in the framed mode.
+ *
+ * A transfer fails with -ETIMEDOUT if it is not answered within the
+ * timeout of the adapter. EUB_I2C_IOC_SET_TIMEOUT shortens that for
+ * transfers the daemon has read to base_us plus byte_ns for every byte of
+ * the transfer and its answer, which the daemon derives from the baud
+ * rate and how fast the board has been answering. Zeros restore the
+ * adapter timeout, as closing the proxy does.
+ */
+
+#define EUB_I2C_MODE_LEGACY	0
+#define EUB_I2C_MODE_TAGGED	1
+#define EUB_I2C_MODE_FRAMED	2
+
+#define EUB_I2C_FORMAT_RAW	0x00
+#define EUB_I2C_FORMAT_COMPACT	0x01
+#define EUB_I2C_FORMAT_SPLIT	0x02
+#define EUB_I2C_FORMAT_SMBUS	0x04
+
+#define EUB_I2C_COMPACT_RD	0x01	/* in the address byte */
+#define EUB_I2C_COMPACT_FLAGS	0x01	/* in the length varint */
+#define EUB_I2C_COMPACT_ADDR16	0x01	/* in the flags varint */
+#define EUB_I2C_COMPACT_HDR_MAX	9
+
+#define EUB_I2C_SMBUS_OP		0xf8	/* | EUB_I2C_SMBUS_* */
+#define EUB_I2C_SMBUS_READ_BYTE_DATA	0
+#define EUB_I2C_SMBUS_READ_WORD_DATA	1
+#define EUB_I2C_SMBUS_READ_BLOCK_DATA	2
+#define EUB_I2C_SMBUS_WRITE_BYTE_DATA	3
+#define EUB_I2C_SMBUS_BLOCK_MAX		32
+
+struct eub_i2c_proxy_hdr {
+	__u32 id;
+	__u32 len;		/* bytes of packed messages that follow */
+	__s32 status;		/* answers: 0, -EIO, -ENXIO or -ETIMEDOUT */
+	__u32 flags;		/* reserved, 0 */
+};
+
+struct eub_i2c_timeout {
+	__u32 base_us;
+	__u32 byte_ns;
+};
+
+/* the framing features the driver speaks, as EUB_BRIDGE_FEAT_* */
+#define EUB_I2C_FRAMING_CRC		0x0002
+#define EUB_I2C_FRAMING_PIPELINE	0x0004
+#define EUB_I2C_FRAMING_COMPACT		0x0008
+#define EUB_I2C_FRAMING_SPLIT		0x0010
+#define EUB_I2C_FRAMING_SMBUS		0x0040
+#define EUB_I2C_FRAMING_ALL		0x005e
+
+#define EUB_I2C_FRAMING_WINDOW_MAX	16
+
+struct eub_i2c_framing {
+	__u16 features;		/* EUB_I2C_FRAMING_* in use on the link */
+	__u16 max_frame;	/* largest frame payload the firmware takes */
+	__u8 window;		/* frames in flight; 1 without PIPELINE */
+	__u8 seq;		/* the last sequence number used */
+	__u16 reserved;		/* 0 */
+};
+
+#define EUB_I2C_RING_ENTRIES_MAX	256
+
+struct eub_i2c_ring_setup {
+	__u32 entries;		/* in each ring, a power of 2 */
+	__u32 entry_size;	/* a multiple of 8 up to a page, header included */
+	__u32 sq_off;		/* set by the driver */
+	__u32 cq_off;		/* set by the driver */
+	__u32 size;		/* set by the driver: the bytes to mmap() */
+};
+
+/* each index on a cache line of its own, sq_limit along with sq_head */
+struct eub_i2c_ring {
+	__u32 sq_head;		/* written by the daemon */
+	__u32 sq_limit;		/* written by the daemon, see above */
+	__u32 pad0[14];
+	__u32 sq_tail;		/* written by the driver */
+	__u32 pad1[15];
+	__u32 cq_head;		/* written by the driver */
+	__u32 pad2[15];
+	__u32 cq_tail;		/* written by the daemon */
+	__u32 pad3[15];
+};
+
+#define EUB_I2C_IOC_MAGIC	0xeb
+
+/* select EUB_I2C_MODE_*; fails transfers in flight */
+#define EUB_I2C_IOC_SET_MODE	_IOW(EUB_I2C_IOC_MAGIC, 1, __u32)
+/* select EUB_I2C_FORMAT_* flags; fails transfers in flight */
+#define EUB_I2C_IOC_SET_FORMAT	_IOW(EUB_I2C_IOC_MAGIC, 2, __u32)
+/* bound the time to answer a transfer once read, see above */
+#define EUB_I2C_IOC_SET_TIMEOUT	_IOW(EUB_I2C_IOC_MAGIC, 3, \
+				     struct eub_i2c_timeout)
+/* select EUB_I2C_MODE_FRAMED with the framing of the link, see above */
+#define EUB_I2C_IOC_SET_FRAMING	_IOW(EUB_I2C_IOC_MAGIC, 4, \
+				     struct eub_i2c_framing)
+/* the framing in use, with the last sequence number the driver has used */
+#define EUB_I2C_IOC_GET_FRAMING	_IOR(EUB_I2C_IOC_MAGIC, 5, \
+				     struct eub_i2c_framing)
+/* create the rings to mmap(), see above; once for each open() */
+#define EUB_I2C_IOC_SET_RING	_IOWR(EUB_I2C_IOC_MAGIC, 6, \
+				      struct eub_i2c_ring_setup)
+/* take in the completion ring and refill the submission ring, see above */
+#define EUB_I2C_IOC_RING_UPDATE	_IO(EUB_I2C_IOC_MAGIC, 7)
+
+/*
+ * ----------------------------------------------------------------------------
+ * The bridge protocol
+ * ----------------------------------------------------------------------------
+ *
+ * What eub_i2cattach and the driver in its serdev configuration speak with
+ * the board firmware over the UART. The firmware starts at
+ * EUB_BRIDGE_BAUDRATE with the legacy framing, in which a frame holds at
+ * most EUB_BRIDGE_LEGACY_FRAME bytes of messages in EUB_I2C_FORMAT_RAW.
+ *
+ * Messages addressed to EUB_BRIDGE_ADDR are consumed by the board firmware
+ * instead of being forwarded to the I2C bus. A control transfer is a write
+ * message carrying a command followed by a read message for its result.
+ */
+#define EUB_BRIDGE_BAUDRATE	115200
+#define EUB_BRIDGE_LEGACY_FRAME	32
+
+#define EUB_BRIDGE_ADDR		0xffff
+
+#define EUB_BRIDGE_CMD_HELLO	0x01	/* reply: struct eub_bridge_hello */
+#define EUB_BRIDGE_CMD_BAUD	0x02	/* u32 rate, u8 flags; reply: u8 status */
+#define EUB_BRIDGE_CMD_MODE	0x03	/* u16 features; reply: u8 status */
+#define EUB_BRIDGE_CMD_SUBSCRIBE 0x04	/* see PUSH below; reply: u8 status */
+
+#define EUB_BRIDGE_MAGIC0	'E'
+#define EUB_BRIDGE_MAGIC1	'B'
+#define EUB_BRIDGE_VERSION	1
+
+#define EUB_BRIDGE_BAUD_RTSCTS	0x01
+
+/*
+ * After acknowledging EUB_BRIDGE_CMD_BAUD the firmware switches to the new
+ * rate, and falls back to EUB_BRIDGE_BAUDRATE unless a valid frame arrives
+ * within EUB_BRIDGE_BAUD_GRACE milliseconds. It also falls back to
+ * EUB_BRIDGE_BAUDRATE when it receives line noise at any other rate, e.g.,
+ * after the host restarts.
+ */
+#define EUB_BRIDGE_BAUD_GRACE	100
+
+/*
+ * Framing features
+ *
+ * Firmware lists the features it supports in struct eub_bridge_hello, and
+ * EUB_BRIDGE_CMD_MODE enables a subset of them; the acknowledgement is
+ * still sent in the old framing. While any feature is enabled, each frame
+ * starts with a control byte (EUB_FRAME_*). Control bytes never have bit 7
+ * set, so a frame starting with a bridge message (0xff) is always in the
+ * legacy framing; firmware returns to the legacy framing when it receives
+ * EUB_BRIDGE_CMD_HELLO that way.
+ *
+ * FRAG: a transfer larger than max_frame is sent as a series of frames,
+ * split at message boundaries. A message may be split as well, in which
+ * case the continuation carries I2C_M_NOSTART. Every frame but the last
+ * has EUB_FRAME_MORE set; the firmware keeps the bus until the last one,
+ * and answers each frame before the host sends the next.
+ */
+#define EUB_BRIDGE_FEAT_FRAG	0x0001
+
+/*
+ * CRC: the control byte is followed by a sequence number, and the frame
+ * ends with the CRC-16/CCITT-FALSE of everything before it, little endian.
+ * The firmware answers a damaged request with EUB_FRAME_NAK, carrying the
+ * sequence number it read if any, and answers a request repeating the
+ * sequence number of the previous one by sending the previous reply again
+ * without touching the I2C bus.
+ */
+#define EUB_BRIDGE_FEAT_CRC	0x0002
+
+/*
+ * PIPELINE: the host may send up to window frames (see struct
+ * eub_bridge_hello) before the first is answered. The firmware runs them
+ * in the order they arrive and answers each with its sequence number,
+ * which requires CRC. It keeps the last window replies so that a frame
+ * sent again is answered without touching the I2C bus. A fragmented
+ * transfer is still sent one frame at a time with nothing else in flight.
+ */
+#define EUB_BRIDGE_FEAT_PIPELINE	0x0004
+
+/*
+ * COMPACT: messages carry the EUB_I2C_FORMAT_COMPACT headers described
+ * above instead of the raw ones. The kernel driver packs them
+ * that way itself once the daemon selects the format, so that the daemon
+ * passes transfers through as they are.
+ */
+#define EUB_BRIDGE_FEAT_COMPACT	0x0008
+
+/*
+ * SPLIT: read messages carry no data, as in EUB_I2C_FORMAT_SPLIT, and the
+ * reply to a frame is a status byte (EUB_BRIDGE_STATUS_*) followed by the
+ * data of the read messages in the frame, one after another, instead of
+ * an echo of the request. A failed frame is answered by the status byte
+ * alone, and ends a fragmented transfer. Replies are held to max_frame
+ * like requests.
+ */
+#define EUB_BRIDGE_FEAT_SPLIT	0x0010
+
+/*
+ * PUSH: EUB_BRIDGE_CMD_SUBSCRIBE, followed by a subscription id, the 7 bit
+ * address of a device, its first register, a count of registers and a u16
+ * period in milliseconds, makes the firmware read the registers every
+ * period and send them to the host unasked, as a frame with the control
+ * byte EUB_FRAME_PUSH, the subscription id in place of the sequence
+ * number, and the register data as its payload. A period of 0 ends the
+ * subscription, and changing the framing features ends all of them. A
+ * snapshot the device does not acknowledge is skipped, and one that is
+ * lost on the way is not sent again; the next one replaces it. The
+ * firmware answers the command with a status of 1 if it is out of
+ * subscriptions or the snapshot would not fit in max_frame. PUSH needs
+ * CRC so that a damaged snapshot is never taken for a reply.
+ */
+#define EUB_BRIDGE_FEAT_PUSH	0x0020
+
+/*
+ * SMBUS: a frame may carry an SMBus op of EUB_I2C_FORMAT_SMBUS instead of
+ * messages, which the firmware runs as the read or write it stands for;
+ * the reply is the status byte followed by the answer the format
+ * describes. It needs COMPACT and SPLIT, which have messages to 0x7c to
+ * 0x7f take their 16 bit address form. Firmware offers it only with a
+ * max_frame that holds the reply to a block read.
+ */
+#define EUB_BRIDGE_FEAT_SMBUS	0x0040
+
+#define EUB_BRIDGE_FEAT_ALL	(EUB_BRIDGE_FEAT_FRAG | EUB_BRIDGE_FEAT_CRC | \
+				 EUB_BRIDGE_FEAT_PIPELINE | \
+				 EUB_BRIDGE_FEAT_COMPACT | \
+				 EUB_BRIDGE_FEAT_SPLIT | \
+				 EUB_BRIDGE_FEAT_PUSH | \
+				 EUB_BRIDGE_FEAT_SMBUS)
+
+#define EUB_BRIDGE_STATUS_OK	0x00
+#define EUB_BRIDGE_STATUS_NAK	0x01	/* a device did not acknowledge */
+
+#define EUB_FRAME_MORE		0x01
+#define EUB_FRAME_NAK		0x02
+#define EUB_FRAME_PUSH		0x04
+
+#define EUB_BRIDGE_CRC16_INIT	0xffff
+
+struct eub_bridge_hello {
+	__u8 magic[2];
+	__u8 version;
+	__u8 window;		/* frames buffered with PIPELINE */
+	__le16 features;
+	__le16 max_frame;	/* largest decoded frame the firmware takes */
+} __attribute__((packed));
+
+#endif /*  __LINUX_EUB_I2C_H */
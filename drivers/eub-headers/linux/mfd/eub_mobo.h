@@ -20,6 +20,8 @@
 #ifndef __LINUX_MFD_EUB_MOBO_H
 #define __LINUX_MFD_EUB_MOBO_H
 
+#include <linux/types.h>
+
 /*
  * ----------------------------------------------------------------------------
  * Registers, all 8 bits
@@ -38,7 +40,42 @@
 #define EUB_MOBO_REG_Y_HIGH		0x08
 #define EUB_MOBO_REG_Z_LOW		0x09
 #define EUB_MOBO_REG_Z_HIGH		0x0A
-#define EUB_MOBO_REG_MAX		0x0B
+#define EUB_MOBO_REG_FIFO_PERIOD	0x0B
+#define EUB_MOBO_REG_MAX		0x0C
+
+/*
+ * ----------------------------------------------------------------------------
+ * Touch FIFO
+ * ----------------------------------------------------------------------------
+ *
+ * Writing a period in EUB_MOBO_FIFO_TICK_US units to EUB_MOBO_REG_FIFO_PERIOD
+ * makes the firmware sample the touch panel on that period and buffer up to
+ * EUB_MOBO_FIFO_DEPTH samples, dropping the oldest when full; 0 turns the
+ * FIFO off and empties it. Firmware without the FIFO reads the register
+ * back as something other than what was written.
+ *
+ * A read from EUB_MOBO_REG_FIFO returns struct eub_mobo_fifo_hdr followed by
+ * hdr.count samples, as many as are buffered and fit in the read, which
+ * are taken out of the FIFO oldest first. The rest of the read is padding.
+ * Times are the firmware clock in ticks, all 16 bits little endian, so the
+ * age of a sample is (u16) (hdr.now - sample.time) ticks.
+ */
+#define EUB_MOBO_REG_FIFO		0x10
+
+#define EUB_MOBO_FIFO_TICK_US		100
+#define EUB_MOBO_FIFO_DEPTH		16
+
+struct eub_mobo_fifo_hdr {
+	__u8 count;
+	__le16 now;
+} __attribute__((packed));
+
+struct eub_mobo_fifo_sample {
+	__le16 time;
+	__le16 x;
+	__le16 y;
+	__le16 z;
+} __attribute__((packed));
 
 struct eub_mobo_dev {
 	struct device *dev;
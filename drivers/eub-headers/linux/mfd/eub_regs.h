@@ -0,0 +1,105 @@
+/*
+ * Esrille Unbrick Board Register Access
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LINUX_MFD_EUB_REGS_H
+#define __LINUX_MFD_EUB_REGS_H
+
+#include <linux/i2c.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+
+/* most registers one write covers */
+#define EUB_REGS_WRITE_MAX	I2C_SMBUS_BLOCK_MAX
+
+/*
+ * Read bytes registers from reg on, as the mobo and the power board
+ * drivers do. Returns 0 or a negative errno.
+ */
+static inline int eub_regs_read(struct i2c_client *i2c, char reg, int bytes,
+				void *dest)
+{
+	struct i2c_msg xfer[2];
+	int ret;
+
+	/* single registers go to the adapter as SMBus, if it has them */
+	if (bytes == 1) {
+		ret = i2c_smbus_read_byte_data(i2c, reg);
+		if (ret < 0)
+			return ret;
+		*(u8 *) dest = ret;
+		return 0;
+	}
+	if (bytes == 2) {
+		ret = i2c_smbus_read_word_data(i2c, reg);
+		if (ret < 0)
+			return ret;
+		put_unaligned_le16(ret, dest);
+		return 0;
+	}
+
+	/* Write register */
+	xfer[0].addr = i2c->addr;
+	xfer[0].flags = 0;
+	xfer[0].len = 1;
+	xfer[0].buf = &reg;
+
+	/* Read data */
+	xfer[1].addr = i2c->addr;
+	xfer[1].flags = I2C_M_RD;
+	xfer[1].len = bytes;
+	xfer[1].buf = dest;
+
+	ret = i2c_transfer(i2c->adapter, xfer, 2);
+	if (ret == 2)
+		ret = 0;
+	else if (ret >= 0)
+		ret = -EIO;
+
+	return ret;
+}
+
+/*
+ * Write bytes registers from reg on, at most EUB_REGS_WRITE_MAX. Returns 0
+ * or a negative errno.
+ */
+static inline int eub_regs_write(struct i2c_client *i2c, char reg, int bytes,
+				 const void *src)
+{
+	/* we add 1 byte for device register */
+	u8 msg[EUB_REGS_WRITE_MAX + 1];
+	int ret;
+
+	if (EUB_REGS_WRITE_MAX < bytes)
+		return -EINVAL;
+
+	if (bytes == 1)
+		return i2c_smbus_write_byte_data(i2c, reg, *(const u8 *) src);
+
+	msg[0] = reg;
+	memcpy(&msg[1], src, bytes);
+
+	ret = i2c_master_send(i2c, msg, bytes + 1);
+	if (ret < 0)
+		return ret;
+	if (ret != bytes + 1)
+		return -EIO;
+	return 0;
+}
+
+#endif /*  __LINUX_MFD_EUB_REGS_H */
@@ -17,6 +17,8 @@
  * along with this program; if not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE	/* for CPU_SET */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -25,12 +27,29 @@
 #include <string.h>
 #include <termios.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <malloc.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <linux/i2c.h>
+#include <linux/serial.h>
 
 #include "eub_i2c.h"
 
-#define UART_DELAY	100	// microseconds
-#define UART_TIMEOUT	(500000/UART_DELAY)
+#define UART_TIMEOUT	500	// milliseconds
+#define UART_QUIET	5	// milliseconds
+#define I2C_BYTE_TIME	100	// microseconds per byte on a 100 kHz I2C bus
+#define RETRY_SLACK	20	// milliseconds, until replies have been timed
+#define TIMEOUT_FLOOR	2000	// microseconds of slack for scheduling
+#define PREFAULT_STACK	(128 * 1024)	// bytes of stack touched up front
+#define BRIDGE_TRIES	4	// control exchanges before giving up on one
 
 static void print_msg(struct i2c_packed_msg *msg)
 {
@@ -45,87 +64,1577 @@ static void print_msg(struct i2c_packed_msg *msg)
 		msg->flags & I2C_M_STOP ? "STOP" : "");
 }
 
-static uint8_t garbage[LEN_BUFFER];
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Sleep until fd becomes ready for events or the deadline passes.
+ * Returns 1 if ready, 0 on timeout, and -1 on error.
+ */
+static int uart_wait(int fd, short events, int64_t deadline)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+
+	for (;;) {
+		int64_t timeout = deadline - now_ms();
+		if (timeout < 0)
+			timeout = 0;
+		int ret = poll(&pfd, 1, (int) timeout);
+		if (0 < ret)
+			return (pfd.revents & (POLLERR | POLLNVAL)) ? -1 : 1;
+		if (ret == 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+static const struct {
+	unsigned int rate;
+	speed_t speed;
+} speeds[] = {
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+	{ 460800, B460800 },
+	{ 500000, B500000 },
+	{ 576000, B576000 },
+	{ 921600, B921600 },
+	{ 1000000, B1000000 },
+	{ 1152000, B1152000 },
+	{ 1500000, B1500000 },
+	{ 2000000, B2000000 },
+	{ 3000000, B3000000 },
+	{ 4000000, B4000000 },
+};
 
-int i2c_xfer(int fd, uint8_t *buffer, uint16_t len)
+#define NUM_SPEEDS	(sizeof speeds / sizeof speeds[0])
+
+speed_t uart_speed(unsigned int baudrate)
 {
-	// append trailer
-	uint8_t* end = buffer + 1 + len;
-	*end = 0;
+	size_t i;
 
-	// stuff data (COBS)
-	uint8_t* p;
-	uint8_t* code = buffer;
+	for (i = 0; i < NUM_SPEEDS; ++i) {
+		if (speeds[i].rate == baudrate)
+			return speeds[i].speed;
+	}
+	return B0;
+}
+
+int uart_configure(int fd, unsigned int baudrate, int rtscts)
+{
+	struct termios ti;
+	struct serial_struct ss;
+	speed_t speed = uart_speed(baudrate);
+
+	if (speed == B0) {
+		fprintf(stderr, "unsupported baud rate: %u\n", baudrate);
+		return -1;
+	}
+
+	tcflush(fd, TCIOFLUSH);
+	if (tcgetattr(fd, &ti) < 0) {
+		perror("Can't get port settings");
+		return -1;
+	}
+	cfmakeraw(&ti);
+	ti.c_cflag |= CLOCAL;
+	if (rtscts)
+		ti.c_cflag |= CRTSCTS;
+	else
+		ti.c_cflag &= ~CRTSCTS;
+	/* return from read() as soon as any byte has arrived */
+	ti.c_cc[VMIN] = 1;
+	ti.c_cc[VTIME] = 0;
+	cfsetispeed(&ti, speed);
+	cfsetospeed(&ti, speed);
+	if (tcsetattr(fd, TCSANOW, &ti) < 0) {
+		perror("Can't set port settings");
+		return -1;
+	}
+
+	/*
+	 * Ask the serial driver to push received bytes to the tty layer
+	 * immediately rather than batching them. Not every UART driver
+	 * supports this, so a failure here is not fatal.
+	 */
+	if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+		ioctl(fd, TIOCSSERIAL, &ss);
+	}
+
+	tcflush(fd, TCIOFLUSH);
+	return 0;
+}
+
+size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	uint8_t *code = dst;
+	uint8_t *p = dst + 1;
 	uint8_t c = 1;
-	for (p = code + 1; p <= end; ++p) {
-		if (*p) {
-			++c;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		if (src[i]) {
+			*p++ = src[i];
+			if (++c < 0xff)
+				continue;
+		}
+		*code = c;
+		code = p++;
+		c = 1;
+	}
+	*code = c;
+	*p++ = 0;
+	return p - dst;
+}
+
+/*
+ * Decode a COBS frame without its delimiter in place. Returns the length
+ * of the decoded data, or 0 if the frame is malformed.
+ */
+size_t cobs_decode(uint8_t *buf, size_t len)
+{
+	size_t in = 0;
+	size_t out = 0;
+
+	while (in < len) {
+		uint8_t code = buf[in++];
+		if (code == 0 || len < in + code - 1)
+			return 0;
+		memmove(buf + out, buf + in, code - 1);
+		out += code - 1;
+		in += code - 1;
+		if (code < 0xff && in < len)
+			buf[out++] = 0;
+	}
+	return out;
+}
+
+static size_t varint_size(uint32_t v)
+{
+	size_t n = 1;
+
+	while (0x80 <= v) {
+		v >>= 7;
+		++n;
+	}
+	return n;
+}
+
+/*
+ * Returns whether the compact header of a message to addr carries the 16
+ * bit address, as it does where the first byte would read as an SMBus op.
+ */
+static int i2c_addr16(int format, uint16_t addr)
+{
+	if (format & EUB_I2C_FORMAT_SMBUS)
+		return EUB_I2C_SMBUS_OP >> 1 <= addr;
+	return 0x7f < addr;
+}
+
+/* Returns the size of the header i2c_pack_msg() writes for the message. */
+size_t i2c_msg_hdr_size(int format, uint16_t addr, uint16_t flags,
+			uint16_t len)
+{
+	uint16_t rest = flags & ~I2C_M_RD;
+	int addr16 = i2c_addr16(format, addr);
+
+	if (!(format & EUB_I2C_FORMAT_COMPACT))
+		return I2C_MSG_HDR_SIZE;
+	size_t size = 1 + varint_size((uint32_t) len << 1);
+	if (rest || addr16)
+		size += varint_size((uint32_t) rest << 1) + (addr16 ? 2 : 0);
+	return size;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+	while (0x80 <= v) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static uint8_t *get_varint(uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 21; shift += 7) {
+		uint8_t c = *p++;
+		*v |= (uint32_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+/* Returns how many bytes of data follow the header of msg. */
+size_t i2c_msg_data_size(int format, const struct i2c_packed_msg *msg)
+{
+	if ((format & EUB_I2C_FORMAT_SPLIT) && (msg->flags & I2C_M_RD))
+		return 0;
+	return msg->len;
+}
+
+/*
+ * Pack a message in the EUB_I2C_FORMAT_* format of linux/eub_i2c.h. If
+ * data is NULL, the message data is zero filled.
+ */
+uint8_t *i2c_pack_msg(uint8_t *p, int format, uint16_t addr,
+		      uint16_t flags, uint16_t len, const void *data)
+{
+	uint16_t rest = flags & ~I2C_M_RD;
+	int addr16 = i2c_addr16(format, addr);
+
+	if (!(format & EUB_I2C_FORMAT_COMPACT)) {
+		memcpy(p, &addr, sizeof addr);
+		memcpy(p + 2, &flags, sizeof flags);
+		memcpy(p + 4, &len, sizeof len);
+		p += I2C_MSG_HDR_SIZE;
+	} else {
+		*p++ = (addr16 ? 0 : addr << 1) |
+		       ((flags & I2C_M_RD) ? EUB_I2C_COMPACT_RD : 0);
+		if (!rest && !addr16) {
+			p = put_varint(p, (uint32_t) len << 1);
 		} else {
-			*code = c;
-			code = p;
-			c = 1;
+			p = put_varint(p, (uint32_t) len << 1 |
+					  EUB_I2C_COMPACT_FLAGS);
+			p = put_varint(p, (uint32_t) rest << 1 |
+					  (addr16 ? EUB_I2C_COMPACT_ADDR16 : 0));
+			if (addr16) {
+				*p++ = addr;
+				*p++ = addr >> 8;
+			}
 		}
 	}
+	if ((format & EUB_I2C_FORMAT_SPLIT) && (flags & I2C_M_RD))
+		return p;
+	if (data)
+		memcpy(p, data, len);
+	else
+		memset(p, 0, len);
+	return p + len;
+}
 
-	size_t count;
-	size_t offset;
+/*
+ * Read the header of the message at p into msg. Returns the start of the
+ * message data, i2c_msg_data_size() bytes long, or NULL if the message is
+ * malformed or runs past end.
+ */
+uint8_t *i2c_unpack_msg(uint8_t *p, const uint8_t *end, int format,
+			struct i2c_packed_msg *msg)
+{
+	uint32_t v;
 
-	// send the request
-	count = len + 2;
-	offset = 0;
-	do {
-		ssize_t ret = write(fd, buffer + offset, count);
-		if (ret <= 0) {
-			usleep(UART_DELAY);
+	if (!(format & EUB_I2C_FORMAT_COMPACT)) {
+		if (end - p < I2C_MSG_HDR_SIZE)
+			return NULL;
+		memcpy(msg, p, I2C_MSG_HDR_SIZE);
+		p += I2C_MSG_HDR_SIZE;
+	} else {
+		if (end <= p)
+			return NULL;
+		/* an op stands for a whole transfer; see i2c_unpack_op() */
+		if ((format & EUB_I2C_FORMAT_SMBUS) && EUB_I2C_SMBUS_OP <= *p)
+			return NULL;
+		msg->addr = *p >> 1;
+		msg->flags = (*p & EUB_I2C_COMPACT_RD) ? I2C_M_RD : 0;
+		if (!(p = get_varint(p + 1, end, &v)) || UINT16_MAX < v >> 1)
+			return NULL;
+		msg->len = v >> 1;
+		if (v & EUB_I2C_COMPACT_FLAGS) {
+			if (!(p = get_varint(p, end, &v)) ||
+			    UINT16_MAX < v >> 1)
+				return NULL;
+			msg->flags |= v >> 1;
+			if (v & EUB_I2C_COMPACT_ADDR16) {
+				if (end - p < 2)
+					return NULL;
+				msg->addr = p[0] | (p[1] << 8);
+				p += 2;
+			}
+		}
+	}
+	if ((size_t) (end - p) < i2c_msg_data_size(format, msg))
+		return NULL;
+	return p;
+}
+
+/*
+ * Read the transfer of len bytes at p into op if it is an SMBus op in the
+ * format. Returns 1 if it is, 0 if it is not, or -1 if it is malformed.
+ */
+int i2c_unpack_op(const uint8_t *p, size_t len, int format,
+		  struct i2c_smbus_op *op)
+{
+	if (!(format & EUB_I2C_FORMAT_SMBUS) || len < 1 ||
+	    *p < EUB_I2C_SMBUS_OP)
+		return 0;
+	op->op = *p & ~EUB_I2C_SMBUS_OP;
+	if (EUB_I2C_SMBUS_WRITE_BYTE_DATA < op->op ||
+	    len != ((op->op == EUB_I2C_SMBUS_WRITE_BYTE_DATA) ? 4 : 3) ||
+	    0x80 <= p[1])
+		return -1;
+	op->addr = p[1];
+	op->cmd = p[2];
+	op->value = (op->op == EUB_I2C_SMBUS_WRITE_BYTE_DATA) ? p[3] : 0;
+	return 1;
+}
+
+/*
+ * Returns the most bytes the answer to the SMBus op holds: the block read
+ * answers with its count and as many bytes as that says.
+ */
+size_t i2c_op_reply_size(int op)
+{
+	switch (op) {
+	case EUB_I2C_SMBUS_READ_BYTE_DATA:
+		return 1;
+	case EUB_I2C_SMBUS_READ_WORD_DATA:
+		return 2;
+	case EUB_I2C_SMBUS_READ_BLOCK_DATA:
+		return 1 + EUB_I2C_SMBUS_BLOCK_MAX;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Pack the transfer of len bytes at src, in the format src_format, into
+ * at most size bytes at dst in the format dst_format. Read messages are
+ * zero filled where dst_format gives them data that src_format does not.
+ * Returns the length packed, or -1 if the transfer is malformed or does
+ * not fit.
+ */
+ssize_t i2c_repack(uint8_t *dst, size_t size, int dst_format,
+		   uint8_t *src, size_t len, int src_format)
+{
+	uint8_t *end = src + len;
+	uint8_t *q = dst;
+
+	while (src < end) {
+		struct i2c_packed_msg msg;
+		uint8_t *data = i2c_unpack_msg(src, end, src_format, &msg);
+		if (!data)
+			return -1;
+		size_t data_size = i2c_msg_data_size(src_format, &msg);
+		if (size - (q - dst) <
+		    i2c_msg_hdr_size(dst_format, msg.addr, msg.flags,
+				     msg.len) + msg.len)
+			return -1;
+		q = i2c_pack_msg(q, dst_format, msg.addr, msg.flags, msg.len,
+				 (data_size == msg.len) ? data : NULL);
+		src = data + data_size;
+	}
+	return q - dst;
+}
+
+/*
+ * Copy the data of the read messages of the transfer of len bytes at buf,
+ * in the format format, from reply, the reply_len bytes link_xfer() or
+ * link_reap() left of the same transfer packed in the format
+ * reply_format. Returns 0, or -1 if the reply does not match.
+ */
+int i2c_fill_reads(uint8_t *buf, size_t len, int format,
+		   uint8_t *reply, size_t reply_len, int reply_format)
+{
+	uint8_t *end = buf + len;
+	uint8_t *reply_end = reply + reply_len;
+
+	while (buf < end) {
+		struct i2c_packed_msg msg, echo;
+		uint8_t *data = i2c_unpack_msg(buf, end, format, &msg);
+		uint8_t *read_data = reply;
+		if (!data)
+			return -1;
+		if (!(reply_format & EUB_I2C_FORMAT_SPLIT)) {
+			read_data = i2c_unpack_msg(reply, reply_end,
+						   reply_format, &echo);
+			if (!read_data || echo.len != msg.len)
+				return -1;
+			reply = read_data + echo.len;
+		} else if (msg.flags & I2C_M_RD) {
+			if (reply_end - reply < msg.len)
+				return -1;
+			reply += msg.len;
+		}
+		if ((msg.flags & I2C_M_RD) &&
+		    i2c_msg_data_size(format, &msg) == msg.len)
+			memcpy(data, read_data, msg.len);
+		buf = data + i2c_msg_data_size(format, &msg);
+	}
+	return (reply == reply_end) ? 0 : -1;
+}
+
+/* CRC-16/CCITT-FALSE, computed without a table as the firmware does */
+uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+	while (len--) {
+		crc = (uint8_t) (crc >> 8) | (crc << 8);
+		crc ^= *data++;
+		crc ^= (uint8_t) (crc & 0xff) >> 4;
+		crc ^= (crc << 8) << 4;
+		crc ^= ((crc & 0xff) << 4) << 1;
+	}
+	return crc;
+}
+
+static size_t frame_header_size(struct eub_link *link)
+{
+	if (!link->features)
+		return 0;
+	return (link->features & EUB_BRIDGE_FEAT_CRC) ? 2 : 1;
+}
+
+static size_t frame_trailer_size(struct eub_link *link)
+{
+	return (link->features & EUB_BRIDGE_FEAT_CRC) ? 2 : 0;
+}
+
+static int link_send(struct eub_link *link, uint8_t ctl, uint8_t seq,
+		     const uint8_t *data, size_t len, int64_t deadline)
+{
+	uint8_t *frame = link->frame;
+	size_t hdr = frame_header_size(link);
+
+	if (hdr)
+		frame[0] = ctl;
+	if (1 < hdr)
+		frame[1] = seq;
+	if (data != frame + hdr)
+		memmove(frame + hdr, data, len);
+	len += hdr;
+	if (link->features & EUB_BRIDGE_FEAT_CRC) {
+		uint16_t crc = crc16(EUB_BRIDGE_CRC16_INIT, frame, len);
+		frame[len++] = crc;
+		frame[len++] = crc >> 8;
+	}
+	size_t count = cobs_encode(frame, len, link->tx);
+	if (link->trace)
+		trace_record(link->trace, EUB_TRACE_TX, link->features,
+			     link->tx, count - 1);
+
+	// stream the frame out as fast as the UART takes it
+	size_t offset = 0;
+	while (offset < count) {
+		ssize_t ret = write(link->fd, link->tx + offset, count - offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN ||
+			    uart_wait(link->fd, POLLOUT, deadline) <= 0)
+				return -1;
 			continue;
 		}
 		offset += ret;
-		count -= ret;
-	} while (0 < count);
-
-	// receive the reply
-	size_t timeout = 0;
-	count = len + 2;
-	offset = 0;
-	uint8_t* tail;
-	do {
-		ssize_t ret = read(fd, buffer + offset, count);
-		if (ret <= 0) {
-			if (UART_TIMEOUT < ++timeout)
-				break;
-			usleep(UART_DELAY);
+	}
+	link->tx_bytes += count;
+	return 0;
+}
+
+/*
+ * Receive the next frame into link->frame, decoding it as the bytes come
+ * in. Returns the length of the frame payload and stores its header in
+ * *frame_hdr. Returns LINK_TIMEOUT if no frame arrives by the deadline
+ * and LINK_CORRUPT if a frame arrives damaged; the damaged frame alone is
+ * consumed. Snapshots pushed by the firmware go to link->push on the way.
+ */
+static ssize_t link_recv(struct eub_link *link,
+			 struct eub_frame_hdr *frame_hdr, int64_t deadline)
+{
+	size_t hdr = frame_header_size(link);
+	size_t trailer = frame_trailer_size(link);
+	size_t scanned = 0;
+
+	for (;;) {
+		uint8_t *tail = memchr(link->rx + scanned, 0,
+				       link->rx_count - scanned);
+		if (tail) {
+			size_t count = tail - link->rx;
+			if (link->trace)
+				trace_record(link->trace, EUB_TRACE_RX,
+					     link->features, link->rx, count);
+			size_t len = cobs_decode(link->rx, count);
+			if (len)
+				memcpy(link->frame, link->rx, len);
+			link->rx_count -= count + 1;
+			memmove(link->rx, tail + 1, link->rx_count);
+			link->frame_start_us = link->rx_start_us;
+			if (link->rx_count)
+				link->rx_start_us = now_us();
+			if (len == 0 || len < hdr + trailer)
+				return LINK_CORRUPT;
+			if (trailer) {
+				uint16_t crc;
+				len -= trailer;
+				crc = link->frame[len] |
+				      (link->frame[len + 1] << 8);
+				if (crc != crc16(EUB_BRIDGE_CRC16_INIT,
+						 link->frame, len))
+					return LINK_CORRUPT;
+			}
+			frame_hdr->ctl = hdr ? link->frame[0] : 0;
+			frame_hdr->seq = (1 < hdr) ? link->frame[1] : 0;
+			if ((link->features & EUB_BRIDGE_FEAT_PUSH) &&
+			    frame_hdr->ctl == EUB_FRAME_PUSH) {
+				++link->pushes;
+				if (link->push)
+					link->push(link->push_ctx,
+						   frame_hdr->seq,
+						   link->frame + hdr,
+						   len - hdr);
+				scanned = 0;
+				continue;
+			}
+			if (hdr)
+				memmove(link->frame, link->frame + hdr,
+					len - hdr);
+			return len - hdr;
+		}
+		scanned = link->rx_count;
+		if (link->rx_count == sizeof link->rx) {
+			link->rx_count = 0;
+			return LINK_CORRUPT;
+		}
+		if (uart_wait(link->fd, POLLIN, deadline) != 1)
+			return LINK_TIMEOUT;
+		ssize_t ret = read(link->fd, link->rx + link->rx_count,
+				   sizeof link->rx - link->rx_count);
+		if (ret < 0 && errno != EAGAIN && errno != EINTR)
+			return LINK_TIMEOUT;
+		if (0 < ret) {
+			if (!link->rx_count)
+				link->rx_start_us = now_us();
+			link->rx_count += ret;
+			link->rx_bytes += ret;
+		}
+	}
+}
+
+/* The time the frame in slot and its reply take on the UART and I2C bus */
+static int64_t link_wire_us(struct eub_link *link, struct eub_slot *slot)
+{
+	size_t len = slot->len;
+	size_t reply_len = slot->reply_len;
+
+	return (int64_t) (COBS_SIZE(len + 4) + COBS_SIZE(reply_len + 4)) *
+	       10 * 1000000 / link->baudrate +
+	       ((len < reply_len) ? reply_len : len) * I2C_BYTE_TIME;
+}
+
+/*
+ * The time the firmware may take on a frame beyond link_wire_us(): its
+ * smoothed service time plus four mean deviations, as TCP times its
+ * retransmissions, and some slack for the scheduler.
+ */
+static int64_t link_slack_us(struct eub_link *link)
+{
+	return link->service_us + 4 * link->service_dev_us + TIMEOUT_FLOOR;
+}
+
+/*
+ * How long to wait for the reply to the frame in slot before sending it
+ * again, doubled for each time it has been sent again already. Without
+ * CRC a frame cannot be sent again, and a late reply could be taken for
+ * the next frame's, so the reply gets UART_TIMEOUT.
+ */
+static int64_t link_timeout(struct eub_link *link, struct eub_slot *slot,
+			    int retries)
+{
+	if (!(link->features & EUB_BRIDGE_FEAT_CRC))
+		return UART_TIMEOUT;
+	int64_t us = (link_wire_us(link, slot) + link_slack_us(link)) <<
+		     retries;
+	int64_t ms = (us + 999) / 1000;
+	return (ms < UART_TIMEOUT) ? ms : UART_TIMEOUT;
+}
+
+/*
+ * Fold the time the firmware took to answer the frame in slot, up to now,
+ * into the estimate of its service time. A frame sent again gives no
+ * sample, as it is unknown which attempt the reply belongs to, and a frame
+ * queued behind another is timed from that one's reply on.
+ */
+static void link_measure(struct eub_link *link, struct eub_slot *slot,
+			 int64_t now)
+{
+	int64_t start = slot->sent_us;
+
+	if (start < link->replied_us)
+		start = link->replied_us;
+	link->replied_us = now;
+	if (slot->attempts != 1)
+		return;
+	int64_t sample = now - start - link_wire_us(link, slot);
+	if (sample < 0)
+		sample = 0;
+	int64_t err = sample - link->service_us;
+	link->service_us += err / 8;
+	link->service_dev_us += ((err < 0) ? -err : err) / 4 -
+				link->service_dev_us / 4;
+}
+
+/*
+ * Returns how long the link takes at most to answer a transfer once it
+ * has it: a full window of frames ahead of it, and two attempts at its
+ * own frame, the second with twice the timeout, each frame taking
+ * base_us plus byte_ns for every byte of the transfer and its reply. The
+ * bytes also pay for the frames a large transfer is split into.
+ */
+void link_answer_timeout(struct eub_link *link, uint32_t *base_us,
+			 uint32_t *byte_ns)
+{
+	unsigned int frames = link->window + 2;
+	int64_t slack = link_slack_us(link);
+
+	*base_us = frames * slack;
+	*byte_ns = frames * (10 * 1000000000LL / link->baudrate +
+			     I2C_BYTE_TIME * 1000 +
+			     slack * 1000 / link->max_frame);
+}
+
+/* Returns the frame in flight with sequence number seq, or any if -1. */
+static struct eub_slot *link_find(struct eub_link *link, int seq)
+{
+	int i;
+
+	// without CRC there is no sequence number, and one frame in flight
+	if (!(link->features & EUB_BRIDGE_FEAT_CRC))
+		seq = -1;
+	for (i = 0; i < LINK_WINDOW; ++i) {
+		struct eub_slot *slot = &link->slots[i];
+		if (slot->used && (seq < 0 || slot->seq == seq))
+			return slot;
+	}
+	return NULL;
+}
+
+/* Send the frame held by slot, which is then the last one sent. */
+static int link_send_slot(struct eub_link *link, struct eub_slot *slot)
+{
+	int64_t start = now_us();
+	int ret;
+
+	slot->deadline = start / 1000 + link_timeout(link, slot,
+						     slot->attempts);
+	slot->order = ++link->sent;
+	ret = link_send(link, slot->ctl, slot->seq, slot->buf, slot->len,
+			slot->deadline);
+	int64_t end = now_us();
+	if (!slot->attempts++)
+		slot->sent_us = end;
+	slot->tx_us += end - start;
+	return ret;
+}
+
+/*
+ * The firmware has answered the frame in slot. It runs frames in the
+ * order they arrive, so the frames sent before it which are still waiting
+ * for their replies were damaged on the way, or their replies were, and
+ * are due for sending again. Those sent after it have made progress and
+ * get their full timeout from now.
+ */
+static void link_progress(struct eub_link *link, struct eub_slot *slot)
+{
+	int64_t now = now_ms();
+	int i;
+
+	for (i = 0; i < LINK_WINDOW; ++i) {
+		struct eub_slot *other = &link->slots[i];
+		if (!other->used || other == slot)
 			continue;
+		if (other->order < slot->order) {
+			other->deadline = now;
+		} else {
+			int retries = other->attempts - 1;
+			int64_t deadline = now + link_timeout(link, other,
+							      retries);
+			if (other->deadline < deadline)
+				other->deadline = deadline;
 		}
-		tail = memchr(buffer + offset, 0, ret);
-		offset += ret;
-		count -= ret;
-		// Check zero in buffer, which indicates an error.
-		if (tail)
+	}
+}
+
+/*
+ * Send the frame held by slot once more, which only CRC makes safe.
+ * Returns -1 if the frame has had its chance.
+ */
+static int link_retry(struct eub_link *link, struct eub_slot *slot)
+{
+	if (!(link->features & EUB_BRIDGE_FEAT_CRC) || 2 <= slot->attempts)
+		return -1;
+	++link->retransmits;
+	return link_send_slot(link, slot);
+}
+
+/*
+ * Free slot, recording its timing in link->timing; rx_start is when its
+ * reply began to arrive, or 0 if none did.
+ */
+static int link_release(struct eub_link *link, struct eub_slot *slot,
+			uint32_t *tag, int ret, int64_t rx_start)
+{
+	int64_t now = now_us();
+
+	if (!rx_start || rx_start < slot->sent_us)
+		rx_start = now;
+	link->timing.tx = slot->tx_us;
+	link->timing.wait = rx_start - slot->sent_us;
+	link->timing.rx = now - rx_start;
+	*tag = slot->tag;
+	slot->used = 0;
+	--link->inflight;
+	return ret;
+}
+
+static int link_submit_frame(struct eub_link *link, uint8_t ctl,
+			     uint32_t tag, uint8_t *buf, size_t len,
+			     size_t reply_len)
+{
+	struct eub_slot *slot = NULL;
+	int i;
+
+	if (link->window <= link->inflight || link->max_frame < len ||
+	    link->max_frame < reply_len)
+		return -1;
+	for (i = 0; i < LINK_WINDOW; ++i) {
+		if (!link->slots[i].used) {
+			slot = &link->slots[i];
 			break;
-	} while (0 < count);
+		}
+	}
+	slot->used = 1;
+	slot->tag = tag;
+	slot->ctl = ctl;
+	slot->seq = ++link->seq;
+	slot->attempts = 0;
+	slot->tx_us = 0;
+	slot->buf = buf;
+	slot->len = len;
+	slot->reply_len = reply_len;
+	++link->inflight;
+	if (link_send_slot(link, slot) < 0) {
+		slot->used = 0;
+		--link->inflight;
+		return -1;
+	}
+	return 0;
+}
 
-	if (tail == end) {
-		// unstuff data
-		for (p = buffer; p < end; p += c) {
-			c = *p;
-			if (c == 0)
+/*
+ * Returns the size of the reply payload to the packed transfer at buf in
+ * one frame, or -1 if the transfer is malformed: the transfer itself, or
+ * with SPLIT, the status byte and the data of the read messages, or the
+ * most an SMBus op answers with.
+ */
+static ssize_t link_reply_size(struct eub_link *link, uint8_t *buf,
+			       size_t len)
+{
+	int format = link_format(link);
+	uint8_t *p = buf;
+	uint8_t *end = buf + len;
+	size_t reply_len = 1;
+	struct i2c_smbus_op op;
+
+	if (!(format & EUB_I2C_FORMAT_SPLIT))
+		return len;
+	switch (i2c_unpack_op(buf, len, format, &op)) {
+	case 1:
+		return 1 + i2c_op_reply_size(op.op);
+	case -1:
+		return -1;
+	}
+	while (p < end) {
+		struct i2c_packed_msg msg;
+		uint8_t *data = i2c_unpack_msg(p, end, format, &msg);
+		if (!data)
+			return -1;
+		if (msg.flags & I2C_M_RD)
+			reply_len += msg.len;
+		p = data + i2c_msg_data_size(format, &msg);
+	}
+	return reply_len;
+}
+
+/* Returns whether the packed transfer at buf goes in one frame each way. */
+int link_fits(struct eub_link *link, uint8_t *buf, size_t len)
+{
+	ssize_t reply_len = link_reply_size(link, buf, len);
+
+	return len <= link->max_frame && 0 <= reply_len &&
+	       reply_len <= link->max_frame;
+}
+
+/*
+ * Send the packed transfer at buf as one frame without waiting for the
+ * reply, which link_reap() returns along with tag. Fails if the window is
+ * full or the transfer does not fit in a frame. buf must stay valid until
+ * then, and with SPLIT, have room for the data of the read messages.
+ */
+int link_submit(struct eub_link *link, uint32_t tag, uint8_t *buf,
+		size_t len)
+{
+	ssize_t reply_len = link_reply_size(link, buf, len);
+
+	if (reply_len < 0)
+		return -1;
+	return link_submit_frame(link, 0, tag, buf, len, reply_len);
+}
+
+/*
+ * Returns whether the len bytes at data answer an SMBus block read in slot,
+ * which answers with as many bytes as its count says.
+ */
+static int link_block_answer(struct eub_link *link, struct eub_slot *slot,
+			     const uint8_t *data, size_t len)
+{
+	struct i2c_smbus_op op;
+
+	return i2c_unpack_op(slot->buf, slot->len, link_format(link),
+			     &op) == 1 &&
+	       op.op == EUB_I2C_SMBUS_READ_BLOCK_DATA && 1 <= len &&
+	       data[0] <= EUB_I2C_SMBUS_BLOCK_MAX && len == 1u + data[0];
+}
+
+/*
+ * Check the reply to the frame in slot, now in link->frame, and store its
+ * data in the caller's buffer: the whole transfer, or with SPLIT, the data
+ * of the read messages. Returns the length stored, LINK_NAK if the
+ * firmware reports a device that did not acknowledge, or -1 if the frame
+ * failed.
+ */
+static ssize_t link_complete(struct eub_link *link, struct eub_slot *slot,
+			     uint8_t ctl, size_t len)
+{
+	uint8_t *data = link->frame;
+
+	if (ctl != slot->ctl)
+		return -1;
+	if (link->features & EUB_BRIDGE_FEAT_SPLIT) {
+		if (len < 1)
+			return -1;
+		if (data[0] != EUB_BRIDGE_STATUS_OK)
+			return (data[0] == EUB_BRIDGE_STATUS_NAK) ? LINK_NAK : -1;
+		++data;
+		--len;
+		if (len != slot->reply_len - 1 &&
+		    !link_block_answer(link, slot, data, len))
+			return -1;
+	} else if (len != slot->len) {
+		return -1;
+	}
+	memcpy(slot->buf, data, len);
+	return len;
+}
+
+/*
+ * Wait up to timeout milliseconds, or forever if timeout is negative, for
+ * a frame in flight to complete. Stores its tag and returns the length of
+ * the reply data that has replaced the buffer passed to link_submit(), see
+ * link_complete(), or LINK_NAK or -1 if the frame failed. Returns
+ * LINK_TIMEOUT if nothing completes in time or nothing is in flight.
+ *
+ * With EUB_BRIDGE_FEAT_CRC, a damaged or missing reply, or a NAK for a
+ * damaged request, makes the host send the same frame once more. The
+ * firmware recognizes the repeated sequence number and replays its reply
+ * instead of running the I2C messages again. Stale replies carrying an
+ * older sequence number are skipped. A NAK whose sequence number matches
+ * no frame is taken for the frame in flight if there is only one.
+ */
+int link_reap(struct eub_link *link, uint32_t *tag, int timeout)
+{
+	int crc = link->features & EUB_BRIDGE_FEAT_CRC;
+	int64_t deadline = (timeout < 0) ? INT64_MAX : now_ms() + timeout;
+	struct eub_frame_hdr reply;
+	struct eub_slot *slot;
+	int i;
+
+	while (link->inflight) {
+		int64_t now = now_ms();
+		int64_t wake = deadline;
+		for (i = 0; i < LINK_WINDOW; ++i) {
+			slot = &link->slots[i];
+			if (!slot->used)
+				continue;
+			if (slot->deadline <= now) {
+				++link->timeouts;
+				if (link_retry(link, slot) < 0)
+					return link_release(link, slot, tag,
+							    -1, 0);
+			}
+			if (slot->deadline < wake)
+				wake = slot->deadline;
+		}
+
+		ssize_t ret = link_recv(link, &reply, wake);
+		if (ret == LINK_TIMEOUT) {
+			if (deadline <= now_ms())
+				break;
+			continue;
+		}
+		if (ret == LINK_CORRUPT) {
+			++link->corrupt;
+			if (crc)
+				continue;
+			slot = link_find(link, -1);
+			return link_release(link, slot, tag, -1, 0);
+		}
+		slot = link_find(link, reply.seq);
+		if (!slot && (reply.ctl & EUB_FRAME_NAK) && link->inflight == 1)
+			slot = link_find(link, -1);
+		if (!slot)
+			continue;
+		if (reply.ctl & EUB_FRAME_NAK) {
+			if (link_retry(link, slot) < 0)
+				return link_release(link, slot, tag, -1, 0);
+			continue;
+		}
+		link_measure(link, slot, now_us());
+		link_progress(link, slot);
+		return link_release(link, slot, tag,
+				    link_complete(link, slot, reply.ctl, ret),
+				    link->frame_start_us);
+	}
+	return LINK_TIMEOUT;
+}
+
+/*
+ * Returns how many milliseconds poll() may sleep before link_reap() has
+ * to send a frame again, or -1 if nothing is in flight.
+ */
+int link_poll_timeout(struct eub_link *link)
+{
+	int64_t now = now_ms();
+	int64_t timeout = INT_MAX;
+	int i;
+
+	if (!link->inflight)
+		return -1;
+	for (i = 0; i < LINK_WINDOW; ++i) {
+		struct eub_slot *slot = &link->slots[i];
+		if (slot->used && slot->deadline - now < timeout)
+			timeout = slot->deadline - now;
+	}
+	return (timeout < 0) ? 0 : (int) timeout;
+}
+
+/*
+ * Send len bytes at data as one frame and wait for the reply, whose data
+ * replaces data. Returns its length, or LINK_NAK or -1 on failure. Nothing
+ * else may be in flight.
+ */
+static int link_exchange(struct eub_link *link, uint8_t ctl, uint8_t *data,
+			 size_t len, size_t reply_len)
+{
+	uint32_t tag;
+	int ret;
+
+	if (link_submit_frame(link, ctl, 0, data, len, reply_len) < 0)
+		return -1;
+	ret = link_reap(link, &tag, -1);
+	return (ret < 0 && ret != LINK_NAK) ? -1 : ret;
+}
+
+/* Scratch space of link_xfer_fragments(), allocated on first use */
+struct eub_frag_piece {
+	uint8_t *dst;
+	size_t offset;		/* of the data in the reply */
+	uint16_t len;
+};
+
+struct eub_frags {
+	uint8_t frag[LEN_BUFFER];
+	uint8_t out[LEN_BUFFER];
+	struct eub_frag_piece pieces[LEN_BUFFER / 2 + 1];
+};
+
+/*
+ * Split the packed transfer at buf into frames of at most limit bytes each
+ * way and exchange them one by one. A message that does not fit in the
+ * rest of a frame is continued in the next frame with I2C_M_NOSTART.
+ * Returns the length of the reply data now in buf, as link_xfer() does.
+ */
+static int link_xfer_fragments(struct eub_link *link, uint8_t *buf,
+			       size_t len, size_t limit)
+{
+	if (!link->frags) {
+		link->frags = malloc(sizeof *link->frags);
+		if (!link->frags)
+			return -1;
+	}
+	uint8_t *frag = link->frags->frag;
+	uint8_t *out = link->frags->out;
+	struct eub_frag_piece *pieces = link->frags->pieces;
+	int format = link_format(link);
+	int split = format & EUB_I2C_FORMAT_SPLIT;
+	uint8_t *p = buf;
+	uint8_t *end = buf + len;
+	size_t out_len = 0;	// read data collected with SPLIT
+	size_t done = 0;	// bytes of the current message already sent
+	struct eub_timing timing = { 0 };
+
+	while (p < end) {
+		uint8_t *q = frag;
+		size_t reply_len = split ? 1 : 0;
+		int n = 0;
+
+		while (p < end) {
+			struct i2c_packed_msg msg;
+			uint8_t *data = i2c_unpack_msg(p, end, format, &msg);
+			if (!data)
+				return -1;
+			int rd = msg.flags & I2C_M_RD;
+			uint16_t flags = msg.flags;
+			if (done)
+				flags |= I2C_M_NOSTART;
+			size_t hdr = i2c_msg_hdr_size(format, msg.addr, flags,
+						      msg.len - done);
+			size_t room = limit - (q - frag);
+			if (room < hdr)
 				break;
-			*p = 0;
+			// with SPLIT, read data takes room in the reply only
+			size_t chunk = msg.len - done;
+			size_t cap = (split && rd) ? limit - reply_len
+						   : room - hdr;
+			if (cap < chunk)
+				chunk = cap;
+			if (chunk == 0 && done < msg.len)
+				break;
+			q = i2c_pack_msg(q, format, msg.addr, flags, chunk,
+					 data + done);
+			if (rd) {
+				pieces[n].dst = split ? out + out_len
+						      : data + done;
+				pieces[n].offset = split ? reply_len - 1
+							 : q - chunk - frag;
+				pieces[n].len = chunk;
+				++n;
+				if (split) {
+					reply_len += chunk;
+					out_len += chunk;
+				}
+			}
+			done += chunk;
+			if (done < msg.len)
+				break;
+			p = data + i2c_msg_data_size(format, &msg);
+			done = 0;
 		}
-		if (p == end) {
+		if (q == frag)
+			return -1;
+
+		uint8_t ctl = (p < end) ? EUB_FRAME_MORE : 0;
+		if (!split)
+			reply_len = q - frag;
+		int ret = link_exchange(link, ctl, frag, q - frag, reply_len);
+		timing.tx += link->timing.tx;
+		timing.wait += link->timing.wait;
+		timing.rx += link->timing.rx;
+		link->timing = timing;
+		if (ret < 0)
+			return ret;
+		for (int i = 0; i < n; ++i)
+			memcpy(pieces[i].dst, frag + pieces[i].offset,
+			       pieces[i].len);
+	}
+	if (!split)
+		return len;
+	memcpy(buf, out, out_len);
+	return out_len;
+}
+
+/* Returns the EUB_I2C_FORMAT_* flags messages use with the features. */
+int bridge_format(uint16_t features)
+{
+	int format = EUB_I2C_FORMAT_RAW;
+
+	if (features & EUB_BRIDGE_FEAT_COMPACT)
+		format |= EUB_I2C_FORMAT_COMPACT;
+	if (features & EUB_BRIDGE_FEAT_SPLIT)
+		format |= EUB_I2C_FORMAT_SPLIT;
+	if (features & EUB_BRIDGE_FEAT_SMBUS)
+		format |= EUB_I2C_FORMAT_SMBUS;
+	return format;
+}
+
+/* Returns the EUB_I2C_FORMAT_* flags messages use on this link. */
+int link_format(struct eub_link *link)
+{
+	return bridge_format(link->features);
+}
+
+/*
+ * Run the packed transfer at buf over the bridge, replacing the data of
+ * read messages with what the I2C devices returned. With SPLIT, buf ends
+ * up holding nothing but the read data, and needs room for it. Returns the
+ * length of the data in buf, LINK_NAK if an I2C device did not
+ * acknowledge, or -1 on failure.
+ */
+int link_xfer(struct eub_link *link, uint8_t *buf, size_t len)
+{
+	size_t limit = link->max_frame;
+	int ret;
+
+	if (link_fits(link, buf, len)) {
+		ret = link_exchange(link, 0, buf, len,
+				    link_reply_size(link, buf, len));
+	} else if (link->features & EUB_BRIDGE_FEAT_FRAG) {
+		ret = link_xfer_fragments(link, buf, len, limit);
+	} else {
+		fprintf(stderr, "%s: %zu byte transfer exceeds %zu bytes\n",
+			__func__, len, limit);
+		return -1;
+	}
+	if (ret < 0 && ret != LINK_NAK) {
+		printf("%s: out of sync\n", __func__);
+		link_sync(link);
+	}
+	return ret;
+}
+
+/*
+ * Take in the frames that have arrived while nothing is in flight: the
+ * snapshots the firmware pushes, and stray replies, which are dropped.
+ */
+void link_drain(struct eub_link *link)
+{
+	struct eub_frame_hdr hdr;
+	ssize_t ret;
+
+	while ((ret = link_recv(link, &hdr, 0)) != LINK_TIMEOUT) {
+		if (ret == LINK_CORRUPT)
+			++link->corrupt;
+	}
+}
+
+void link_sync(struct eub_link *link)
+{
+	struct eub_frame_hdr hdr;
+
+	++link->resyncs;
+	if (link->features & EUB_BRIDGE_FEAT_PUSH) {
+		// snapshots may never leave the line quiet; drop replies
+		// until none has come for UART_QUIET, and let CRC catch the
+		// rest of a frame cut off before
+		while (link_recv(link, &hdr, now_ms() + UART_QUIET) !=
+		       LINK_TIMEOUT)
+			;
+		return;
+	}
+	// discard everything until the line has been quiet for UART_QUIET
+	while (uart_wait(link->fd, POLLIN, now_ms() + UART_QUIET) == 1) {
+		if (read(link->fd, link->rx, sizeof link->rx) < 0 &&
+		    errno != EAGAIN && errno != EINTR)
+			break;
+	}
+	link->rx_count = 0;
+}
+
+/*
+ * Use fd as a link in whatever state eub_i2cattach left it, with the
+ * framing every firmware understands.
+ */
+void link_attach(struct eub_link *link, int fd)
+{
+	link->fd = fd;
+	link->trace = NULL;
+	link->frags = NULL;
+	link->push = NULL;
+	link->push_ctx = NULL;
+	link->service_us = 0;
+	link->service_dev_us = RETRY_SLACK * 1000 / 4;
+	link->replied_us = 0;
+	link->baudrate = BAUDRATE;
+	link->features = 0;
+	link->max_frame = LEN_LEGACY;
+	link->window = 1;
+	link->inflight = 0;
+	memset(link->slots, 0, sizeof link->slots);
+	link->rx_count = 0;
+}
+
+int link_open(struct eub_link *link, const char *path,
+	      unsigned int baudrate, int rtscts, uint16_t features)
+{
+	int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	// the UART has one owner at a time; see eub_i2cpoweroff
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "%s: %s\n", path, (errno == EWOULDBLOCK) ?
+			"in use by another program" : strerror(errno));
+		close(fd);
+		return -1;
+	}
+	link_attach(link, fd);
+	if (bridge_negotiate(link, baudrate, rtscts, features) < 0) {
+		close(fd);
+		return -1;
+	}
+	// leave the negotiation out of the counters
+	link->sent = link->retransmits = link->timeouts = link->corrupt = 0;
+	link->resyncs = link->pushes = 0;
+	link->tx_bytes = link->rx_bytes = 0;
+	return 0;
+}
+
+/*
+ * Return the firmware to the legacy framing so that programs using
+ * link_attach() can talk to it, and close the link.
+ */
+void link_close(struct eub_link *link)
+{
+	uint8_t cmd[3] = { EUB_BRIDGE_CMD_MODE, 0, 0 };
+	uint8_t status;
+
+	if (link->features &&
+	    bridge_command(link, cmd, sizeof cmd, &status, 1) == 0 &&
+	    status == 0)
+		link->features = 0;
+	close(link->fd);
+	link->fd = -1;
+	free(link->frags);
+	link->frags = NULL;
+}
+
+int bridge_command(struct eub_link *link, const uint8_t *cmd,
+		   uint16_t cmd_len, uint8_t *reply, uint16_t reply_len)
+{
+	uint8_t buffer[LEN_LEGACY];
+	uint8_t *p = buffer;
+	int format = link_format(link);
+
+	if (LEN_LEGACY < 2 * I2C_MSG_HDR_SIZE + cmd_len + reply_len)
+		return -1;
+	p = i2c_pack_msg(p, format, EUB_BRIDGE_ADDR, 0, cmd_len, cmd);
+	p = i2c_pack_msg(p, format, EUB_BRIDGE_ADDR, I2C_M_RD, reply_len,
+			 NULL);
+	if (link_exchange(link, 0, buffer, p - buffer,
+			  link_reply_size(link, buffer, p - buffer)) < 0) {
+		link_sync(link);
+		return -1;
+	}
+	// with SPLIT, the reply holds the read data alone
+	memcpy(reply, (format & EUB_I2C_FORMAT_SPLIT) ? buffer : p - reply_len,
+	       reply_len);
+	return 0;
+}
+
+int bridge_hello(struct eub_link *link, struct eub_bridge_hello *hello)
+{
+	uint8_t cmd = EUB_BRIDGE_CMD_HELLO;
+
+	if (bridge_command(link, &cmd, 1, (uint8_t *) hello,
+			   sizeof *hello) < 0)
+		return -1;
+	if (hello->magic[0] != EUB_BRIDGE_MAGIC0 ||
+	    hello->magic[1] != EUB_BRIDGE_MAGIC1 || hello->version == 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Ask the firmware for its HELLO until two replies in a row agree. The
+ * control frames go without CRC before MODE, so a single reply that
+ * looks right may still have been damaged on the line, and a single
+ * one that does not may only have been lost.
+ */
+static int bridge_probe(struct eub_link *link, struct eub_bridge_hello *hello)
+{
+	struct eub_bridge_hello again;
+	int i;
+
+	for (i = 0; i < BRIDGE_TRIES; ++i) {
+		if (bridge_hello(link, hello) == 0 &&
+		    bridge_hello(link, &again) == 0 &&
+		    memcmp(hello, &again, sizeof again) == 0)
 			return 0;
+	}
+	return -1;
+}
+
+/*
+ * Switch both sides to baudrate and check the link with HELLO there. The
+ * BAUD exchange has no CRC, so a failed exchange, check or even refusal
+ * is tried again at the same rate before moving on to the next one.
+ */
+static int bridge_try_baud(struct eub_link *link, unsigned int baudrate,
+			   int rtscts, const struct eub_bridge_hello *hello)
+{
+	struct eub_bridge_hello check;
+	uint8_t cmd[6];
+	uint32_t rate = baudrate;
+	uint8_t status;
+	int i;
+
+	cmd[0] = EUB_BRIDGE_CMD_BAUD;
+	memcpy(cmd + 1, &rate, sizeof rate);
+	cmd[5] = rtscts ? EUB_BRIDGE_BAUD_RTSCTS : 0;
+	for (i = 0; i < BRIDGE_TRIES; ++i) {
+		if (bridge_command(link, cmd, sizeof cmd, &status, 1) == 0) {
+			if (status != 0)
+				continue;
+
+			// the firmware switches once the acknowledgement
+			// has been sent
+			tcdrain(link->fd);
+			if (uart_configure(link->fd, baudrate, rtscts) == 0 &&
+			    bridge_probe(link, &check) == 0 &&
+			    memcmp(&check, hello, sizeof check) == 0) {
+				link->baudrate = baudrate;
+				return 0;
+			}
 		}
+
+		// let the firmware time out and return to the default rate
+		uart_configure(link->fd, BAUDRATE, 0);
+		usleep(EUB_BRIDGE_BAUD_GRACE * 2 * 1000);
+		link_sync(link);
 	}
+	return -1;
+}
+
+/*
+ * Enable the framing features, and check with a HELLO in the new framing,
+ * under CRC if it is among them, that both sides made the switch. If the
+ * acknowledgement or the check was lost, a HELLO in the legacy framing
+ * returns the firmware to it, whichever framing it was left in.
+ */
+static int bridge_set_mode(struct eub_link *link, uint16_t features)
+{
+	struct eub_bridge_hello hello;
+	uint8_t cmd[3];
+	uint8_t status;
 
-	printf("%s: out of sync\n", __func__);
-	i2c_sync(fd);
+	cmd[0] = EUB_BRIDGE_CMD_MODE;
+	memcpy(cmd + 1, &features, sizeof features);
+	if (bridge_command(link, cmd, sizeof cmd, &status, 1) == 0) {
+		if (status != 0)
+			return -1;
+		link->features = features;
+		if (bridge_hello(link, &hello) == 0 ||
+		    bridge_hello(link, &hello) == 0)
+			return 0;
+		link->features = 0;
+	}
+	bridge_hello(link, &hello);
+	link_sync(link);
 	return -1;
 }
 
-void i2c_sync(int fd)
+/*
+ * Have the firmware push count registers of the device at addr from reg
+ * on every period_ms milliseconds as subscription id, or end the
+ * subscription if period_ms is 0. Returns 0, or -1 if the firmware does
+ * not take it.
+ */
+int bridge_subscribe(struct eub_link *link, uint8_t id, uint8_t addr,
+		     uint8_t reg, uint8_t count, uint16_t period_ms)
+{
+	uint8_t cmd[7] = { EUB_BRIDGE_CMD_SUBSCRIBE, id, addr, reg, count };
+	uint8_t status;
+
+	if (!(link->features & EUB_BRIDGE_FEAT_PUSH))
+		return -1;
+	memcpy(cmd + 5, &period_ms, sizeof period_ms);
+	if (bridge_command(link, cmd, sizeof cmd, &status, 1) < 0 ||
+	    status != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Switch the link to the highest rate not above baudrate that both the
+ * board firmware and the local UART accept, and enable the framing
+ * features both sides support. Firmware that does not speak the bridge
+ * control protocol stays at BAUDRATE with the legacy framing. Only the
+ * framing features in the features mask are considered; PIPELINE also
+ * needs CRC, and SMBUS both COMPACT and SPLIT. If neither a higher rate
+ * nor any feature is asked for, the firmware is not probed at all, so
+ * firmware without bridge control never sees a control frame. Returns
+ * the rate in use.
+ */
+int bridge_negotiate(struct eub_link *link, unsigned int baudrate,
+		     int rtscts, uint16_t features)
+{
+	struct eub_bridge_hello hello;
+	int i;
+
+	link->features = 0;
+	link->max_frame = LEN_LEGACY;
+	link->window = 1;
+	if (uart_configure(link->fd, BAUDRATE, 0) < 0)
+		return -1;
+	link->baudrate = BAUDRATE;
+	link_sync(link);
+
+	features &= EUB_BRIDGE_FEAT_ALL;
+	if (baudrate <= BAUDRATE && !features)
+		return BAUDRATE;
+
+	// the first attempt resets firmware left at another rate or framing
+	if (bridge_probe(link, &hello) < 0) {
+		fprintf(stderr, "%s: no bridge control support; using %u\n",
+			__func__, BAUDRATE);
+		return BAUDRATE;
+	}
+
+	if (BAUDRATE < baudrate) {
+		for (i = NUM_SPEEDS - 1; 0 <= i; --i) {
+			if (baudrate < speeds[i].rate ||
+			    speeds[i].rate <= BAUDRATE)
+				continue;
+			if (bridge_try_baud(link, speeds[i].rate, rtscts,
+					    &hello) == 0)
+				break;
+		}
+		if (i < 0)
+			fprintf(stderr, "%s: falling back to %u\n", __func__,
+				BAUDRATE);
+	}
+
+	features &= hello.features;
+	if (!(features & EUB_BRIDGE_FEAT_CRC) || hello.window < 2)
+		features &= ~EUB_BRIDGE_FEAT_PIPELINE;
+	if (!(features & EUB_BRIDGE_FEAT_CRC))
+		features &= ~EUB_BRIDGE_FEAT_PUSH;
+	if (~features & (EUB_BRIDGE_FEAT_COMPACT | EUB_BRIDGE_FEAT_SPLIT))
+		features &= ~EUB_BRIDGE_FEAT_SMBUS;
+	for (i = 0; features && i < BRIDGE_TRIES; ++i) {
+		if (bridge_set_mode(link, features) == 0)
+			break;
+	}
+	if (features && i < BRIDGE_TRIES) {
+		// leave room for the frame control byte
+		link->max_frame = hello.max_frame - frame_header_size(link) -
+				  frame_trailer_size(link);
+		if (features & EUB_BRIDGE_FEAT_PIPELINE)
+			link->window = (LINK_WINDOW < hello.window) ?
+				       LINK_WINDOW : hello.window;
+	} else if (LEN_LEGACY < hello.max_frame) {
+		link->max_frame = hello.max_frame;
+	}
+	return link->baudrate;
+}
+
+/* Touch the stack the process is going to need so that it is resident. */
+static void prefault_stack(void)
 {
-	usleep(UART_DELAY * LEN_BUFFER);
-	while (0 < read(fd, garbage, LEN_BUFFER)) {
-		usleep(UART_DELAY);
+	volatile uint8_t stack[PREFAULT_STACK];
+
+	for (size_t i = 0; i < sizeof stack; i += 4096)
+		stack[i] = 0;
+}
+
+/*
+ * Pin the calling process to cpu unless cpu is negative, and with a
+ * priority above zero, lock its memory, present and future, fault in its
+ * stack and keep the heap it frees, and run it under SCHED_FIFO at
+ * priority. Threads created afterwards inherit all of it, so call this
+ * once the buffers are allocated and before creating threads.
+ */
+int realtime_setup(int priority, int cpu)
+{
+	if (0 <= cpu) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof set, &set) < 0) {
+			perror("sched_setaffinity");
+			return -1;
+		}
+	}
+	if (priority <= 0)
+		return 0;
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("mlockall");
+		return -1;
 	}
+	prefault_stack();
+
+	struct sched_param param = { .sched_priority = priority };
+	if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+		perror("sched_setscheduler");
+		return -1;
+	}
+	return 0;
+}
+
+/* Connect to the client socket of eub_i2cattach at path, see eub_i2c.h. */
+int client_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (sizeof addr.sun_path <= strlen(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Run the transfer of len bytes at buf, packed in EUB_I2C_FORMAT_RAW,
+ * through the client socket fd, waiting up to timeout milliseconds for
+ * the answer, whose read data replaces that in buf. Returns 0, or a
+ * negative errno.
+ */
+int client_xfer(int fd, uint8_t *buf, size_t len, int timeout)
+{
+	static uint32_t next_id;
+	struct eub_i2c_proxy_hdr hdr = { .id = ++next_id, .len = len };
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof hdr },
+		{ .iov_base = buf, .iov_len = len },
+	};
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	uint32_t id = hdr.id;
+	ssize_t ret;
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+		return -errno;
+	do {
+		ret = uart_wait(fd, POLLIN, now_ms() + timeout);
+		if (ret <= 0)
+			return ret ? -EIO : -ETIMEDOUT;
+		ret = recvmsg(fd, &msg, 0);
+	} while (0 < ret && hdr.id != id);
+	if (ret < 0)
+		return -errno;
+	if (ret == 0 || (msg.msg_flags & MSG_TRUNC))
+		return -EPROTO;
+	if (hdr.status)
+		return hdr.status;
+	return ((size_t) ret == sizeof hdr + len) ? 0 : -EPROTO;
 }
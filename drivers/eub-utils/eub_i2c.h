@@ -18,10 +18,20 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <linux/eub_i2c.h>
 
-#define BAUDRATE	B115200
+#define BAUDRATE	EUB_BRIDGE_BAUDRATE
 
-#define LEN_BUFFER	32
+#define LEN_BUFFER	65536	/* largest packed transfer */
+#define LEN_LEGACY	EUB_BRIDGE_LEGACY_FRAME
+
+/* worst case size of a COBS encoded frame including the delimiter */
+#define COBS_SIZE(n)	((n) + (n) / 254 + 2)
+
+#define I2C_MSG_HDR_SIZE	6
 
 struct i2c_packed_msg {
 	uint16_t addr;		/* slave address			*/
@@ -31,5 +41,221 @@ struct i2c_packed_msg {
 */
 };
 
-int i2c_xfer(int fd, uint8_t *buffer, uint16_t len);
-void i2c_sync(int fd);
+/* an EUB_I2C_FORMAT_SMBUS op in place of a transfer */
+struct i2c_smbus_op {
+	uint8_t op;		/* EUB_I2C_SMBUS_* */
+	uint8_t addr;
+	uint8_t cmd;
+	uint8_t value;		/* for EUB_I2C_SMBUS_WRITE_BYTE_DATA */
+};
+
+struct eub_frame_hdr {
+	uint8_t ctl;
+	uint8_t seq;
+};
+
+/* link_recv() and link_reap() results besides lengths, 0 and -1 */
+#define LINK_TIMEOUT	(-2)
+#define LINK_CORRUPT	(-3)
+#define LINK_NAK	(-4)	/* an I2C device did not acknowledge */
+
+#define LINK_WINDOW	8	/* most frames the host keeps in flight */
+
+/*
+ * Frame traces
+ *
+ * With link->trace set, every frame the link sends or receives goes to a
+ * ring in a memory mapped file, encoded as on the line but without the
+ * delimiter, along with a CLOCK_MONOTONIC timestamp and the framing
+ * features in effect. The oldest frames make room for new ones.
+ */
+#define EUB_TRACE_MAGIC		"EUBTRACE"
+#define EUB_TRACE_VERSION	1
+
+#define EUB_TRACE_TX		0	/* host to firmware */
+#define EUB_TRACE_RX		1	/* firmware to host */
+#define EUB_TRACE_PAD		2	/* fills the end of the ring */
+
+struct eub_trace_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t data_offset;	/* of the ring in the file */
+	uint64_t size;		/* of the ring */
+	uint64_t head;		/* bytes ever written to the ring */
+	uint64_t tail;		/* where the oldest record starts */
+	uint64_t dropped;	/* frames too large for the ring */
+};
+
+/* followed by the frame, padded to 8 bytes */
+struct eub_trace_rec {
+	int64_t time_us;
+	uint32_t len;
+	uint8_t dir;		/* EUB_TRACE_* */
+	uint8_t reserved;
+	uint16_t features;	/* enabled framing features */
+};
+
+struct eub_trace {
+	struct eub_trace_hdr *hdr;
+	uint8_t *ring;
+	size_t map_size;
+};
+
+/* where the time of the last completed transfer went, in microseconds */
+struct eub_timing {
+	int64_t tx;		/* writing its frames to the UART */
+	int64_t wait;		/* until the reply started to arrive */
+	int64_t rx;		/* receiving the reply */
+};
+
+/* a frame waiting for its reply */
+struct eub_slot {
+	int used;
+	uint32_t tag;		/* the caller's name for the frame */
+	uint8_t ctl;
+	uint8_t seq;
+	int attempts;
+	unsigned long order;	/* when it was last sent */
+	int64_t sent_us;	/* when it was first written out */
+	int64_t tx_us;		/* time spent writing it out */
+	int64_t deadline;	/* send it again unless answered by then */
+	uint8_t *buf;		/* the caller's buffer, replaced by the reply */
+	size_t len;
+	size_t reply_len;	/* expected payload of the reply */
+};
+
+/* called for every snapshot the firmware pushes, see PUSH */
+typedef void eub_push_fn(void *ctx, uint8_t id, const uint8_t *data,
+			 size_t len);
+
+struct eub_link {
+	int fd;
+	struct eub_trace *trace;	/* or NULL */
+	struct eub_frags *frags;	/* for fragmented transfers */
+	eub_push_fn *push;		/* or NULL to drop snapshots */
+	void *push_ctx;
+	unsigned int baudrate;
+	uint16_t features;	/* enabled framing features */
+	uint16_t max_frame;	/* largest payload per frame */
+	unsigned int window;	/* frames allowed in flight */
+	uint8_t seq;
+
+	unsigned int inflight;
+	unsigned long sent;	/* frames sent so far */
+	struct eub_slot slots[LINK_WINDOW];
+
+	struct eub_timing timing;
+
+	/* what the firmware takes to answer a frame, see link_measure() */
+	int64_t service_us;
+	int64_t service_dev_us;
+	int64_t replied_us;	/* when the last reply arrived */
+
+	/* counted from link_open() on */
+	unsigned long retransmits;
+	unsigned long timeouts;
+	unsigned long corrupt;
+	unsigned long resyncs;
+	unsigned long pushes;		/* snapshots received */
+	unsigned long long tx_bytes;	/* on the line */
+	unsigned long long rx_bytes;
+
+	size_t rx_count;	/* encoded bytes collected in rx */
+	int64_t rx_start_us;	/* when the first of them arrived */
+	int64_t frame_start_us;	/* the same for the frame last received */
+	uint8_t frame[LEN_BUFFER + 1];
+	uint8_t tx[COBS_SIZE(LEN_BUFFER + 1)];
+	uint8_t rx[COBS_SIZE(LEN_BUFFER + 1)];
+};
+
+speed_t uart_speed(unsigned int baudrate);
+int uart_configure(int fd, unsigned int baudrate, int rtscts);
+size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst);
+size_t cobs_decode(uint8_t *buf, size_t len);
+uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len);
+size_t i2c_msg_hdr_size(int format, uint16_t addr, uint16_t flags,
+			uint16_t len);
+size_t i2c_msg_data_size(int format, const struct i2c_packed_msg *msg);
+uint8_t *i2c_pack_msg(uint8_t *p, int format, uint16_t addr,
+		      uint16_t flags, uint16_t len, const void *data);
+uint8_t *i2c_unpack_msg(uint8_t *p, const uint8_t *end, int format,
+			struct i2c_packed_msg *msg);
+int i2c_unpack_op(const uint8_t *p, size_t len, int format,
+		  struct i2c_smbus_op *op);
+size_t i2c_op_reply_size(int op);
+ssize_t i2c_repack(uint8_t *dst, size_t size, int dst_format,
+		   uint8_t *src, size_t len, int src_format);
+int i2c_fill_reads(uint8_t *buf, size_t len, int format,
+		   uint8_t *reply, size_t reply_len, int reply_format);
+
+void link_attach(struct eub_link *link, int fd);
+int link_open(struct eub_link *link, const char *path,
+	      unsigned int baudrate, int rtscts, uint16_t features);
+void link_close(struct eub_link *link);
+int link_format(struct eub_link *link);
+int bridge_format(uint16_t features);
+int link_fits(struct eub_link *link, uint8_t *buf, size_t len);
+int link_xfer(struct eub_link *link, uint8_t *buf, size_t len);
+int link_submit(struct eub_link *link, uint32_t tag, uint8_t *buf,
+		size_t len);
+int link_reap(struct eub_link *link, uint32_t *tag, int timeout);
+int link_poll_timeout(struct eub_link *link);
+void link_answer_timeout(struct eub_link *link, uint32_t *base_us,
+			 uint32_t *byte_ns);
+void link_sync(struct eub_link *link);
+void link_drain(struct eub_link *link);
+
+int bridge_command(struct eub_link *link, const uint8_t *cmd,
+		   uint16_t cmd_len, uint8_t *reply, uint16_t reply_len);
+int bridge_hello(struct eub_link *link, struct eub_bridge_hello *hello);
+int bridge_negotiate(struct eub_link *link, unsigned int baudrate,
+		     int rtscts, uint16_t features);
+int bridge_subscribe(struct eub_link *link, uint8_t id, uint8_t addr,
+		     uint8_t reg, uint8_t count, uint16_t period_ms);
+
+int realtime_setup(int priority, int cpu);
+
+/*
+ * Client socket
+ *
+ * eub_i2cattach listens on a SOCK_SEQPACKET UNIX socket, so that tools
+ * can run transfers over a bridge it serves without opening the UART
+ * themselves. A request is a packet holding struct eub_i2c_proxy_hdr
+ * followed by hdr.len bytes of messages packed in EUB_I2C_FORMAT_RAW, and
+ * the answer is the same header, with status 0 or a negative errno,
+ * followed by the messages with the data of read messages filled in, or
+ * by nothing if the transfer failed. A client has one request in flight
+ * at a time.
+ */
+#define EUB_SOCKET_PATH		"/run/eub_i2c.sock"
+
+int client_connect(const char *path);
+int client_xfer(int fd, uint8_t *buf, size_t len, int timeout);
+
+/*
+ * Transfer statistics, kept by eub_i2cattach in histograms by phase and
+ * I2C address
+ */
+enum {
+	PHASE_HANDOFF,		/* from the proxy until sent to the bridge */
+	PHASE_TX,		/* see struct eub_timing */
+	PHASE_WAIT,
+	PHASE_RX,
+	PHASE_WRITEBACK,	/* answering the proxy */
+	PHASE_TOTAL,
+	NUM_PHASES
+};
+
+int trace_create(struct eub_trace *trace, const char *path, size_t size);
+int trace_open(struct eub_trace *trace, const char *path);
+void trace_close(struct eub_trace *trace);
+void trace_record(struct eub_trace *trace, uint8_t dir, uint16_t features,
+		  const uint8_t *frame, size_t len);
+const struct eub_trace_rec *trace_next(struct eub_trace *trace,
+				       uint64_t *pos);
+
+struct eub_stats *stats_create(void);
+void stats_record(struct eub_stats *stats, uint16_t addr,
+		  const int64_t us[NUM_PHASES], int failed);
+int stats_write(struct eub_stats *stats, const char *path,
+		struct eub_link *link);
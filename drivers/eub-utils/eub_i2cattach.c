@@ -17,85 +17,1609 @@
  * along with this program; if not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE	/* for ppoll */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <termios.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/i2c.h>
+#include <linux/eub_i2c.h>
 #include "eub_i2c.h"
 
+#define NUM_REQUESTS	LINK_WINDOW
+#define MAX_CLIENTS	4	// tools on the client socket at once
+#define NUM_SLOTS	(NUM_REQUESTS + MAX_CLIENTS)
+#define CLIENT_BACKLOG	4
+#define MAX_INSTANCES	4	// links one daemon serves
+#define STATS_PATH	"/run/eub_i2c.stats"
+#define TICK_INTERVAL	1000	// ms between stats and timeout updates
+#define TRACE_SIZE	1024	// KiB of frames a trace file keeps
+#define THREAD_STACK	(256 * 1024)	// bytes, all locked in real-time mode
+#define HOLD_MAX	10000	// us a register read may be held at most
+#define BATCH_MAX	32	// bytes of registers one merged read covers
+#define MAX_PUSHES	8	// subscriptions to pushed registers
+#define RING_ENTRIES	16	// transfers each proxy ring holds
+#define RING_ENTRY	128	// bytes of each, a register read or write
+
 static volatile sig_atomic_t quit_flag = 0;
 
-static void quit_handler(int signum)
+/*
+ * Transfers read from the proxy. The link thread reads them itself once
+ * poll() reports them. Only with a driver too old for
+ * EUB_I2C_IOC_GET_FRAMING, whose proxy cannot be polled, does a thread of
+ * its own read them instead, as long as a request is free, and pass them
+ * on through the ready ring, waking the link thread through a pipe.
+ * The requests after the first NUM_REQUESTS belong to the clients, one
+ * each, which the link thread queues in the same ring.
+ */
+struct request {
+	struct eub_i2c_proxy_hdr hdr;
+	uint8_t buf[LEN_BUFFER];
+	int64_t read_us;	/* when it came from the proxy */
+	int64_t sent_us;	/* when it went to the bridge */
+	uint16_t addr;		/* of its first message */
+	uint8_t reg;		/* a register read: the first register */
+	uint16_t count;		/* and how many, or 0 for other transfers */
+};
+
+/*
+ * Register reads held back to be merged into one read of the registers
+ * they cover together, which then answers every one of them. See
+ * hold_read().
+ */
+struct batch {
+	int num_members;	/* 0 if the batch is free */
+	int members[NUM_SLOTS];
+	int sent;		/* it is in flight, and takes no more */
+	uint16_t addr;
+	uint8_t reg;
+	uint16_t count;
+	int64_t due_us;		/* when it goes out at the latest */
+	size_t len;		/* of the transfer packed in buf */
+	size_t data;		/* where the read data is in the reply */
+	uint8_t buf[2 * I2C_MSG_HDR_SIZE + 1 + BATCH_MAX];
+};
+
+/* Registers the firmware pushes every period_ms, see PUSH in eub_i2c.h */
+struct subscription {
+	uint8_t addr;
+	uint8_t reg;
+	uint8_t count;
+	uint16_t period_ms;
+};
+
+/*
+ * The latest snapshot pushed for a subscription. It answers the reads of
+ * the registers it covers as long as it is no older than two periods and
+ * came in after the last write to the device was answered.
+ */
+struct snapshot {
+	int64_t taken_us;	/* when it came in, or 0 */
+	int64_t written_us;	/* when the last write was answered */
+	int writing;		/* writes to the device on the way */
+	uint8_t data[BATCH_MAX];
+};
+
+static struct subscription subscriptions[MAX_PUSHES];
+static int num_subscriptions;
+
+/* A tool connected to the client socket, see eub_i2c.h */
+struct client {
+	int fd;			/* or -1 */
+	int busy;		/* its transfer is on the way */
+	struct eub_i2c_proxy_hdr hdr;
+	uint8_t buf[LEN_BUFFER];	/* in EUB_I2C_FORMAT_RAW */
+};
+
+/*
+ * A proxy served over a UART. Each instance has a link thread running the
+ * bridge, which polls the proxy along with the UART, or with drivers that
+ * cannot be polled, a reader thread feeding it, and shares nothing with
+ * the other instances.
+ */
+struct instance {
+	const char *uart_path;
+	const char *proxy_path;
+	char stats_path[PATH_MAX];	/* or "" */
+	char trace_path[PATH_MAX];	/* or "" */
+	char socket_path[PATH_MAX];	/* or "" */
+
+	struct eub_link link;
+	struct eub_trace trace;
+	struct eub_stats *stats;
+	int proxy_fd;
+	int tagged;		/* the proxy is in EUB_I2C_MODE_TAGGED */
+	int kernel_timeout;	/* keep EUB_I2C_IOC_SET_TIMEOUT up to date */
+	int hold_us;		/* to merge register reads, or 0 */
+	int framed;		/* the proxy is in EUB_I2C_MODE_FRAMED */
+	int polled;		/* the proxy takes poll(); no reader thread */
+	struct eub_i2c_ring *ring;	/* mapped from the proxy, or NULL */
+	struct eub_i2c_ring_setup ring_setup;
+	uint32_t sq_head;	/* the indices the daemon sets */
+	uint32_t sq_limit;
+	uint32_t cq_tail;
+	int ring_moved;		/* since the last EUB_I2C_IOC_RING_UPDATE */
+	int wake_pipe[2];
+	pthread_t thread;
+
+	struct request requests[NUM_SLOTS];
+	pthread_mutex_t request_lock;
+	pthread_cond_t request_freed;
+	int free_list[NUM_REQUESTS];
+	int num_free;
+	int ready[NUM_SLOTS];
+	int ready_head;
+	int num_ready;
+	int reader_failed;
+
+	struct batch batches[NUM_SLOTS];	/* tagged NUM_SLOTS + n */
+	struct snapshot snapshots[MAX_PUSHES];
+
+	int listen_fd;		/* the client socket, or -1 */
+	struct client clients[MAX_CLIENTS];
+
+	uint8_t relay_buf[COBS_SIZE(LEN_BUFFER + 4)];	/* the framed mode */
+};
+
+static struct instance *instances[MAX_INSTANCES];
+static int num_instances;
+
+static int64_t now_us(void)
 {
-	quit_flag = 1;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void wake(struct instance *inst)
+{
+	while (write(inst->wake_pipe[1], "", 1) < 0 && errno == EINTR)
+		;
 }
 
-int main()
+/* Read a transfer from the proxy into req. */
+static ssize_t read_request(struct instance *inst, struct request *req)
 {
-	uint8_t buffer[LEN_BUFFER + 2];
 	ssize_t len;
-	struct termios ti;
-
-	struct sigaction act;
-	sigemptyset(&act.sa_mask);
-	act.sa_handler = quit_handler;
-	act.sa_flags = 0;
-	if (sigaction(SIGTERM, &act, NULL) == -1) {
-		perror("sigaction");
-		return 1;
+
+	if (inst->tagged) {
+		len = read(inst->proxy_fd, req, sizeof req->hdr + LEN_BUFFER);
+		if (0 <= len && len != sizeof req->hdr + req->hdr.len) {
+			errno = EPROTO;
+			len = -1;
+		}
+	} else {
+		len = read(inst->proxy_fd, req->buf, LEN_BUFFER);
+		req->hdr.len = len;
 	}
+	return len;
+}
 
-	int uart = open("/dev/serial0", O_RDWR | O_NOCTTY | O_NONBLOCK);
-	if (uart < 0) {
-		perror("open serial0");
-		return 1;
+static struct eub_i2c_proxy_hdr *ring_entry(struct instance *inst,
+					    uint32_t off, uint32_t index)
+{
+	index &= inst->ring_setup.entries - 1;
+	return (void *) ((uint8_t *) inst->ring + off +
+			 index * inst->ring_setup.entry_size);
+}
+
+/*
+ * How many more transfers to take from the proxy: those the link can send
+ * at once, so that the rest keep waiting in the driver, where transfers
+ * for input devices go ahead of the others. Called with request_lock
+ * held.
+ */
+static int proxy_room(struct instance *inst)
+{
+	struct eub_link *link = &inst->link;
+	int room = (int) link->window - (int) link->inflight - inst->num_ready;
+
+	if (inst->num_free < room)
+		room = inst->num_free;
+	return (room < 0) ? 0 : room;
+}
+
+/*
+ * Take the transfers in the submission ring into the free requests, as
+ * many as there is room for. Returns how many it took.
+ */
+static int take_ring(struct instance *inst)
+{
+	uint32_t head = inst->sq_head;
+	uint32_t tail = __atomic_load_n(&inst->ring->sq_tail,
+					__ATOMIC_ACQUIRE);
+	int taken = 0;
+
+	pthread_mutex_lock(&inst->request_lock);
+	for (; head != tail && proxy_room(inst); ++head, ++taken) {
+		struct eub_i2c_proxy_hdr *entry =
+			ring_entry(inst, inst->ring_setup.sq_off, head);
+		int i = inst->free_list[--inst->num_free];
+		struct request *req = &inst->requests[i];
+
+		memcpy(req, entry, sizeof req->hdr + entry->len);
+		req->read_us = now_us();
+		inst->ready[(inst->ready_head + inst->num_ready++) %
+			    NUM_SLOTS] = i;
+	}
+	pthread_mutex_unlock(&inst->request_lock);
+	inst->sq_head = head;
+	__atomic_store_n(&inst->ring->sq_head, head, __ATOMIC_RELEASE);
+	return taken;
+}
+
+/*
+ * Let the driver put as many transfers into the submission ring as there
+ * is room for, and have it do so at the next EUB_I2C_IOC_RING_UPDATE if
+ * there is more room than before.
+ */
+static void open_ring(struct instance *inst)
+{
+	pthread_mutex_lock(&inst->request_lock);
+	uint32_t limit = inst->sq_head + proxy_room(inst);
+	pthread_mutex_unlock(&inst->request_lock);
+
+	if ((int32_t) (limit - inst->sq_limit) > 0)
+		inst->ring_moved = 1;
+	inst->sq_limit = limit;
+	__atomic_store_n(&inst->ring->sq_limit, limit, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take in the transfers the proxy has for the free requests, as many as
+ * there is room for, once poll() has found it readable: those in the
+ * submission ring if it has any, or else those too large for it. Returns
+ * 0, or -1 if the proxy has failed.
+ */
+static int take_requests(struct instance *inst)
+{
+	if (inst->ring && take_ring(inst))
+		return 0;
+	for (;;) {
+		pthread_mutex_lock(&inst->request_lock);
+		if (!proxy_room(inst)) {
+			pthread_mutex_unlock(&inst->request_lock);
+			return 0;
+		}
+		int i = inst->free_list[--inst->num_free];
+		pthread_mutex_unlock(&inst->request_lock);
+
+		struct request *req = &inst->requests[i];
+		ssize_t len = read_request(inst, req);
+		req->read_us = now_us();
+
+		pthread_mutex_lock(&inst->request_lock);
+		if (len < 0)
+			inst->free_list[inst->num_free++] = i;
+		else
+			inst->ready[(inst->ready_head + inst->num_ready++) %
+				    NUM_SLOTS] = i;
+		pthread_mutex_unlock(&inst->request_lock);
+		if (len < 0 && errno == EAGAIN)
+			return 0;
+		if (len < 0 && errno != EINTR) {
+			perror(inst->proxy_path);
+			return -1;
+		}
+	}
+}
+
+static void *proxy_reader(void *arg)
+{
+	struct instance *inst = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&inst->request_lock);
+		while (inst->num_free == 0)
+			pthread_cond_wait(&inst->request_freed,
+					  &inst->request_lock);
+		int i = inst->free_list[--inst->num_free];
+		pthread_mutex_unlock(&inst->request_lock);
+
+		struct request *req = &inst->requests[i];
+		ssize_t len;
+		do {
+			len = read_request(inst, req);
+		} while (len < 0 && errno == EINTR);
+		req->read_us = now_us();
+
+		pthread_mutex_lock(&inst->request_lock);
+		if (len < 0) {
+			if (!quit_flag)
+				perror(inst->proxy_path);
+			inst->reader_failed = 1;
+		} else {
+			inst->ready[(inst->ready_head + inst->num_ready++) %
+				    NUM_SLOTS] = i;
+		}
+		pthread_mutex_unlock(&inst->request_lock);
+		wake(inst);
+		if (len < 0)
+			return NULL;
+	}
+}
+
+/*
+ * Stores the snapshot the firmware has pushed for subscription id; the
+ * link calls it as the snapshot comes in.
+ */
+static void snapshot_taken(void *ctx, uint8_t id, const uint8_t *data,
+			   size_t len)
+{
+	struct instance *inst = ctx;
+
+	if (num_subscriptions <= id || len != subscriptions[id].count)
+		return;
+	memcpy(inst->snapshots[id].data, data, len);
+	inst->snapshots[id].taken_us = now_us();
+}
+
+/*
+ * Returns the registers req reads from the latest snapshot, or NULL if
+ * none covers them or it may be out of date.
+ */
+static const uint8_t *snapshot_find(struct instance *inst,
+				    struct request *req)
+{
+	int64_t now = now_us();
+
+	for (int n = 0; n < num_subscriptions; ++n) {
+		struct subscription *sub = &subscriptions[n];
+		struct snapshot *snap = &inst->snapshots[n];
+		if (sub->addr != req->addr || req->reg < sub->reg ||
+		    sub->reg + sub->count < req->reg + req->count)
+			continue;
+		if (!snap->taken_us || snap->writing ||
+		    snap->taken_us <= snap->written_us ||
+		    2000LL * sub->period_ms < now - snap->taken_us)
+			continue;
+		return snap->data + (req->reg - sub->reg);
+	}
+	return NULL;
+}
+
+/*
+ * Note that a transfer other than a register read goes out to addr, by a
+ * delta of 1, or has been answered, by -1. It may change the registers,
+ * so no snapshot of addr taken before it is answered is used.
+ */
+static void snapshot_guard(struct instance *inst, uint16_t addr, int delta)
+{
+	for (int n = 0; n < num_subscriptions; ++n) {
+		struct snapshot *snap = &inst->snapshots[n];
+		if (subscriptions[n].addr != addr)
+			continue;
+		snap->writing += delta;
+		if (delta < 0)
+			snap->written_us = now_us();
+	}
+}
+
+static void client_close(struct client *client)
+{
+	close(client->fd);
+	client->fd = -1;
+	client->busy = 0;
+}
+
+/*
+ * Answer client c with the result of its transfer, ret bytes of reply
+ * data in its request in the format of the link or a failure. A client
+ * that has gone away is dropped, which does not concern the link.
+ */
+static void answer_client(struct instance *inst, int c, int ret)
+{
+	struct client *client = &inst->clients[c];
+	struct request *req = &inst->requests[NUM_REQUESTS + c];
+
+	if (0 <= ret &&
+	    i2c_fill_reads(client->buf, client->hdr.len, EUB_I2C_FORMAT_RAW,
+			   req->buf, ret, link_format(&inst->link)) < 0)
+		ret = -1;
+	client->hdr.status = (ret == LINK_NAK) ? -ENXIO : (ret < 0) ? -EIO : 0;
+	if (ret < 0)
+		client->hdr.len = 0;
+	client->busy = 0;
+	if (send(client->fd, &client->hdr, sizeof client->hdr + client->hdr.len,
+		 MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		client_close(client);
+}
+
+/* Answer the kernel with the result of req, as answer_client() does. */
+static ssize_t answer_proxy(struct instance *inst, struct request *req,
+			    int ret)
+{
+	ssize_t len;
+
+	if (inst->tagged) {
+		req->hdr.status = (ret == LINK_NAK) ? -ENXIO :
+				  (ret < 0) ? -EIO : 0;
+		req->hdr.len = (ret < 0) ? 0 : ret;
+	}
+	// the next EUB_I2C_IOC_RING_UPDATE takes in an answer in the
+	// completion ring
+	if (inst->ring &&
+	    sizeof req->hdr + req->hdr.len <= inst->ring_setup.entry_size &&
+	    inst->cq_tail - __atomic_load_n(&inst->ring->cq_head,
+					    __ATOMIC_ACQUIRE) <
+	    inst->ring_setup.entries) {
+		len = sizeof req->hdr + req->hdr.len;
+		memcpy(ring_entry(inst, inst->ring_setup.cq_off, inst->cq_tail),
+		       req, len);
+		__atomic_store_n(&inst->ring->cq_tail, ++inst->cq_tail,
+				 __ATOMIC_RELEASE);
+		inst->ring_moved = 1;
+		return len;
+	}
+	do {
+		if (inst->tagged) {
+			len = write(inst->proxy_fd, req,
+				    sizeof req->hdr + req->hdr.len);
+		} else {
+			len = write(inst->proxy_fd, req->buf,
+				    (ret < 0) ? 0 : ret);
+		}
+	} while (len < 0 && errno == EINTR);
+	return len;
+}
+
+/*
+ * Hand the result of request i, ret bytes of reply data in its buffer or
+ * a failure, back to the kernel and let the reader have the request again,
+ * or back to the client it came from. timing is where the time on the
+ * link went, or NULL if it never got there.
+ */
+static int answer(struct instance *inst, int i, int ret,
+		  const struct eub_timing *timing)
+{
+	struct request *req = &inst->requests[i];
+	int64_t us[NUM_PHASES] = { 0 };
+	ssize_t len = 0;
+
+	int64_t start = now_us();
+	if (NUM_REQUESTS <= i)
+		answer_client(inst, i - NUM_REQUESTS, ret);
+	else
+		len = answer_proxy(inst, req, ret);
+	int64_t end = now_us();
+
+	us[PHASE_HANDOFF] = req->sent_us - req->read_us;
+	if (timing) {
+		us[PHASE_TX] = timing->tx;
+		us[PHASE_WAIT] = timing->wait;
+		us[PHASE_RX] = timing->rx;
 	}
+	us[PHASE_WRITEBACK] = end - start;
+	us[PHASE_TOTAL] = end - req->read_us;
+	stats_record(inst->stats, req->addr, us, ret < 0);
+	if (!req->count)
+		snapshot_guard(inst, req->addr, -1);
+	if (NUM_REQUESTS <= i)
+		return 0;
 
-	tcflush(uart, TCIOFLUSH);
-	if (tcgetattr(uart, &ti) < 0) {
-		perror("Can't get port settings");
+	pthread_mutex_lock(&inst->request_lock);
+	inst->free_list[inst->num_free++] = i;
+	pthread_cond_signal(&inst->request_freed);
+	pthread_mutex_unlock(&inst->request_lock);
+
+	// the kernel fails a transfer it has given up on, or answered by 0 bytes
+	if (len < 0 && errno != EIO && errno != ENOENT) {
+		perror(inst->proxy_path);
 		return -1;
 	}
-	cfmakeraw(&ti);
-	ti.c_cflag |= CLOCAL;
-	ti.c_cflag &= ~CRTSCTS;
-	cfsetispeed(&ti, BAUDRATE);
-	cfsetospeed(&ti, BAUDRATE);
-	if (tcsetattr(uart, TCSANOW, &ti) < 0) {
-		perror("Can't set port settings");
+	return 0;
+}
+
+/*
+ * Let the kernel give up on a transfer soon after the link would, as the
+ * estimate of how fast the firmware answers changes.
+ */
+static void update_kernel_timeout(struct instance *inst)
+{
+	struct eub_i2c_timeout timeout;
+
+	link_answer_timeout(&inst->link, &timeout.base_us, &timeout.byte_ns);
+	if (ioctl(inst->proxy_fd, EUB_I2C_IOC_SET_TIMEOUT, &timeout) < 0) {
+		// an older driver keeps its adapter timeout
+		if (errno != ENOTTY)
+			perror("EUB_I2C_IOC_SET_TIMEOUT");
+		inst->kernel_timeout = 0;
+	}
+}
+
+/*
+ * Note the address req goes to, and whether it reads count registers of a
+ * 7 bit device starting at reg: a write of the register number followed
+ * by a read, as the power board drivers do, or an SMBus byte or word read,
+ * which is answered the same way.
+ */
+static void classify(struct instance *inst, struct request *req)
+{
+	int format = link_format(&inst->link);
+	uint8_t *end = req->buf + req->hdr.len;
+	struct i2c_packed_msg w, r;
+	struct i2c_smbus_op op;
+	uint8_t *p;
+
+	req->count = 0;
+	if (i2c_unpack_op(req->buf, req->hdr.len, format, &op) == 1) {
+		req->addr = op.addr;
+		req->reg = op.cmd;
+		if (op.op == EUB_I2C_SMBUS_READ_BYTE_DATA ||
+		    op.op == EUB_I2C_SMBUS_READ_WORD_DATA)
+			req->count = i2c_op_reply_size(op.op);
+		return;
+	}
+	p = i2c_unpack_msg(req->buf, end, format, &w);
+	req->addr = p ? w.addr : EUB_BRIDGE_ADDR;
+	if (!p || w.flags || w.len != 1 || 0x7f < w.addr ||
+	    end - p < 1)
+		return;
+	req->reg = *p++;
+	p = i2c_unpack_msg(p, end, format, &r);
+	if (!p || r.flags != I2C_M_RD || r.addr != w.addr ||
+	    r.len == 0 || BATCH_MAX < r.len ||
+	    end - p != i2c_msg_data_size(format, &r))
+		return;
+	req->count = r.len;
+}
+
+static struct batch *held_batch(struct instance *inst, uint16_t addr)
+{
+	for (int n = 0; n < NUM_SLOTS; ++n) {
+		struct batch *b = &inst->batches[n];
+		if (b->num_members && !b->sent && b->addr == addr)
+			return b;
+	}
+	return NULL;
+}
+
+/* Returns the next ready request that can go out now, or -1. */
+static int next_request(struct instance *inst)
+{
+	struct eub_link *link = &inst->link;
+	int i = -1;
+
+	pthread_mutex_lock(&inst->request_lock);
+	if (inst->num_ready) {
+		struct request *req =
+			&inst->requests[inst->ready[inst->ready_head]];
+		// a fragmented transfer waits until nothing else is in flight
+		int room = link_fits(link, req->buf, req->hdr.len) ?
+			   link->inflight < link->window : link->inflight == 0;
+		if (inst->hold_us) {
+			struct batch *b;
+
+			// register reads are held; others keep their order
+			// with the reads of the same device
+			classify(inst, req);
+			if (req->count) {
+				room = 1;
+			} else if ((b = held_batch(inst, req->addr))) {
+				b->due_us = 0;
+				room = 0;
+			}
+		}
+		if (room) {
+			i = inst->ready[inst->ready_head];
+			inst->ready_head = (inst->ready_head + 1) %
+					   NUM_SLOTS;
+			--inst->num_ready;
+		}
+	}
+	pthread_mutex_unlock(&inst->request_lock);
+	return i;
+}
+
+/*
+ * Pack into b a read of count registers from reg on. Returns 0, or -1 if
+ * the read would not fit in a frame, leaving b to be packed again.
+ */
+static int batch_pack(struct instance *inst, struct batch *b, uint8_t reg,
+		      uint16_t count)
+{
+	int format = link_format(&inst->link);
+	uint8_t *p;
+
+	p = i2c_pack_msg(b->buf, format, b->addr, 0, 1, &reg);
+	p = i2c_pack_msg(p, format, b->addr, I2C_M_RD, count, NULL);
+	b->len = p - b->buf;
+	if (!link_fits(&inst->link, b->buf, b->len))
+		return -1;
+	b->reg = reg;
+	b->count = count;
+	b->data = (format & EUB_I2C_FORMAT_SPLIT) ? 0 : b->len - count;
+	return 0;
+}
+
+/*
+ * Hold the register read i for up to hold_us, merged with the reads held
+ * for the same device if the registers of both are next to each other or
+ * overlap. Merging never reads a register nobody asked for. Returns 0, or
+ * -1 if the read cannot be held and has to go out on its own.
+ */
+static int hold_read(struct instance *inst, int i)
+{
+	struct request *req = &inst->requests[i];
+	struct batch *b, *free_batch = NULL;
+
+	for (int n = 0; n < NUM_SLOTS; ++n) {
+		b = &inst->batches[n];
+		if (!b->num_members) {
+			if (!free_batch)
+				free_batch = b;
+			continue;
+		}
+		if (b->sent || b->addr != req->addr ||
+		    b->reg + b->count < req->reg ||
+		    req->reg + req->count < b->reg)
+			continue;
+		int lo = (b->reg < req->reg) ? b->reg : req->reg;
+		int hi = (b->reg + b->count < req->reg + req->count) ?
+			 req->reg + req->count : b->reg + b->count;
+		if (BATCH_MAX < hi - lo)
+			continue;
+		if (batch_pack(inst, b, lo, hi - lo) < 0) {
+			batch_pack(inst, b, b->reg, b->count);
+			continue;
+		}
+		b->members[b->num_members++] = i;
+		return 0;
+	}
+
+	b = free_batch;
+	if (!b)
 		return -1;
+	b->addr = req->addr;
+	if (batch_pack(inst, b, req->reg, req->count) < 0)
+		return -1;
+	b->members[0] = i;
+	b->num_members = 1;
+	b->sent = 0;
+	b->due_us = req->read_us + inst->hold_us;
+	return 0;
+}
+
+/* Answer the register read i with the registers at data. */
+static int answer_read(struct instance *inst, int i, const uint8_t *data,
+		       const struct eub_timing *timing)
+{
+	struct request *req = &inst->requests[i];
+
+	if (link_format(&inst->link) & EUB_I2C_FORMAT_SPLIT) {
+		memcpy(req->buf, data, req->count);
+		return answer(inst, i, req->count, timing);
+	}
+	// the read data ends the transfer
+	memcpy(req->buf + req->hdr.len - req->count, data, req->count);
+	return answer(inst, i, req->hdr.len, timing);
+}
+
+/*
+ * Answer every read merged into b from the reply to b, ret bytes in its
+ * buffer or a failure.
+ */
+static int answer_batch(struct instance *inst, struct batch *b, int ret,
+			const struct eub_timing *timing)
+{
+	int failed = 0;
+
+	for (int m = 0; m < b->num_members; ++m) {
+		int i = b->members[m];
+		struct request *req = &inst->requests[i];
+		const uint8_t *data = b->buf + b->data + (req->reg - b->reg);
+
+		if (((ret < 0) ? answer(inst, i, ret, timing) :
+				 answer_read(inst, i, data, timing)) < 0)
+			failed = 1;
+	}
+	b->num_members = 0;
+	return failed ? -1 : 0;
+}
+
+/* Answer what went out under tag, a request or a batch of them. */
+static int answer_tag(struct instance *inst, uint32_t tag, int ret,
+		      const struct eub_timing *timing)
+{
+	if (tag < NUM_SLOTS)
+		return answer(inst, tag, ret, timing);
+	return answer_batch(inst, &inst->batches[tag - NUM_SLOTS], ret,
+			    timing);
+}
+
+/*
+ * Returns when the next held batch is due, or INT64_MAX if none is. All
+ * are due once the reader has no request left to take more transfers in.
+ */
+static int64_t batch_due(struct instance *inst)
+{
+	int64_t due = INT64_MAX;
+
+	pthread_mutex_lock(&inst->request_lock);
+	int starved = inst->num_free == 0;
+	pthread_mutex_unlock(&inst->request_lock);
+	for (int n = 0; n < NUM_SLOTS; ++n) {
+		struct batch *b = &inst->batches[n];
+		if (b->num_members && !b->sent && b->due_us < due)
+			due = b->due_us;
 	}
-	tcflush(uart, TCIOFLUSH);
+	return (starved && due != INT64_MAX) ? 0 : due;
+}
 
-	i2c_sync(uart);
+/*
+ * Send the batch that is due first if it is due by now and the link has
+ * room for it. Returns 1 if it went out or failed, 0 if nothing was sent,
+ * or -1 if answering the proxy failed.
+ */
+static int flush_batch(struct instance *inst, int64_t now)
+{
+	struct eub_link *link = &inst->link;
+	struct batch *first = NULL;
 
-	int fd = open("/dev/i2c-proxy3", O_RDWR);
-	if (fd < 0) {
-		perror("open i2c-proxy3");
+	if (link->window <= link->inflight)
+		return 0;
+	int64_t due = batch_due(inst);
+	if (due == INT64_MAX || now < due)
+		return 0;
+	for (int n = 0; n < NUM_SLOTS; ++n) {
+		struct batch *b = &inst->batches[n];
+		if (b->num_members && !b->sent &&
+		    (!first || b->due_us < first->due_us))
+			first = b;
+	}
+	for (int m = 0; m < first->num_members; ++m)
+		inst->requests[first->members[m]].sent_us = now_us();
+	if (link_submit(link, NUM_SLOTS + (first - inst->batches),
+			first->buf, first->len) == 0) {
+		first->sent = 1;
 		return 1;
 	}
+	return (answer_batch(inst, first, -1, NULL) < 0) ? -1 : 1;
+}
+
+/*
+ * Take the transfer client c has sent, in EUB_I2C_FORMAT_RAW, into its
+ * request in the format of the link, and queue it after the transfers
+ * from the proxy ready by now.
+ */
+static void client_request(struct instance *inst, int c)
+{
+	struct client *client = &inst->clients[c];
+	struct request *req = &inst->requests[NUM_REQUESTS + c];
+	ssize_t len;
+
+	do {
+		len = recv(client->fd, &client->hdr,
+			   sizeof client->hdr + LEN_BUFFER, MSG_DONTWAIT);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0 && errno == EAGAIN)
+		return;
+	if (len <= 0) {
+		client_close(client);
+		return;
+	}
+	if (len != sizeof client->hdr + client->hdr.len ||
+	    (len = i2c_repack(req->buf, LEN_BUFFER, link_format(&inst->link),
+			      client->buf, client->hdr.len,
+			      EUB_I2C_FORMAT_RAW)) <= 0) {
+		client->hdr.status = -EINVAL;
+		client->hdr.len = 0;
+		if (send(client->fd, &client->hdr, sizeof client->hdr,
+			 MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+			client_close(client);
+		return;
+	}
+	req->hdr = client->hdr;
+	req->hdr.len = len;
+	req->read_us = now_us();
+	client->busy = 1;
+
+	pthread_mutex_lock(&inst->request_lock);
+	inst->ready[(inst->ready_head + inst->num_ready++) % NUM_SLOTS] =
+		NUM_REQUESTS + c;
+	pthread_mutex_unlock(&inst->request_lock);
+}
+
+/* Take a new client on, or turn it away if there are too many. */
+static void client_accept(struct instance *inst)
+{
+	int fd = accept4(inst->listen_fd, NULL, NULL,
+			 SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (fd < 0)
+		return;
+	for (int c = 0; c < MAX_CLIENTS; ++c) {
+		if (inst->clients[c].fd < 0) {
+			inst->clients[c].fd = fd;
+			return;
+		}
+	}
+	close(fd);
+}
+
+static void client_close_all(struct instance *inst)
+{
+	for (int c = 0; c < MAX_CLIENTS; ++c) {
+		if (0 <= inst->clients[c].fd)
+			client_close(&inst->clients[c]);
+	}
+	if (0 <= inst->listen_fd) {
+		close(inst->listen_fd);
+		unlink(inst->socket_path);
+	}
+}
+
+/*
+ * Listen on the client socket of inst, replacing what a daemon that did
+ * not quit cleanly left behind.
+ */
+static int client_listen(struct instance *inst)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (sizeof addr.sun_path <= strlen(inst->socket_path)) {
+		fprintf(stderr, "%s: path too long\n", inst->socket_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, inst->socket_path);
+	inst->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (inst->listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(inst->socket_path);
+	if (bind(inst->listen_fd, (struct sockaddr *) &addr,
+		 sizeof addr) < 0 ||
+	    listen(inst->listen_fd, CLIENT_BACKLOG) < 0) {
+		perror(inst->socket_path);
+		close(inst->listen_fd);
+		inst->listen_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Returns whether the driver behind the proxy packs SMBus ops, which it
+ * takes in the format only in the tagged mode. Leaves the proxy in the
+ * legacy mode with raw messages.
+ */
+static int proxy_has_smbus(int fd)
+{
+	__u32 mode = EUB_I2C_MODE_TAGGED;
+	__u32 format = EUB_I2C_FORMAT_COMPACT | EUB_I2C_FORMAT_SPLIT |
+		       EUB_I2C_FORMAT_SMBUS;
+	int ret = ioctl(fd, EUB_I2C_IOC_SET_MODE, &mode) == 0 &&
+		  ioctl(fd, EUB_I2C_IOC_SET_FORMAT, &format) == 0;
+
+	mode = EUB_I2C_MODE_LEGACY;
+	format = EUB_I2C_FORMAT_RAW;
+	ioctl(fd, EUB_I2C_IOC_SET_MODE, &mode);
+	ioctl(fd, EUB_I2C_IOC_SET_FORMAT, &format);
+	return ret;
+}
+
+/*
+ * Open the proxy and the link of inst and agree on how transfers pass
+ * between them.
+ */
+static int instance_open(struct instance *inst, unsigned int baudrate,
+			 int rtscts, uint16_t features, size_t trace_size,
+			 int hold_us)
+{
+	struct eub_link *link = &inst->link;
+
+	inst->proxy_fd = open(inst->proxy_path, O_RDWR);
+	if (inst->proxy_fd < 0) {
+		perror(inst->proxy_path);
+		return -1;
+	}
+
+	// a driver without the ioctls packs raw messages one at a time
+	__u32 format = EUB_I2C_FORMAT_RAW;
+	int ioctls = ioctl(inst->proxy_fd, EUB_I2C_IOC_SET_FORMAT,
+			   &format) == 0;
+	if (!ioctls)
+		features &= ~(EUB_BRIDGE_FEAT_COMPACT |
+			      EUB_BRIDGE_FEAT_PIPELINE |
+			      EUB_BRIDGE_FEAT_SPLIT |
+			      EUB_BRIDGE_FEAT_SMBUS);
+	// the I2C core emulates SMBus where the driver has no ops
+	else if (!proxy_has_smbus(inst->proxy_fd))
+		features &= ~EUB_BRIDGE_FEAT_SMBUS;
+	// the driver does not fragment, and has no use for snapshots
+	if (inst->framed)
+		features &= ~(EUB_BRIDGE_FEAT_FRAG | EUB_BRIDGE_FEAT_PUSH);
+	if (inst->framed && !ioctls) {
+		fprintf(stderr, "%s: no framed mode in the driver\n",
+			inst->proxy_path);
+		return -1;
+	}
+	// drivers with the framed mode can be polled, too
+	struct eub_i2c_framing current;
+	inst->polled = ioctls && ioctl(inst->proxy_fd,
+				       EUB_I2C_IOC_GET_FRAMING, &current) == 0;
+
+	if (*inst->trace_path &&
+	    trace_create(&inst->trace, inst->trace_path, trace_size) < 0) {
+		perror(inst->trace_path);
+		return -1;
+	}
+	inst->stats = stats_create();
+	if (!inst->stats) {
+		perror("stats_create");
+		return -1;
+	}
+
+	if (link_open(link, inst->uart_path, baudrate, rtscts, features) < 0)
+		return -1;
+	if (*inst->trace_path)
+		link->trace = &inst->trace;
+	if (num_subscriptions && (link->features & EUB_BRIDGE_FEAT_PUSH)) {
+		link->push = snapshot_taken;
+		link->push_ctx = inst;
+		for (int n = 0; n < num_subscriptions; ++n) {
+			struct subscription *sub = &subscriptions[n];
+			if (bridge_subscribe(link, n, sub->addr, sub->reg,
+					     sub->count, sub->period_ms) < 0)
+				fprintf(stderr, "%s: cannot subscribe to "
+					"0x%02x:0x%02x\n", inst->uart_path,
+					sub->addr, sub->reg);
+		}
+	}
+
+	if (inst->framed) {
+		struct eub_i2c_framing framing = {
+			.features = link->features,
+			.max_frame = link->max_frame,
+			.window = link->window,
+			.seq = link->seq,
+		};
+		if (ioctl(inst->proxy_fd, EUB_I2C_IOC_SET_FRAMING,
+			  &framing) < 0) {
+			perror("EUB_I2C_IOC_SET_FRAMING");
+			link_close(link);
+			return -1;
+		}
+	}
+
+	// the proxy passes transfers through in the format of the link
+	// reads are merged only if the proxy hands out several at a time
+	format = link_format(link);
+	if (ioctls && hold_us)
+		inst->hold_us = hold_us;
+	if (ioctls && !inst->framed &&
+	    (1 < link->window || (format & EUB_I2C_FORMAT_SPLIT) ||
+	     inst->hold_us)) {
+		__u32 mode = EUB_I2C_MODE_TAGGED;
+		if (ioctl(inst->proxy_fd, EUB_I2C_IOC_SET_MODE, &mode) < 0) {
+			perror("EUB_I2C_IOC_SET_MODE");
+			link_close(link);
+			return -1;
+		}
+		inst->tagged = 1;
+	}
+	if (format != EUB_I2C_FORMAT_RAW && !inst->framed &&
+	    ioctl(inst->proxy_fd, EUB_I2C_IOC_SET_FORMAT, &format) < 0) {
+		perror("EUB_I2C_IOC_SET_FORMAT");
+		link_close(link);
+		return -1;
+	}
+
+	// without CRC, the link keeps its fixed timeout
+	inst->kernel_timeout = ioctls &&
+			       (link->features & EUB_BRIDGE_FEAT_CRC);
+	if (inst->polled &&
+	    fcntl(inst->proxy_fd, F_SETFL,
+		  fcntl(inst->proxy_fd, F_GETFL) | O_NONBLOCK) < 0) {
+		perror(inst->proxy_path);
+		link_close(link);
+		return -1;
+	}
+	// drivers without the rings have the transfers read and written
+	if (inst->polled && inst->tagged) {
+		struct eub_i2c_ring_setup *setup = &inst->ring_setup;
+		setup->entries = RING_ENTRIES;
+		setup->entry_size = RING_ENTRY;
+		if (ioctl(inst->proxy_fd, EUB_I2C_IOC_SET_RING, setup) == 0) {
+			void *ring = mmap(NULL, setup->size,
+					  PROT_READ | PROT_WRITE, MAP_SHARED,
+					  inst->proxy_fd, 0);
+			if (ring == MAP_FAILED)
+				perror(inst->proxy_path);
+			else
+				inst->ring = ring;
+		}
+	}
+
+	printf("%s: %u baud, features 0x%04x, max frame %u, window %u\n",
+	       inst->uart_path, link->baudrate, link->features,
+	       link->max_frame, link->window);
+	fflush(stdout);
+
+	inst->listen_fd = -1;
+	for (int c = 0; c < MAX_CLIENTS; ++c)
+		inst->clients[c].fd = -1;
+	if (*inst->socket_path && client_listen(inst) < 0) {
+		link_close(link);
+		return -1;
+	}
+
+	pthread_mutex_init(&inst->request_lock, NULL);
+	pthread_cond_init(&inst->request_freed, NULL);
+	for (int i = 0; i < NUM_REQUESTS; ++i)
+		inst->free_list[inst->num_free++] = i;
+	if (pipe(inst->wake_pipe) < 0) {
+		perror("pipe");
+		link_close(link);
+		return -1;
+	}
+	return 0;
+}
+
+/* Write len bytes at buf to fd, waiting for room if it is non-blocking. */
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+	while (0 < len) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				poll(&pfd, 1, -1);
+			else if (errno != EINTR)
+				return -1;
+			continue;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * The link thread of an instance in the framed mode: the driver frames
+ * the transfers and takes the replies apart itself, so the link only
+ * relays bytes, the frames the driver hands out to the UART and whatever
+ * the UART receives to the driver. The bytes on the UART are all the
+ * statistics see.
+ */
+static void *relay_run(struct instance *inst)
+{
+	struct eub_link *link = &inst->link;
+	struct pollfd fds[3] = {
+		{ .fd = inst->wake_pipe[0], .events = POLLIN },
+		{ .fd = link->fd, .events = POLLIN },
+		{ .fd = inst->proxy_fd, .events = POLLIN },
+	};
+	uint8_t *buf = inst->relay_buf;
+	int64_t tick_due = 0;
+	int stats_failed = 0;
+	ssize_t len;
 
 	while (!quit_flag) {
-		len = read(fd, buffer + 1, LEN_BUFFER);
-		if (len < 0) {
-			perror("read fd");
+		int64_t now = now_us() / 1000;
+		if (tick_due <= now) {
+			if (*inst->stats_path &&
+			    stats_write(inst->stats, inst->stats_path,
+					link) < 0 && !stats_failed) {
+				perror(inst->stats_path);
+				stats_failed = 1;
+			}
+			if (inst->kernel_timeout)
+				update_kernel_timeout(inst);
+			tick_due = now + TICK_INTERVAL;
+		}
+		if (poll(fds, 3, tick_due - now) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
 			break;
 		}
-		lockf(uart, F_LOCK, 0);
-		int ret = i2c_xfer(uart, buffer, len);
-		lockf(uart, F_ULOCK, 0);
-		do {
-			len = write(fd, buffer + 1, (ret < 0) ? 0 : len);
-		} while (len == EINTR);
-		if (len < 0) {
-			perror("write fd");
+		if (fds[2].revents & POLLIN) {
+			len = read(inst->proxy_fd, buf, sizeof inst->relay_buf);
+			if (len < 0 && errno != EAGAIN && errno != EINTR) {
+				perror(inst->proxy_path);
+				break;
+			}
+			if (0 < len) {
+				if (write_all(link->fd, buf, len) < 0) {
+					perror(inst->uart_path);
+					break;
+				}
+				link->tx_bytes += len;
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			len = read(link->fd, buf, sizeof inst->relay_buf);
+			if (len < 0 && errno != EAGAIN && errno != EINTR) {
+				perror(inst->uart_path);
+				break;
+			}
+			if (0 < len) {
+				if (write_all(inst->proxy_fd, buf, len) < 0) {
+					perror(inst->proxy_path);
+					break;
+				}
+				link->rx_bytes += len;
+			}
+		}
+	}
+	if (!quit_flag)
+		kill(getpid(), SIGTERM);
+
+	// hand the sequence numbers back to the link before it closes
+	struct eub_i2c_framing framing;
+	if (ioctl(inst->proxy_fd, EUB_I2C_IOC_GET_FRAMING, &framing) == 0)
+		link->seq = framing.seq;
+	__u32 mode = EUB_I2C_MODE_LEGACY;
+	ioctl(inst->proxy_fd, EUB_I2C_IOC_SET_MODE, &mode);
+	if (*inst->stats_path)
+		stats_write(inst->stats, inst->stats_path, link);
+	close(inst->proxy_fd);
+	link_close(link);
+	return NULL;
+}
+
+/*
+ * The link thread of an instance: move transfers between the proxy and
+ * the bridge until asked to quit or something fails, in which case it
+ * asks the whole daemon to quit.
+ */
+static void *instance_run(void *arg)
+{
+	struct instance *inst = arg;
+	struct eub_link *link = &inst->link;
+
+	if (inst->framed)
+		return relay_run(inst);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK);
+	pthread_t reader;
+	if (!inst->polled &&
+	    pthread_create(&reader, &attr, proxy_reader, inst) != 0) {
+		perror("pthread_create");
+		kill(getpid(), SIGTERM);
+		return NULL;
+	}
+	pthread_attr_destroy(&attr);
+
+	struct pollfd fds[4 + MAX_CLIENTS] = {
+		{ .fd = inst->wake_pipe[0], .events = POLLIN },
+		{ .fd = link->fd, .events = POLLIN },
+		{ .fd = inst->listen_fd, .events = POLLIN },
+		{ .fd = -1, .events = POLLIN },
+	};
+	int failed = 0;
+	int64_t tick_due = 0;
+	int stats_failed = 0;
+	while (!quit_flag && !failed) {
+		int i, ret;
+		for (;;) {
+			if ((ret = flush_batch(inst, now_us())) != 0) {
+				if (ret < 0)
+					failed = 1;
+				continue;
+			}
+			if ((i = next_request(inst)) == -1)
+				break;
+			struct request *req = &inst->requests[i];
+			const uint8_t *data;
+			if (!inst->hold_us)
+				classify(inst, req);
+			if (req->count && (data = snapshot_find(inst, req))) {
+				// pushed by the firmware; no need to ask
+				req->sent_us = now_us();
+				if (answer_read(inst, i, data, NULL) < 0)
+					failed = 1;
+				continue;
+			}
+			if (inst->hold_us && req->count &&
+			    hold_read(inst, i) == 0)
+				continue;
+			if (!req->count)
+				snapshot_guard(inst, req->addr, 1);
+			req->sent_us = now_us();
+			if (link_fits(link, req->buf, req->hdr.len)) {
+				if (link_submit(link, i, req->buf,
+						req->hdr.len) == 0)
+					continue;
+				if (answer(inst, i, -1, NULL) < 0)
+					failed = 1;
+				continue;
+			}
+			ret = link_xfer(link, req->buf, req->hdr.len);
+			if (answer(inst, i, ret, &link->timing) < 0)
+				failed = 1;
+		}
+
+		int timeout = link_poll_timeout(link);
+		if (*inst->stats_path || inst->kernel_timeout) {
+			int64_t now = now_us() / 1000;
+			if (tick_due <= now) {
+				if (*inst->stats_path &&
+				    stats_write(inst->stats, inst->stats_path,
+						link) < 0 && !stats_failed) {
+					perror(inst->stats_path);
+					stats_failed = 1;
+				}
+				if (inst->kernel_timeout)
+					update_kernel_timeout(inst);
+				tick_due = now + TICK_INTERVAL;
+			}
+			if (timeout < 0 || tick_due - now < timeout)
+				timeout = tick_due - now;
+		}
+		// held reads are due in microseconds
+		int64_t timeout_us = (timeout < 0) ? -1 : timeout * 1000LL;
+		if (link->inflight < link->window) {
+			int64_t due = batch_due(inst);
+			if (due != INT64_MAX) {
+				due -= now_us();
+				if (due < 0)
+					due = 0;
+				if (timeout_us < 0 || due < timeout_us)
+					timeout_us = due;
+			}
+		}
+		struct timespec ts = {
+			.tv_sec = timeout_us / 1000000,
+			.tv_nsec = timeout_us % 1000000 * 1000,
+		};
+		// the proxy is read only into free requests the link can
+		// send at once
+		if (inst->polled) {
+			pthread_mutex_lock(&inst->request_lock);
+			fds[3].fd = proxy_room(inst) ? inst->proxy_fd : -1;
+			pthread_mutex_unlock(&inst->request_lock);
+		}
+		// a client waiting for an answer sends nothing more
+		for (int c = 0; c < MAX_CLIENTS; ++c) {
+			struct client *client = &inst->clients[c];
+			fds[4 + c].fd = client->busy ? -1 : client->fd;
+			fds[4 + c].events = POLLIN;
+		}
+		// one call for the answers put in the rings and the room
+		// made since the last
+		if (inst->ring)
+			open_ring(inst);
+		if (inst->ring_moved) {
+			if (ioctl(inst->proxy_fd, EUB_I2C_IOC_RING_UPDATE) < 0) {
+				perror("EUB_I2C_IOC_RING_UPDATE");
+				break;
+			}
+			inst->ring_moved = 0;
+		}
+		if (ppoll(fds, 4 + MAX_CLIENTS, (timeout_us < 0) ? NULL : &ts,
+			  NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ppoll");
 			break;
 		}
+		if (fds[0].revents & POLLIN) {
+			char buf[NUM_REQUESTS];
+			if (read(inst->wake_pipe[0], buf, sizeof buf) < 0 &&
+			    errno != EINTR)
+				break;
+			pthread_mutex_lock(&inst->request_lock);
+			failed |= inst->reader_failed;
+			pthread_mutex_unlock(&inst->request_lock);
+		}
+		if (fds[2].revents & POLLIN)
+			client_accept(inst);
+		if ((fds[3].revents & (POLLIN | POLLERR)) &&
+		    take_requests(inst) < 0)
+			failed = 1;
+		for (int c = 0; c < MAX_CLIENTS; ++c) {
+			if (0 <= fds[4 + c].fd && fds[4 + c].revents)
+				client_request(inst, c);
+		}
+		if (!link->inflight) {
+			// nothing is in flight; take in snapshots, or drop
+			// stray bytes
+			if (!(fds[1].revents & POLLIN))
+				continue;
+			if (link->features & EUB_BRIDGE_FEAT_PUSH)
+				link_drain(link);
+			else
+				link_sync(link);
+			continue;
+		}
+
+		uint32_t tag;
+		while ((ret = link_reap(link, &tag, 0)) != LINK_TIMEOUT) {
+			if (answer_tag(inst, tag, ret, &link->timing) < 0)
+				failed = 1;
+		}
 	}
-	close(fd);
-	close(uart);
+	if (!quit_flag)
+		kill(getpid(), SIGTERM);
+
+	// let the reads held and the transfers in flight complete
+	while (flush_batch(inst, INT64_MAX) || link->inflight) {
+		uint32_t tag;
+		int ret = link_reap(link, &tag, -1);
+		if (ret != LINK_TIMEOUT)
+			answer_tag(inst, tag, ret, &link->timing);
+	}
+	if (inst->ring) {
+		// have the answers left in the completion ring taken in
+		if (inst->ring_moved)
+			ioctl(inst->proxy_fd, EUB_I2C_IOC_RING_UPDATE);
+		munmap(inst->ring, inst->ring_setup.size);
+	}
+	if (*inst->stats_path)
+		stats_write(inst->stats, inst->stats_path, link);
+	client_close_all(inst);
+	close(inst->proxy_fd);
+	link_close(link);
+	trace_close(&inst->trace);
+	return NULL;
+}
+
+/*
+ * With several links, each gets its own statistics and trace file and
+ * client socket, named after the path given with the number of the link
+ * appended.
+ */
+static int instance_path(char *dst, const char *path, int n)
+{
+	int len;
+
+	if (!path)
+		path = "";
+	if (num_instances == 1 || !*path)
+		len = snprintf(dst, PATH_MAX, "%s", path);
+	else
+		len = snprintf(dst, PATH_MAX, "%s.%d", path, n);
+	return (len < PATH_MAX) ? 0 : -1;
+}
+
+/* Parse addr:reg:count:ms as given to -P. */
+static int parse_subscription(const char *arg, struct subscription *sub)
+{
+	int addr, reg, count, period_ms;
+	char end;
+
+	if (sscanf(arg, "%i:%i:%i:%i%c", &addr, &reg, &count, &period_ms,
+		   &end) != 4 || addr < 0 || 0x7f < addr || reg < 0 ||
+	    0xff < reg || count <= 0 || BATCH_MAX < count ||
+	    period_ms <= 0 || UINT16_MAX < period_ms)
+		return -1;
+	sub->addr = addr;
+	sub->reg = reg;
+	sub->count = count;
+	sub->period_ms = period_ms;
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d uart] [-p proxy] [-b baudrate] [-f] [-m mask] "
+		"[-s path] [-t path] [-T size]\n"
+		"       [-S path] [-r priority] [-c cpu] [-w us] "
+		"[-P addr:reg:count:ms]... [-k]\n"
+		"  -d uart      serial device (default /dev/serial0)\n"
+		"  -p proxy     i2c proxy device (default /dev/i2c-proxy3)\n"
+		"               give -d and -p once for each link, up to %d\n"
+		"  -b baudrate  highest baud rate to negotiate (default %u)\n"
+		"  -f           use RTS/CTS flow control above the default rate\n"
+		"  -m mask      framing features to enable (default 0x%04x)\n"
+		"  -s path      statistics file, updated every second "
+		"(default %s;\n"
+		"               \"\" turns it off)\n"
+		"  -t path      record the frames on the UART to a trace file\n"
+		"  -T size      KiB of the latest frames the trace keeps "
+		"(default %u)\n"
+		"  -S path      client socket for tools (default %s;\n"
+		"               \"\" turns it off)\n"
+		"  -r priority  run under SCHED_FIFO at priority (1-99) with "
+		"memory locked\n"
+		"  -c cpu       pin the daemon to cpu\n"
+		"  -w us        hold register reads up to us (at most %d) to "
+		"merge them\n"
+		"  -P addr:reg:count:ms\n"
+		"               have the firmware push count registers every "
+		"ms and answer\n"
+		"               reads of them from there; up to %d\n"
+		"  -k           let the driver frame transfers and only relay "
+		"bytes\n"
+		"               (no -w, -P, -t or client socket)\n",
+		name, MAX_INSTANCES, BAUDRATE, EUB_BRIDGE_FEAT_ALL,
+		STATS_PATH, TRACE_SIZE, EUB_SOCKET_PATH, HOLD_MAX, MAX_PUSHES);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *uart_paths[MAX_INSTANCES] = { "/dev/serial0" };
+	const char *proxy_paths[MAX_INSTANCES] = { "/dev/i2c-proxy3" };
+	int num_uarts = 0;
+	int num_proxies = 0;
+	const char *stats_path = STATS_PATH;
+	const char *trace_path = NULL;
+	unsigned int trace_size = TRACE_SIZE;
+	const char *socket_path = EUB_SOCKET_PATH;
+	int priority = 0;
+	int cpu = -1;
+	int hold_us = 0;
+	int framed = 0;
+	unsigned int baudrate = BAUDRATE;
+	int rtscts = 0;
+	uint16_t features = EUB_BRIDGE_FEAT_ALL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:p:b:fm:s:t:T:S:r:c:w:P:kh")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (num_uarts == MAX_INSTANCES) {
+				usage(argv[0]);
+				return 1;
+			}
+			uart_paths[num_uarts++] = optarg;
+			break;
+		case 'p':
+			if (num_proxies == MAX_INSTANCES) {
+				usage(argv[0]);
+				return 1;
+			}
+			proxy_paths[num_proxies++] = optarg;
+			break;
+		case 'b':
+			baudrate = strtoul(optarg, NULL, 0);
+			if (uart_speed(baudrate) == B0) {
+				fprintf(stderr, "unsupported baud rate: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'f':
+			rtscts = 1;
+			break;
+		case 'm':
+			features = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			stats_path = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'T':
+			trace_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'r':
+			priority = strtol(optarg, NULL, 0);
+			if (priority < sched_get_priority_min(SCHED_FIFO) ||
+			    sched_get_priority_max(SCHED_FIFO) < priority) {
+				fprintf(stderr, "invalid priority: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			cpu = strtol(optarg, NULL, 0);
+			break;
+		case 'w':
+			hold_us = strtol(optarg, NULL, 0);
+			if (hold_us < 0 || HOLD_MAX < hold_us) {
+				fprintf(stderr, "invalid hold time: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'P':
+			if (num_subscriptions == MAX_PUSHES ||
+			    parse_subscription(optarg,
+				    &subscriptions[num_subscriptions]) < 0) {
+				fprintf(stderr, "invalid subscription: %s\n",
+					optarg);
+				return 1;
+			}
+			++num_subscriptions;
+			break;
+		case 'k':
+			framed = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	// the defaults make the first link
+	num_instances = (num_uarts < num_proxies) ? num_proxies : num_uarts;
+	if (num_instances == 0)
+		num_instances = 1;
+	if (1 < num_instances && num_uarts != num_proxies) {
+		fprintf(stderr, "give a uart and a proxy for every link\n");
+		return 1;
+	}
+	// the daemon never sees a transfer in the framed mode
+	if (framed) {
+		if (hold_us || num_subscriptions || trace_path) {
+			fprintf(stderr, "-k does not go with -w, -P or -t\n");
+			return 1;
+		}
+		socket_path = NULL;
+	}
+
+	for (int n = 0; n < num_instances; ++n) {
+		struct instance *inst = calloc(1, sizeof *inst);
+		if (!inst) {
+			perror("calloc");
+			return 1;
+		}
+		instances[n] = inst;
+		inst->uart_path = uart_paths[n];
+		inst->proxy_path = proxy_paths[n];
+		inst->framed = framed;
+		if (instance_path(inst->stats_path, stats_path, n) < 0 ||
+		    instance_path(inst->trace_path, trace_path, n) < 0 ||
+		    instance_path(inst->socket_path, socket_path, n) < 0) {
+			fprintf(stderr, "path too long\n");
+			return 1;
+		}
+		if (instance_open(inst, baudrate, rtscts, features,
+				  (size_t) trace_size * 1024, hold_us) < 0) {
+			while (0 < n--)
+				link_close(&instances[n]->link);
+			return 1;
+		}
+	}
+
+	// everything is allocated by now; the threads inherit the mode
+	if ((priority || 0 <= cpu) && realtime_setup(priority, cpu) < 0) {
+		for (int n = 0; n < num_instances; ++n)
+			link_close(&instances[n]->link);
+		return 1;
+	}
+
+	// only the main thread takes SIGTERM, and passes it on to the links
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK);
+	for (int n = 0; n < num_instances; ++n) {
+		if (pthread_create(&instances[n]->thread, &attr, instance_run,
+				   instances[n]) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	int sig;
+	while (sigwait(&mask, &sig) != 0)
+		;
+	quit_flag = 1;
+	for (int n = 0; n < num_instances; ++n)
+		wake(instances[n]);
+	for (int n = 0; n < num_instances; ++n)
+		pthread_join(instances[n]->thread, NULL);
 	return 0;
 }
@@ -0,0 +1,468 @@
+/*
+ * Esrille Unbrick I2C Bridge Benchmark
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * eub_i2cbench drives the bridge UART directly, the same way
+ * eub_i2cattach does, and reports the round-trip time of a register read
+ * (a one-byte write followed by a read) together with the throughput.
+ * With PIPELINE, it keeps as many reads in flight as the window allows.
+ * Run it against eub_i2cstub, or against the board with eub-i2c.service
+ * stopped. -H starts processes that keep the CPUs busy meanwhile, to see
+ * what the real-time mode of eub_i2cattach, -r and -c here as well, does
+ * for the latency under load.
+ *
+ * With -i, it goes through an eub_i2c adapter instead, with eub_i2cattach
+ * serving it, and -j client threads read at once, each every -t
+ * microseconds or back to back, the way the drivers on the bridge share
+ * it. It then reports the round-trip time of each client, and how evenly
+ * the adapter has served them as Jain's fairness index of their transfer
+ * rates, 1 when all got the same.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "eub_i2c.h"
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/* Holds the clients back until all have started, or one has failed to. */
+struct gate {
+	pthread_mutex_t lock;
+	pthread_cond_t opened;
+	int state;		/* 0 closed, 1 open, -1 given up */
+};
+
+static void gate_set(struct gate *gate, int state)
+{
+	pthread_mutex_lock(&gate->lock);
+	gate->state = state;
+	pthread_cond_broadcast(&gate->opened);
+	pthread_mutex_unlock(&gate->lock);
+}
+
+static int gate_wait(struct gate *gate)
+{
+	pthread_mutex_lock(&gate->lock);
+	while (!gate->state)
+		pthread_cond_wait(&gate->opened, &gate->lock);
+	int state = gate->state;
+	pthread_mutex_unlock(&gate->lock);
+	return state;
+}
+
+/* A thread reading registers through the adapter, with -i. */
+struct client {
+	pthread_t thread;
+	int fd;
+	int count;
+	int period_us;
+	uint16_t addr;
+	uint8_t reg;
+	uint16_t len;
+	struct gate *start;
+	int64_t *rtt;
+	int errors;
+	int64_t elapsed;
+};
+
+static void *client_run(void *arg)
+{
+	struct client *client = arg;
+	uint8_t buf[client->len];
+	struct i2c_msg msgs[2] = {
+		{ client->addr, 0, 1, &client->reg },
+		{ client->addr, I2C_M_RD, client->len, buf },
+	};
+	struct i2c_rdwr_ioctl_data data = { msgs, 2 };
+
+	if (gate_wait(client->start) < 0)
+		return NULL;
+	int64_t start = now_us();
+	for (int i = 0; i < client->count; ++i) {
+		int64_t sent = now_us();
+		if (ioctl(client->fd, I2C_RDWR, &data) < 0)
+			++client->errors;
+		int64_t end = now_us();
+		client->rtt[i] = end - sent;
+		if (end < sent + client->period_us)
+			usleep(sent + client->period_us - end);
+	}
+	client->elapsed = now_us() - start;
+	return NULL;
+}
+
+/*
+ * Run num_clients clients reading through the adapter at once, count
+ * register reads each, and report how they fared. Returns the exit
+ * status.
+ */
+static int adapter_bench(const char *adapter_path, int num_clients,
+			 int count, int period_us, uint16_t addr,
+			 uint8_t reg, uint16_t len)
+{
+	struct client clients[num_clients];
+	struct gate start = {
+		PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0
+	};
+	int64_t *rtt = calloc((size_t) num_clients * count, sizeof(int64_t));
+	int started = 0;
+
+	if (!rtt) {
+		perror("calloc");
+		return 1;
+	}
+	for (int n = 0; n < num_clients; ++n) {
+		struct client *client = &clients[n];
+		memset(client, 0, sizeof *client);
+		client->fd = open(adapter_path, O_RDWR);
+		if (client->fd < 0) {
+			perror(adapter_path);
+			break;
+		}
+		client->count = count;
+		client->period_us = period_us;
+		client->addr = addr;
+		client->reg = reg;
+		client->len = len;
+		client->start = &start;
+		client->rtt = rtt + (size_t) n * count;
+		if (pthread_create(&client->thread, NULL, client_run,
+				   client) != 0) {
+			perror("pthread_create");
+			close(client->fd);
+			break;
+		}
+		++started;
+	}
+	if (started < num_clients) {
+		gate_set(&start, -1);
+		for (int n = 0; n < started; ++n) {
+			pthread_join(clients[n].thread, NULL);
+			close(clients[n].fd);
+		}
+		free(rtt);
+		return 1;
+	}
+	int64_t begin = now_us();
+	gate_set(&start, 1);
+	for (int n = 0; n < num_clients; ++n)
+		pthread_join(clients[n].thread, NULL);
+	int64_t elapsed = now_us() - begin;
+
+	printf("adapter     %s, %d clients, period %d us\n",
+	       adapter_path, num_clients, period_us);
+	int errors = 0;
+	double sum = 0, squares = 0;
+	for (int n = 0; n < num_clients; ++n) {
+		struct client *client = &clients[n];
+		double rate = count * 1e6 / client->elapsed;
+		qsort(client->rtt, count, sizeof(int64_t), compare);
+		printf("client %-4d %d transfers (%d errors), p50 %lld us, "
+		       "p99 %lld us, max %lld us, %.1f transfers/s\n",
+		       n, count, client->errors,
+		       (long long) client->rtt[count / 2],
+		       (long long) client->rtt[count * 99 / 100],
+		       (long long) client->rtt[count - 1], rate);
+		errors += client->errors;
+		sum += rate;
+		squares += rate * rate;
+		close(client->fd);
+	}
+	int total = num_clients * count;
+	qsort(rtt, total, sizeof(int64_t), compare);
+	printf("transfers   %d (%d errors)\n", total, errors);
+	printf("rtt min     %lld us\n", (long long) rtt[0]);
+	printf("rtt p50     %lld us\n", (long long) rtt[total / 2]);
+	printf("rtt p99     %lld us\n", (long long) rtt[total * 99 / 100]);
+	printf("rtt max     %lld us\n", (long long) rtt[total - 1]);
+	printf("transfers/s %.1f\n", total * 1e6 / elapsed);
+	printf("fairness    %.3f\n", sum * sum / (num_clients * squares));
+
+	free(rtt);
+	return errors ? 2 : 0;
+}
+
+/* Start count processes that spin until killed. */
+static void start_hogs(pid_t *hogs, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		hogs[i] = fork();
+		if (hogs[i] == 0)
+			for (;;)
+				;
+		if (hogs[i] < 0)
+			perror("fork");
+	}
+}
+
+static void stop_hogs(pid_t *hogs, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		if (0 < hogs[i]) {
+			kill(hogs[i], SIGKILL);
+			waitpid(hogs[i], NULL, 0);
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d uart] [-b baudrate] [-f] [-m mask] [-n count] "
+		"[-a addr] [-r reg] [-l len]\n"
+		"       [-p priority] [-c cpu] [-H hogs] "
+		"[-i adapter [-j clients] [-t period]]\n"
+		"  -d uart      serial device (default /dev/serial0)\n"
+		"  -b baudrate  highest baud rate to negotiate (default %u)\n"
+		"  -f           use RTS/CTS flow control above the default rate\n"
+		"  -m mask      framing features to enable (default 0x%04x)\n"
+		"  -n count     number of register reads (default 1000)\n"
+		"  -a addr      I2C address (default 0x08)\n"
+		"  -r reg       first register (default 0x05)\n"
+		"  -l len       bytes to read (default 6)\n"
+		"  -p priority  run under SCHED_FIFO at priority with memory "
+		"locked\n"
+		"  -c cpu       pin the benchmark to cpu\n"
+		"  -H hogs      processes to keep the CPUs busy meanwhile "
+		"(default 0)\n"
+		"  -i adapter   read through the eub_i2c adapter, e.g. "
+		"/dev/i2c-3, instead\n"
+		"  -j clients   threads reading through the adapter at once, "
+		"count reads each\n"
+		"               (default 1)\n"
+		"  -t period    microseconds from one read of a client to "
+		"the next (default 0)\n",
+		name, BAUDRATE, EUB_BRIDGE_FEAT_ALL);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *uart_path = "/dev/serial0";
+	unsigned int baudrate = BAUDRATE;
+	int rtscts = 0;
+	uint16_t features = EUB_BRIDGE_FEAT_ALL;
+	int count = 1000;
+	uint16_t addr = 0x08;
+	uint8_t reg = 0x05;
+	uint16_t len = 6;
+	int priority = 0;
+	int cpu = -1;
+	int num_hogs = 0;
+	const char *adapter_path = NULL;
+	int num_clients = 1;
+	int period_us = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:b:fm:n:a:r:l:p:c:H:i:j:t:h")) !=
+	       -1) {
+		switch (opt) {
+		case 'd':
+			uart_path = optarg;
+			break;
+		case 'b':
+			baudrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			rtscts = 1;
+			break;
+		case 'm':
+			features = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtol(optarg, NULL, 0);
+			break;
+		case 'a':
+			addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			reg = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			len = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			priority = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			cpu = strtol(optarg, NULL, 0);
+			break;
+		case 'H':
+			num_hogs = strtol(optarg, NULL, 0);
+			break;
+		case 'i':
+			adapter_path = optarg;
+			break;
+		case 'j':
+			num_clients = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			period_us = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (count <= 0 || num_hogs < 0 || num_clients <= 0 || period_us < 0 ||
+	    LEN_BUFFER < 2 * I2C_MSG_HDR_SIZE + 1 + len) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (adapter_path) {
+		pid_t hogs[num_hogs + 1];
+		start_hogs(hogs, num_hogs);
+		if ((priority || 0 <= cpu) && realtime_setup(priority, cpu) < 0) {
+			stop_hogs(hogs, num_hogs);
+			return 1;
+		}
+		int ret = adapter_bench(adapter_path, num_clients, count,
+					period_us, addr, reg, len);
+		stop_hogs(hogs, num_hogs);
+		return ret;
+	}
+
+	static struct eub_link link;
+	if (link_open(&link, uart_path, baudrate, rtscts, features) < 0)
+		return 1;
+
+	int64_t *rtt = calloc(count, sizeof(int64_t));
+	if (!rtt) {
+		perror("calloc");
+		return 1;
+	}
+
+	/*
+	 * With PIPELINE, keep the window full; every transfer has a buffer
+	 * of its own until it completes.
+	 */
+	static uint8_t buffers[LINK_WINDOW][LEN_BUFFER];
+	int64_t *sent = calloc(count, sizeof(int64_t));
+	if (!sent) {
+		perror("calloc");
+		return 1;
+	}
+	pid_t hogs[num_hogs + 1];
+	start_hogs(hogs, num_hogs);
+	if ((priority || 0 <= cpu) && realtime_setup(priority, cpu) < 0) {
+		stop_hogs(hogs, num_hogs);
+		link_close(&link);
+		return 1;
+	}
+
+	int split = link_format(&link) & EUB_I2C_FORMAT_SPLIT;
+	int errors = 0;
+	size_t bytes = 0;	// frame payloads each way
+	int submitted = 0;
+	int done = 0;
+	int64_t start = now_us();
+	while (done < count) {
+		while (submitted < count && link.inflight < link.window) {
+			uint8_t *buffer = buffers[submitted % LINK_WINDOW];
+			uint8_t *p = buffer;
+			int format = link_format(&link);
+			p = i2c_pack_msg(p, format, addr, 0, 1, &reg);
+			p = i2c_pack_msg(p, format, addr, I2C_M_RD, len, NULL);
+			size_t size = p - buffer;
+
+			int i = submitted++;
+			sent[i] = now_us();
+			bytes += size;
+			if (link_fits(&link, buffer, size)) {
+				if (link_submit(&link, i, buffer, size) < 0) {
+					++errors;
+					rtt[i] = now_us() - sent[i];
+					++done;
+				}
+				continue;
+			}
+			// fragmented transfers go one at a time
+			int ret = link_xfer(&link, buffer, size);
+			if (ret < 0)
+				++errors;
+			else
+				bytes += ret + (split ? 1 : 0);
+			rtt[i] = now_us() - sent[i];
+			++done;
+		}
+		if (done == count)
+			break;
+
+		uint32_t tag;
+		int ret = link_reap(&link, &tag, -1);
+		if (ret == LINK_TIMEOUT)
+			continue;
+		if (ret < 0)
+			++errors;
+		else
+			bytes += ret + (split ? 1 : 0);
+		rtt[tag] = now_us() - sent[tag];
+		++done;
+	}
+	int64_t elapsed = now_us() - start;
+	stop_hogs(hogs, num_hogs);
+
+	qsort(rtt, count, sizeof(int64_t), compare);
+	printf("baudrate    %u%s\n", link.baudrate, rtscts ? " rts/cts" : "");
+	printf("features    0x%04x (max frame %u, window %u)\n",
+	       link.features, link.max_frame, link.window);
+	if (priority || 0 <= cpu || num_hogs)
+		printf("scheduling  priority %d, cpu %d, %d hogs\n",
+		       priority, cpu, num_hogs);
+	printf("transfers   %d (%d errors)\n", count, errors);
+	printf("recovery    %lu retransmits, %lu timeouts, %lu corrupt\n",
+	       link.retransmits, link.timeouts, link.corrupt);
+	printf("rtt min     %lld us\n", (long long) rtt[0]);
+	printf("rtt p50     %lld us\n", (long long) rtt[count / 2]);
+	printf("rtt p99     %lld us\n", (long long) rtt[count * 99 / 100]);
+	printf("rtt max     %lld us\n", (long long) rtt[count - 1]);
+	printf("transfers/s %.1f\n", count * 1e6 / elapsed);
+	printf("bytes/s     %.1f\n", bytes * 1e6 / elapsed);
+
+	free(sent);
+	free(rtt);
+	link_close(&link);
+	return errors ? 2 : 0;
+}
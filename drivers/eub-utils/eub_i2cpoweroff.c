@@ -19,29 +19,62 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/file.h>
 #include "eub_i2c.h"
 
+#define CLIENT_TIMEOUT	1000	// milliseconds
+
+static const char *const socket_paths[] = {
+	EUB_SOCKET_PATH, EUB_SOCKET_PATH ".0",
+};
+
 int main()
 {
-	uint8_t buffer[LEN_BUFFER + 2];
+	static struct eub_link link;
+	uint8_t buffer[LEN_LEGACY];
+	uint8_t data[2] = { 1, 0 };
+	uint8_t *end = i2c_pack_msg(buffer, EUB_I2C_FORMAT_RAW, 9, 0,
+				    sizeof data, data);
+
+	// while eub_i2cattach serves the bridge, it runs the transfer; with
+	// several links, the power board is on the first one
+	for (size_t i = 0; i < sizeof socket_paths / sizeof *socket_paths;
+	     ++i) {
+		int fd = client_connect(socket_paths[i]);
+		if (fd < 0)
+			continue;
+		int ret = client_xfer(fd, buffer, end - buffer,
+				      CLIENT_TIMEOUT);
+		close(fd);
+		if (ret < 0) {
+			fprintf(stderr, "%s: %s\n", socket_paths[i],
+				strerror(-ret));
+			return 1;
+		}
+		return 0;
+	}
 
+	// eub-poweroff.service runs after eub-i2c.service has stopped; should
+	// eub_i2cattach still hold the UART, give up rather than write next
+	// to it
 	int uart = open("/dev/serial0", O_RDWR | O_NOCTTY | O_NONBLOCK);
 	if (uart < 0) {
 		perror("open serial0");
 		return 1;
 	}
+	if (flock(uart, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "serial0: %s\n", (errno == EWOULDBLOCK) ?
+			"in use by another program" : strerror(errno));
+		close(uart);
+		return 1;
+	}
 
-	struct i2c_packed_msg *msg = (struct i2c_packed_msg *) &buffer[1];
-	msg->addr = 9;
-	msg->flags = 0;
-	msg->len = 2;
-	msg->buf[0] = 1;
-	msg->buf[1] = 0;
-	lockf(uart, F_LOCK, 0);
-	i2c_xfer(uart, buffer, 7);
-	lockf(uart, F_ULOCK, 0);
+	link_attach(&link, uart);
+	link_xfer(&link, buffer, end - buffer);
 
 	close(uart);
 	return 0;
@@ -0,0 +1,466 @@
+/*
+ * Esrille Unbrick I2C Bridge Trace Replay
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * eub_i2creplay reads a frame trace recorded by eub_i2cattach -t, pulls
+ * out the I2C transfers the host sent, and sends them again over a link
+ * of its own, typically to eub_i2cstub, at the pace they were recorded at
+ * or faster. The transfers are packed afresh for the framing features
+ * negotiated now, so that the same session can be compared across
+ * protocol changes. Bridge control transfers and retransmissions are left
+ * out. It reports the round-trip times in the trace next to the latency
+ * of the replay, measured from when each transfer was due.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <linux/i2c.h>
+
+#include "eub_i2c.h"
+
+/* a transfer from the trace, packed in EUB_I2C_FORMAT_RAW */
+struct xfer {
+	int64_t time_us;	/* when its first frame was sent */
+	int64_t rtt_us;		/* until its last reply, or -1 */
+	size_t len;
+	size_t last;		/* offset of the last message */
+	uint8_t *buf;
+};
+
+static struct xfer *xfers;
+static size_t num_xfers;
+static uint16_t recorded_features;
+static double speed = 1;
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Decode the frame of rec into buf. Returns the length of its payload,
+ * which starts at *payload, or -1 if the frame is damaged, and stores its
+ * control byte and sequence number, -1 without CRC.
+ */
+static ssize_t decode_frame(const struct eub_trace_rec *rec, uint8_t *buf,
+			    uint8_t **payload, uint8_t *ctl, int *seq)
+{
+	uint16_t features = rec->features;
+	size_t hdr = !features ? 0 : (features & EUB_BRIDGE_FEAT_CRC) ? 2 : 1;
+	size_t trailer = (features & EUB_BRIDGE_FEAT_CRC) ? 2 : 0;
+
+	memcpy(buf, rec + 1, rec->len);
+	size_t len = cobs_decode(buf, rec->len);
+	if (len == 0 || len < hdr + trailer)
+		return -1;
+	if (trailer) {
+		len -= trailer;
+		if (crc16(EUB_BRIDGE_CRC16_INIT, buf, len) !=
+		    (buf[len] | buf[len + 1] << 8))
+			return -1;
+	}
+	*ctl = hdr ? buf[0] : 0;
+	*seq = (1 < hdr) ? buf[1] : -1;
+	*payload = buf + hdr;
+	return len - hdr;
+}
+
+static struct xfer *new_xfer(int64_t time_us)
+{
+	if (num_xfers % 1024 == 0) {
+		struct xfer *p = realloc(xfers, (num_xfers + 1024) *
+						sizeof *xfers);
+		if (!p) {
+			perror("realloc");
+			exit(1);
+		}
+		xfers = p;
+	}
+	struct xfer *xfer = &xfers[num_xfers++];
+	xfer->time_us = time_us;
+	xfer->rtt_us = -1;
+	xfer->len = 0;
+	xfer->buf = malloc(LEN_BUFFER);
+	if (!xfer->buf) {
+		perror("malloc");
+		exit(1);
+	}
+	return xfer;
+}
+
+/*
+ * Append the messages in the payload of a frame to xfer, joining a
+ * message continued from the previous frame to its first part. Returns
+ * 1 if the frame holds a bridge control transfer, 0 otherwise, or -1 if
+ * the messages are malformed.
+ */
+static int add_messages(struct xfer *xfer, uint8_t *p, size_t len,
+			int format, int continued)
+{
+	uint8_t *end = p + len;
+	struct i2c_smbus_op op;
+	uint8_t cmd[2];
+
+	/*
+	 * an SMBus op goes in as the messages it stands for, a block read
+	 * as a read of its largest answer
+	 */
+	switch (i2c_unpack_op(p, len, format, &op)) {
+	case 1:
+		cmd[0] = op.cmd;
+		cmd[1] = op.value;
+		xfer->last = xfer->len;
+		xfer->len = i2c_pack_msg(xfer->buf + xfer->len,
+					 EUB_I2C_FORMAT_RAW, op.addr, 0,
+					 (op.op == EUB_I2C_SMBUS_WRITE_BYTE_DATA) ?
+					 2 : 1, cmd) - xfer->buf;
+		if (op.op != EUB_I2C_SMBUS_WRITE_BYTE_DATA) {
+			xfer->last = xfer->len;
+			xfer->len = i2c_pack_msg(xfer->buf + xfer->len,
+						 EUB_I2C_FORMAT_RAW, op.addr,
+						 I2C_M_RD,
+						 i2c_op_reply_size(op.op),
+						 NULL) - xfer->buf;
+		}
+		return 0;
+	case -1:
+		return -1;
+	}
+	while (p < end) {
+		struct i2c_packed_msg msg;
+		uint8_t *data = i2c_unpack_msg(p, end, format, &msg);
+		if (!data)
+			return -1;
+		if (msg.addr == EUB_BRIDGE_ADDR)
+			return 1;
+		size_t size = i2c_msg_data_size(format, &msg);
+		// what a read carries in the request is of no use
+		const uint8_t *write = (msg.flags & I2C_M_RD) ? NULL : data;
+		if (LEN_BUFFER < xfer->len + I2C_MSG_HDR_SIZE + msg.len)
+			return -1;
+		if (continued && (msg.flags & I2C_M_NOSTART) && xfer->len) {
+			uint8_t *last = xfer->buf + xfer->last;
+			uint16_t last_len;
+			memcpy(&last_len, last + 4, sizeof last_len);
+			last_len += msg.len;
+			memcpy(last + 4, &last_len, sizeof last_len);
+			if (write)
+				memcpy(xfer->buf + xfer->len, write, size);
+			else
+				memset(xfer->buf + xfer->len, 0, msg.len);
+			xfer->len += msg.len;
+		} else {
+			xfer->last = xfer->len;
+			xfer->len = i2c_pack_msg(xfer->buf + xfer->len,
+						 EUB_I2C_FORMAT_RAW, msg.addr,
+						 msg.flags, msg.len, write) -
+				    xfer->buf;
+		}
+		continued = 0;
+		p = data + size;
+	}
+	return 0;
+}
+
+/*
+ * Collect the transfers of the trace at path into xfers. Returns the
+ * number of transfers, or -1 if the trace cannot be read.
+ */
+static int load_trace(const char *path)
+{
+	static uint8_t frame[COBS_SIZE(LEN_BUFFER + 4)];
+	static struct {
+		size_t xfer;	/* index + 1, or 0 */
+		int last;	/* the last frame of its transfer */
+	} by_seq[256], no_crc;
+	struct eub_trace trace = { 0 };
+	struct xfer *open_xfer = NULL;	// continued in the next frame
+	int recent[LINK_WINDOW];	// sequence numbers last sent
+	unsigned int next_recent = 0;
+	uint64_t pos;
+	const struct eub_trace_rec *rec;
+
+	if (trace_open(&trace, path) < 0)
+		return -1;
+	for (int i = 0; i < LINK_WINDOW; ++i)
+		recent[i] = -1;
+	pos = trace.hdr->tail;
+	while ((rec = trace_next(&trace, &pos))) {
+		uint8_t *payload;
+		uint8_t ctl;
+		int seq;
+
+		if (sizeof frame < rec->len)
+			continue;
+		ssize_t len = decode_frame(rec, frame, &payload, &ctl, &seq);
+		if (len < 0)
+			continue;
+
+		if (rec->dir == EUB_TRACE_RX) {
+			if (ctl & EUB_FRAME_NAK)
+				continue;
+			typeof(&no_crc) match = (seq < 0) ? &no_crc
+							  : &by_seq[seq];
+			if (match->xfer && match->last) {
+				struct xfer *xfer = &xfers[match->xfer - 1];
+				if (xfer->rtt_us < 0)
+					xfer->rtt_us = rec->time_us -
+						       xfer->time_us;
+			}
+			match->xfer = 0;
+			continue;
+		}
+
+		int skip = 0;
+		for (int i = 0; i < LINK_WINDOW; ++i)
+			skip |= 0 <= seq && recent[i] == seq;
+		if (skip)
+			continue;	// sent again
+		if (0 <= seq) {
+			recent[next_recent] = seq;
+			next_recent = (next_recent + 1) % LINK_WINDOW;
+		}
+
+		recorded_features = rec->features;
+		int continued = open_xfer != NULL;
+		struct xfer *xfer = continued ? open_xfer
+					      : new_xfer(rec->time_us);
+		int ret = add_messages(xfer, payload, len,
+				       bridge_format(rec->features),
+				       continued);
+		if (ret != 0 || xfer->len == 0) {
+			// drop control transfers and whatever is malformed
+			if (xfer == &xfers[num_xfers - 1]) {
+				free(xfer->buf);
+				--num_xfers;
+			}
+			open_xfer = NULL;
+			continue;
+		}
+		open_xfer = (ctl & EUB_FRAME_MORE) ? xfer : NULL;
+		typeof(&no_crc) match = (seq < 0) ? &no_crc : &by_seq[seq];
+		match->xfer = xfer - xfers + 1;
+		match->last = !open_xfer;
+	}
+	if (open_xfer) {
+		free(open_xfer->buf);
+		--num_xfers;
+	}
+	trace_close(&trace);
+	return num_xfers;
+}
+
+/* Returns when the transfer i is due, counting from start. */
+static int64_t due_us(int64_t start, size_t i)
+{
+	if (!speed)
+		return start;
+	return start + (xfers[i].time_us - xfers[0].time_us) / speed;
+}
+
+static void print_times(const char *name, int64_t *us, size_t count)
+{
+	if (!count) {
+		printf("%-11s -\n", name);
+		return;
+	}
+	qsort(us, count, sizeof(int64_t), compare);
+	printf("%-11s p50 %lld us, p99 %lld us, max %lld us\n", name,
+	       (long long) us[count / 2], (long long) us[count * 99 / 100],
+	       (long long) us[count - 1]);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d uart] [-b baudrate] [-f] [-m mask] [-x speed] "
+		"trace\n"
+		"  -d uart      serial device (default /dev/serial0)\n"
+		"  -b baudrate  highest baud rate to negotiate (default %u)\n"
+		"  -f           use RTS/CTS flow control above the default rate\n"
+		"  -m mask      framing features to enable (default 0x%04x)\n"
+		"  -x speed     replay speed; 0 sends as fast as possible "
+		"(default 1)\n",
+		name, BAUDRATE, EUB_BRIDGE_FEAT_ALL);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *uart_path = "/dev/serial0";
+	unsigned int baudrate = BAUDRATE;
+	int rtscts = 0;
+	uint16_t features = EUB_BRIDGE_FEAT_ALL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:b:fm:x:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			uart_path = optarg;
+			break;
+		case 'b':
+			baudrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			rtscts = 1;
+			break;
+		case 'm':
+			features = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			speed = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc != optind + 1 || speed < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (load_trace(argv[optind]) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (!num_xfers) {
+		fprintf(stderr, "%s: no transfers\n", argv[optind]);
+		return 1;
+	}
+
+	static struct eub_link link;
+	if (link_open(&link, uart_path, baudrate, rtscts, features) < 0)
+		return 1;
+
+	int64_t *recorded = calloc(num_xfers, sizeof(int64_t));
+	int64_t *latency = calloc(num_xfers, sizeof(int64_t));
+	int64_t *due = calloc(num_xfers, sizeof(int64_t));
+	if (!recorded || !latency || !due) {
+		perror("calloc");
+		return 1;
+	}
+	size_t num_recorded = 0;
+	for (size_t i = 0; i < num_xfers; ++i) {
+		if (0 <= xfers[i].rtt_us)
+			recorded[num_recorded++] = xfers[i].rtt_us;
+	}
+
+	/*
+	 * Send each transfer once it is due and keep the window as full as
+	 * the pace allows. The latency of a transfer runs from when it was
+	 * due, so that a replay falling behind shows up in the figures, or
+	 * from when it was sent if the replay goes as fast as it can.
+	 */
+	static uint8_t buffers[LINK_WINDOW][LEN_BUFFER];
+	int64_t start = now_us();
+	int errors = 0;
+	size_t submitted = 0;
+	size_t done = 0;
+	while (done < num_xfers) {
+		int blocked = 0;	// a fragmented transfer waits for the rest
+
+		while (submitted < num_xfers && link.inflight < link.window) {
+			size_t i = submitted;
+			if (now_us() < due_us(start, i))
+				break;
+			due[i] = speed ? due_us(start, i) : now_us();
+			uint8_t *buffer = buffers[i % LINK_WINDOW];
+			ssize_t size = i2c_repack(buffer, LEN_BUFFER,
+						  link_format(&link),
+						  xfers[i].buf, xfers[i].len,
+						  EUB_I2C_FORMAT_RAW);
+			if (size < 0 || link_fits(&link, buffer, size)) {
+				++submitted;
+				if (size < 0 ||
+				    link_submit(&link, i, buffer, size) < 0) {
+					++errors;
+					latency[i] = now_us() - due[i];
+					++done;
+				}
+				continue;
+			}
+			// fragmented transfers go one at a time
+			if (link.inflight) {
+				blocked = 1;
+				break;
+			}
+			++submitted;
+			if (link_xfer(&link, buffer, size) < 0)
+				++errors;
+			latency[i] = now_us() - due[i];
+			++done;
+		}
+		if (done == num_xfers)
+			break;
+
+		int timeout = -1;
+		if (!blocked && submitted < num_xfers &&
+		    link.inflight < link.window) {
+			int64_t wait = due_us(start, submitted) - now_us();
+			timeout = (0 < wait) ? (wait + 999) / 1000 : 0;
+		}
+		if (!link.inflight) {
+			if (0 < timeout)
+				usleep(due_us(start, submitted) - now_us());
+			continue;
+		}
+		uint32_t tag;
+		int ret = link_reap(&link, &tag, timeout);
+		if (ret == LINK_TIMEOUT)
+			continue;
+		if (ret < 0)
+			++errors;
+		latency[tag] = now_us() - due[tag];
+		++done;
+	}
+	int64_t elapsed = now_us() - start;
+	int64_t span = xfers[num_xfers - 1].time_us - xfers[0].time_us;
+
+	printf("transfers   %zu (%d errors)\n", num_xfers, errors);
+	printf("recorded    %.3f s, features 0x%04x\n", span / 1e6,
+	       recorded_features);
+	printf("replayed    %.3f s at %u baud, features 0x%04x, window %u\n",
+	       elapsed / 1e6, link.baudrate, link.features, link.window);
+	print_times("rtt", recorded, num_recorded);
+	print_times("latency", latency, num_xfers);
+	printf("transfers/s %.1f recorded, %.1f replayed\n",
+	       span ? num_xfers * 1e6 / span : 0.0,
+	       num_xfers * 1e6 / elapsed);
+
+	free(due);
+	free(latency);
+	free(recorded);
+	link_close(&link);
+	return errors ? 2 : 0;
+}
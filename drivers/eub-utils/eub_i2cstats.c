@@ -0,0 +1,233 @@
+/*
+ * Esrille Unbrick I2C Bridge Statistics
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+
+#include "eub_i2c.h"
+
+/*
+ * Histograms keep four buckets per power of two, which bounds the error
+ * of a percentile to a quarter of its value while a sample costs no more
+ * than a few instructions. Values below 4 us get buckets of their own, and
+ * the last bucket takes everything from about 2^32 us on.
+ */
+#define HIST_BUCKETS	128
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+#define ADDR_OTHER	128	/* 10 bit and bridge control addresses */
+#define ADDR_ALL	129
+#define NUM_ADDRS	130
+
+struct addr_stats {
+	unsigned long transfers;
+	unsigned long errors;
+	struct hist phases[NUM_PHASES];
+};
+
+/* The statistics of one link */
+struct eub_stats {
+	struct addr_stats addrs[NUM_ADDRS];
+	int64_t started_us;
+	int64_t last_us;
+	unsigned long last_frames;
+	unsigned long long last_bytes;
+};
+
+static const char *const phase_names[NUM_PHASES] = {
+	"handoff", "tx", "wait", "rx", "writeback", "total",
+};
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int hist_bucket(uint64_t v)
+{
+	unsigned int msb, i;
+
+	if (v < 4)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	i = (msb - 1) * 4 + ((v >> (msb - 2)) & 3);
+	return (i < HIST_BUCKETS) ? i : HIST_BUCKETS - 1;
+}
+
+/* Returns the smallest value that falls in bucket i. */
+static uint64_t hist_lower(unsigned int i)
+{
+	if (i < 4)
+		return i;
+	return (uint64_t) (4 + i % 4) << (i / 4 - 1);
+}
+
+static void hist_add(struct hist *hist, uint64_t v)
+{
+	++hist->count;
+	hist->sum += v;
+	if (hist->max < v)
+		hist->max = v;
+	++hist->buckets[hist_bucket(v)];
+}
+
+/* Returns the upper bound of the bucket holding the pct percentile. */
+static uint64_t hist_percentile(const struct hist *hist, unsigned int pct)
+{
+	uint64_t rank = (hist->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS - 1; ++i) {
+		seen += hist->buckets[i];
+		if (rank <= seen)
+			break;
+	}
+	if (i == HIST_BUCKETS - 1 || hist->max < hist_lower(i + 1) - 1)
+		return hist->max;
+	return hist_lower(i + 1) - 1;
+}
+
+/* Returns empty statistics, or NULL if out of memory. */
+struct eub_stats *stats_create(void)
+{
+	return calloc(1, sizeof(struct eub_stats));
+}
+
+/*
+ * Record a transfer to addr, the address of its first message, which took
+ * us[] microseconds in each phase.
+ */
+void stats_record(struct eub_stats *stats, uint16_t addr,
+		  const int64_t us[NUM_PHASES], int failed)
+{
+	struct addr_stats *addrs[2] = {
+		&stats->addrs[(addr < ADDR_OTHER) ? addr : ADDR_OTHER],
+		&stats->addrs[ADDR_ALL],
+	};
+	int i, j;
+
+	if (!stats->started_us)
+		stats->started_us = stats->last_us = now_us();
+	for (i = 0; i < 2; ++i) {
+		++addrs[i]->transfers;
+		if (failed)
+			++addrs[i]->errors;
+		for (j = 0; j < NUM_PHASES; ++j)
+			hist_add(&addrs[i]->phases[j],
+				 (0 < us[j]) ? us[j] : 0);
+	}
+}
+
+static void write_addr(FILE *file, const char *name, struct addr_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < NUM_PHASES; ++i) {
+		struct hist *hist = &stats->phases[i];
+		fprintf(file, "%-9s %-5s %8llu %8llu %8llu %8llu %8llu\n",
+			phase_names[i], name, (unsigned long long) hist->count,
+			(unsigned long long) hist_percentile(hist, 50),
+			(unsigned long long) hist_percentile(hist, 99),
+			(unsigned long long) hist->max,
+			(unsigned long long) (hist->sum / hist->count));
+	}
+}
+
+/*
+ * Write the statistics to path as "name value" lines followed by a table
+ * of the phases by address, replacing the file at once so that readers
+ * never see it half written. The rates cover the time since the previous
+ * call.
+ */
+int stats_write(struct eub_stats *stats, const char *path,
+		struct eub_link *link)
+{
+	struct addr_stats *addrs = stats->addrs;
+	char tmp[PATH_MAX];
+	int64_t now = now_us();
+	int i;
+
+	if (!stats->started_us)
+		stats->started_us = stats->last_us = now;
+	if (sizeof tmp <= (size_t) snprintf(tmp, sizeof tmp, "%s.tmp", path))
+		return -1;
+	FILE *file = fopen(tmp, "w");
+	if (!file)
+		return -1;
+
+	unsigned long long bytes = link->tx_bytes + link->rx_bytes;
+	double elapsed = (now - stats->last_us) / 1e6;
+	if (elapsed <= 0)
+		elapsed = 1;
+	fprintf(file, "uptime_s %.3f\n", (now - stats->started_us) / 1e6);
+	fprintf(file, "baudrate %u\n", link->baudrate);
+	fprintf(file, "features 0x%04x\n", link->features);
+	fprintf(file, "window %u\n", link->window);
+	fprintf(file, "transfers %lu\n", addrs[ADDR_ALL].transfers);
+	fprintf(file, "errors %lu\n", addrs[ADDR_ALL].errors);
+	fprintf(file, "frames %lu\n", link->sent);
+	fprintf(file, "retransmits %lu\n", link->retransmits);
+	fprintf(file, "timeouts %lu\n", link->timeouts);
+	fprintf(file, "corrupt %lu\n", link->corrupt);
+	fprintf(file, "resyncs %lu\n", link->resyncs);
+	fprintf(file, "pushes %lu\n", link->pushes);
+	fprintf(file, "tx_bytes %llu\n", link->tx_bytes);
+	fprintf(file, "rx_bytes %llu\n", link->rx_bytes);
+	fprintf(file, "frames_per_s %.1f\n",
+		(link->sent - stats->last_frames) / elapsed);
+	fprintf(file, "bytes_per_s %.1f\n",
+		(bytes - stats->last_bytes) / elapsed);
+	fprintf(file, "# phase   addr     count   p50_us   p99_us   max_us"
+		"  mean_us\n");
+	if (addrs[ADDR_ALL].transfers)
+		write_addr(file, "all", &addrs[ADDR_ALL]);
+	for (i = 0; i < ADDR_ALL; ++i) {
+		char name[8];
+
+		if (!addrs[i].transfers)
+			continue;
+		if (i == ADDR_OTHER)
+			strcpy(name, "other");
+		else
+			snprintf(name, sizeof name, "0x%02x", i);
+		write_addr(file, name, &addrs[i]);
+	}
+	stats->last_us = now;
+	stats->last_frames = link->sent;
+	stats->last_bytes = bytes;
+
+	if (fclose(file) != 0 || rename(tmp, path) < 0) {
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
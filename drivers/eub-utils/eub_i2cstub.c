@@ -0,0 +1,912 @@
+/*
+ * Esrille Unbrick I2C Bridge Firmware Stand-in
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * eub_i2cstub plays the part of the board firmware at the far end of the
+ * bridge UART. It creates a pseudo terminal, prints the name of its slave
+ * side, and answers bridge frames against emulated register files for the
+ * motherboard, the power board, the RTC and the DAC. The time a frame
+ * would spend on a real UART at the negotiated baud rate is simulated, so
+ * the effect of protocol changes can be measured without hardware.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <termios.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/i2c.h>
+#include <linux/mfd/eub_mobo.h>
+
+#include "eub_i2c.h"
+
+#define SUPPORTED_FEATURES	EUB_BRIDGE_FEAT_ALL
+
+#define MAX_WINDOW	16
+#define MAX_SUBSCRIPTIONS 8
+#define MOBO_ADDR	0x08
+#define STROKE		64	/* FIFO samples per stroke of the pen */
+#define REPLY_SIZE	COBS_SIZE(LEN_BUFFER + 3)
+/* a block read answer with the status byte, the frame header and CRC */
+#define SMBUS_MIN_FRAME	(1 + 1 + EUB_I2C_SMBUS_BLOCK_MAX + 4)
+
+struct device {
+	int present;
+	uint8_t ptr;
+	uint8_t regs[256];
+};
+
+static struct device devices[128];
+
+/* the touch FIFO of the motherboard, see eub_mobo.h */
+static struct {
+	unsigned int period_us;		/* 0 if off */
+	int64_t next_us;		/* when the next sample is taken */
+	unsigned int taken;		/* samples taken since turned on */
+	unsigned int head;
+	unsigned int count;
+	uint16_t time[EUB_MOBO_FIFO_DEPTH];
+	uint16_t xyz[EUB_MOBO_FIFO_DEPTH][3];
+} fifo;
+
+static int verbose;
+static int legacy;			/* no bridge control support */
+static unsigned int max_baudrate = 921600;
+static unsigned int service_us = 100;	/* I2C bus time per message */
+static unsigned int max_frame = 256;
+static unsigned int corrupt_rate;	/* damage 1 in N frames each way */
+static unsigned int drop_rate;		/* lose 1 in N replies with CRC */
+static unsigned int window = 4;		/* frames buffered with PIPELINE */
+
+static unsigned int baudrate = BAUDRATE;
+static int64_t baud_deadline;		/* revert unless a frame arrives */
+static uint16_t features;		/* enabled framing features */
+
+/* changes requested by a control transfer, applied after the reply */
+struct actions {
+	unsigned int baudrate;
+	int set_mode;
+	uint16_t features;
+};
+
+/*
+ * The UART receiver, the I2C bus and the UART transmitter each work on one
+ * frame at a time; these are the times at which each becomes free.
+ */
+static int64_t rx_free;
+static int64_t bus_free;
+static int64_t tx_free;
+
+/* encoded replies waiting for their simulated transmission to finish */
+static struct reply {
+	int64_t due;
+	unsigned int baudrate;	/* switch to this rate once sent */
+	size_t len;
+	uint8_t *buf;
+} replies[MAX_WINDOW * 2];
+static unsigned int reply_head;
+static unsigned int reply_count;
+
+/* registers pushed every period_us with PUSH; period_us 0 if unused */
+static struct subscription {
+	uint8_t addr;
+	uint8_t reg;
+	uint8_t count;
+	int64_t period_us;
+	int64_t due;
+} subscriptions[MAX_SUBSCRIPTIONS];
+
+/* the last replies by sequence number, for frames sent again */
+static struct cached {
+	int seq;
+	size_t len;
+	uint8_t *buf;
+} cache[MAX_WINDOW];
+static unsigned int cache_next;
+
+static volatile sig_atomic_t quit_flag = 0;
+
+static void quit_handler(int signum)
+{
+	quit_flag = 1;
+}
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* time to shift count bytes through the UART at the current rate */
+static int64_t line_us(size_t count)
+{
+	return (int64_t) count * 10 * 1000000 / baudrate;
+}
+
+static void init_devices(void)
+{
+	struct device *dev;
+
+	/* motherboard */
+	dev = &devices[MOBO_ADDR];
+	dev->present = 1;
+	dev->regs[0x00] = 1;			/* version */
+	dev->regs[0x01] = 40;			/* brightness */
+	dev->regs[0x05] = 500 & 0xff;		/* X */
+	dev->regs[0x06] = 500 >> 8;
+	dev->regs[0x07] = 500 & 0xff;		/* Y */
+	dev->regs[0x08] = 500 >> 8;
+	dev->regs[0x09] = 0x3ff & 0xff;		/* Z: not touched */
+	dev->regs[0x0a] = 0x3ff >> 8;
+
+	/* power board */
+	dev = &devices[0x09];
+	dev->present = 1;
+	dev->regs[0x00] = 1;			/* version */
+	dev->regs[0x02] = 128;			/* X */
+	dev->regs[0x03] = 128;			/* Y */
+	dev->regs[0x04] = 1;			/* VBUS */
+	dev->regs[0x05] = 200;			/* VREF */
+
+	/* ds1307 and pcm5122 */
+	devices[0x68].present = 1;
+	devices[0x4d].present = 1;
+}
+
+static size_t bridge_reply(const uint8_t *cmd, uint16_t cmd_len,
+			   uint8_t *reply, uint16_t reply_len,
+			   struct actions *actions)
+{
+	struct eub_bridge_hello hello;
+	struct subscription *sub;
+	uint16_t mode;
+
+	if (cmd_len < 1)
+		return 0;
+	switch (cmd[0]) {
+	case EUB_BRIDGE_CMD_HELLO:
+		memset(&hello, 0, sizeof hello);
+		hello.magic[0] = EUB_BRIDGE_MAGIC0;
+		hello.magic[1] = EUB_BRIDGE_MAGIC1;
+		hello.version = EUB_BRIDGE_VERSION;
+		hello.features = SUPPORTED_FEATURES;
+		if (max_frame < SMBUS_MIN_FRAME)
+			hello.features &= ~EUB_BRIDGE_FEAT_SMBUS;
+		hello.window = window;
+		hello.max_frame = max_frame;
+		if (sizeof hello < reply_len)
+			reply_len = sizeof hello;
+		memcpy(reply, &hello, reply_len);
+		return reply_len;
+	case EUB_BRIDGE_CMD_BAUD:
+		if (cmd_len < 5 || reply_len < 1)
+			return 0;
+		uint32_t rate;
+		memcpy(&rate, cmd + 1, sizeof rate);
+		if (rate <= max_baudrate && uart_speed(rate) != B0) {
+			reply[0] = 0;
+			actions->baudrate = rate;
+		} else {
+			reply[0] = 1;
+		}
+		return 1;
+	case EUB_BRIDGE_CMD_MODE:
+		if (cmd_len < 3 || reply_len < 1)
+			return 0;
+		memcpy(&mode, cmd + 1, sizeof mode);
+		if ((mode & ~SUPPORTED_FEATURES) ||
+		    ((mode & EUB_BRIDGE_FEAT_SMBUS) &&
+		     (max_frame < SMBUS_MIN_FRAME ||
+		      (~mode & (EUB_BRIDGE_FEAT_COMPACT |
+				EUB_BRIDGE_FEAT_SPLIT))))) {
+			reply[0] = 1;
+		} else {
+			reply[0] = 0;
+			actions->set_mode = 1;
+			actions->features = mode;
+		}
+		return 1;
+	case EUB_BRIDGE_CMD_SUBSCRIBE:
+		if (cmd_len < 7 || reply_len < 1)
+			return 0;
+		memcpy(&mode, cmd + 5, sizeof mode);
+		/* the snapshot has to fit in a frame with its header and CRC */
+		if (!(features & EUB_BRIDGE_FEAT_PUSH) ||
+		    MAX_SUBSCRIPTIONS <= cmd[1] || 0x80 <= cmd[2] ||
+		    (mode && (cmd[4] == 0 || max_frame < cmd[4] + 4u))) {
+			reply[0] = 1;
+			return 1;
+		}
+		sub = &subscriptions[cmd[1]];
+		sub->addr = cmd[2];
+		sub->reg = cmd[3];
+		sub->count = cmd[4];
+		sub->period_us = mode * 1000;
+		sub->due = now_us() + sub->period_us;
+		if (verbose)
+			printf("subscription %u: addr=0x%02x reg=0x%02x "
+			       "count=%u every %u ms\n", cmd[1], cmd[2], cmd[3],
+			       cmd[4], mode);
+		reply[0] = 0;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void put16(uint8_t *p, uint16_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+}
+
+/*
+ * Take the samples of the touch FIFO due by now. The pen draws a diagonal
+ * stroke of STROKE samples and lifts for a quarter of that, over and over,
+ * so a reader can tell a sample lost or repeated.
+ */
+static void fifo_sample(int64_t now)
+{
+	struct device *dev = &devices[MOBO_ADDR];
+	unsigned int period_us = dev->regs[EUB_MOBO_REG_FIFO_PERIOD] *
+				 EUB_MOBO_FIFO_TICK_US;
+
+	if (period_us != fifo.period_us) {
+		fifo.period_us = period_us;
+		fifo.next_us = now + period_us;
+		fifo.taken = fifo.head = fifo.count = 0;
+	}
+	if (!period_us)
+		return;
+	/* samples older than the FIFO holds are lost anyway */
+	if (fifo.next_us + EUB_MOBO_FIFO_DEPTH * period_us < now) {
+		int64_t skip = (now - fifo.next_us) / period_us -
+			       EUB_MOBO_FIFO_DEPTH;
+		fifo.next_us += skip * period_us;
+		fifo.taken += skip;
+	}
+	for (; fifo.next_us <= now; fifo.next_us += period_us) {
+		unsigned int n = fifo.taken++ % (STROKE + STROKE / 4);
+		unsigned int tail = (fifo.head + fifo.count) %
+				    EUB_MOBO_FIFO_DEPTH;
+
+		if (fifo.count == EUB_MOBO_FIFO_DEPTH)
+			fifo.head = (fifo.head + 1) % EUB_MOBO_FIFO_DEPTH;
+		else
+			++fifo.count;
+		fifo.time[tail] = fifo.next_us / EUB_MOBO_FIFO_TICK_US;
+		fifo.xyz[tail][0] = 100 + (n % STROKE) * 12;
+		fifo.xyz[tail][1] = 200 + (n % STROKE) * 8;
+		fifo.xyz[tail][2] = (n < STROKE) ? 0x200 : 0x3ff;
+	}
+}
+
+/* Read len bytes from EUB_MOBO_REG_FIFO into buf, taking the samples out. */
+static void fifo_read(uint8_t *buf, size_t len)
+{
+	const size_t hdr = sizeof(struct eub_mobo_fifo_hdr);
+	const size_t size = sizeof(struct eub_mobo_fifo_sample);
+	int64_t now = now_us();
+	unsigned int count = 0;
+
+	fifo_sample(now);
+	memset(buf, 0, len);
+	if (len < hdr)
+		return;
+	for (uint8_t *p = buf + hdr; fifo.count && p + size <= buf + len;
+	     p += size, ++count) {
+		put16(p, fifo.time[fifo.head]);
+		for (int i = 0; i < 3; ++i)
+			put16(p + 2 + 2 * i, fifo.xyz[fifo.head][i]);
+		fifo.head = (fifo.head + 1) % EUB_MOBO_FIFO_DEPTH;
+		--fifo.count;
+	}
+	buf[0] = count;
+	put16(buf + 1, now / EUB_MOBO_FIFO_TICK_US);
+	if (verbose)
+		printf("touch fifo: %u samples\n", count);
+}
+
+/*
+ * Run the SMBus op on the emulated devices, with its answer after the
+ * status byte at out, and set *out_len to the length of that reply. A
+ * block read answers with the count in the command register, at most
+ * EUB_I2C_SMBUS_BLOCK_MAX, and as many registers following it. Returns 1.
+ */
+static int execute_op(const struct i2c_smbus_op *op, uint8_t *out,
+		      size_t *out_len)
+{
+	struct device *dev = &devices[op->addr];
+	uint8_t ptr = op->cmd;
+	size_t len = i2c_op_reply_size(op->op);
+
+	if (verbose)
+		printf("smbus op %u addr=0x%02x cmd=0x%02x\n", op->op,
+		       op->addr, op->cmd);
+	*out_len = 1;
+	if (!dev->present) {
+		out[0] = EUB_BRIDGE_STATUS_NAK;
+		return 1;
+	}
+	out[0] = EUB_BRIDGE_STATUS_OK;
+	if (op->op == EUB_I2C_SMBUS_WRITE_BYTE_DATA) {
+		dev->regs[ptr++] = op->value;
+	} else {
+		if (op->op == EUB_I2C_SMBUS_READ_BLOCK_DATA) {
+			len = dev->regs[ptr];
+			if (EUB_I2C_SMBUS_BLOCK_MAX < len)
+				len = EUB_I2C_SMBUS_BLOCK_MAX;
+			out[(*out_len)++] = len;
+			++ptr;
+		}
+		for (size_t i = 0; i < len; ++i)
+			out[(*out_len)++] = dev->regs[ptr++];
+	}
+	dev->ptr = ptr;
+	return 1;
+}
+
+/*
+ * Execute the packed messages in buf, as the firmware does, and return the
+ * number of I2C messages executed or -1 if the frame is malformed. Read
+ * data goes in place, or with EUB_I2C_FORMAT_SPLIT, after the status byte
+ * at out, and *out_len is set to the length of that reply.
+ */
+static int execute(uint8_t *buf, size_t len, int format, uint8_t *out,
+		   size_t *out_len, struct actions *actions)
+{
+	uint8_t *p = buf;
+	uint8_t *end = buf + len;
+	uint8_t *cmd = NULL;
+	uint16_t cmd_len = 0;
+	int split = format & EUB_I2C_FORMAT_SPLIT;
+	uint8_t *rd = out + 1;
+	int count = 0;
+	struct i2c_smbus_op op;
+
+	switch (i2c_unpack_op(buf, len, format, &op)) {
+	case 1:
+		return execute_op(&op, out, out_len);
+	case -1:
+		return -1;
+	}
+	out[0] = EUB_BRIDGE_STATUS_OK;
+	while (p < end) {
+		struct i2c_packed_msg msg;
+		uint8_t *data;
+
+		data = i2c_unpack_msg(p, end, format, &msg);
+		if (!data)
+			return -1;
+		p = data;
+		if (split && (msg.flags & I2C_M_RD)) {
+			/* the reply has to fit in a frame too */
+			if (max_frame < (size_t) (rd - out) + msg.len)
+				return -1;
+			p = rd;
+			rd += msg.len;
+		}
+
+		if (verbose)
+			printf("%s addr=0x%02x len=%u\n",
+			       (msg.flags & I2C_M_RD) ? "read" : "write",
+			       msg.addr, msg.len);
+
+		if (msg.addr == EUB_BRIDGE_ADDR && !legacy) {
+			if (msg.flags & I2C_M_RD) {
+				if (cmd)
+					bridge_reply(cmd, cmd_len, p, msg.len,
+						     actions);
+			} else {
+				cmd = p;
+				cmd_len = msg.len;
+			}
+		} else if (msg.addr < 128 && devices[msg.addr].present) {
+			struct device *dev = &devices[msg.addr];
+			uint16_t i = 0;
+
+			/* I2C_M_NOSTART continues a split message */
+			if (!(msg.flags & (I2C_M_RD | I2C_M_NOSTART)) &&
+			    0 < msg.len) {
+				dev->ptr = p[0];
+				i = 1;
+			}
+			if ((msg.flags & I2C_M_RD) &&
+			    dev == &devices[MOBO_ADDR] &&
+			    dev->ptr == EUB_MOBO_REG_FIFO) {
+				fifo_read(p, msg.len);
+				i = msg.len;
+			}
+			for (; i < msg.len; ++i) {
+				if (msg.flags & I2C_M_RD)
+					p[i] = dev->regs[dev->ptr++];
+				else
+					dev->regs[dev->ptr++] = p[i];
+			}
+			++count;
+		} else if (split) {
+			/* the bus stops at the first message not acknowledged */
+			out[0] = EUB_BRIDGE_STATUS_NAK;
+			rd = out + 1;
+			++count;
+			break;
+		}
+		p = data + i2c_msg_data_size(format, &msg);
+	}
+	*out_len = rd - out;
+	return count;
+}
+
+/* flip a bit in 1 of corrupt_rate frames to emulate line noise */
+static void corrupt(uint8_t *buf, size_t len)
+{
+	if (!corrupt_rate || len == 0 || rand() % corrupt_rate)
+		return;
+	buf[rand() % len] ^= 1u << (rand() % 8);
+	if (verbose)
+		printf("corrupted a frame\n");
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t len)
+{
+	while (0 < len) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("write");
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static int64_t max64(int64_t a, int64_t b)
+{
+	return (a < b) ? b : a;
+}
+
+/* frame the len bytes at data, which has room for the CRC, into buf */
+static size_t encode_reply(uint8_t *data, size_t len, uint8_t *buf)
+{
+	if (features & EUB_BRIDGE_FEAT_CRC) {
+		uint16_t crc = crc16(EUB_BRIDGE_CRC16_INIT, data, len);
+		data[len++] = crc;
+		data[len++] = crc >> 8;
+	}
+	return cobs_encode(data, len, buf);
+}
+
+/*
+ * Queue the encoded reply in buf, which can go out on the UART once it is
+ * ready, for when its last byte has left the transmitter.
+ */
+static void queue_reply(const uint8_t *buf, size_t len, int64_t ready,
+			unsigned int new_baudrate)
+{
+	if (sizeof replies / sizeof replies[0] <= reply_count) {
+		if (verbose)
+			printf("reply queue overflow\n");
+		return;
+	}
+	// a lost reply can only be recovered from with CRC
+	if (drop_rate && (features & EUB_BRIDGE_FEAT_CRC) &&
+	    rand() % drop_rate == 0) {
+		if (verbose)
+			printf("dropped a reply\n");
+		return;
+	}
+	struct reply *reply = &replies[(reply_head + reply_count++) %
+				       (sizeof replies / sizeof replies[0])];
+	tx_free = max64(ready, tx_free) + line_us(len);
+	reply->due = tx_free;
+	reply->baudrate = new_baudrate;
+	reply->len = len;
+	memcpy(reply->buf, buf, len);
+	corrupt(reply->buf, len - 1);
+}
+
+static void send_nak(uint8_t seq, int64_t ready)
+{
+	uint8_t nak[4] = { EUB_FRAME_NAK, seq };
+	uint8_t buf[COBS_SIZE(sizeof nak)];
+
+	queue_reply(buf, encode_reply(nak, 2, buf), ready, 0);
+}
+
+static void cache_reply(uint8_t seq, const uint8_t *buf, size_t len)
+{
+	struct cached *entry = &cache[cache_next];
+
+	entry->seq = seq;
+	entry->len = len;
+	memcpy(entry->buf, buf, len);
+	cache_next = (cache_next + 1) % ((features & EUB_BRIDGE_FEAT_PIPELINE) ?
+					 window : 1);
+}
+
+static struct cached *cache_find(uint8_t seq)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_WINDOW; ++i) {
+		if (cache[i].seq == seq)
+			return &cache[i];
+	}
+	return NULL;
+}
+
+static void cache_clear(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_WINDOW; ++i)
+		cache[i].seq = -1;
+	cache_next = 0;
+}
+
+/*
+ * Send the replies that are due. Returns the microseconds until the next
+ * one, or -1 if none is queued.
+ */
+static int64_t send_replies(int fd)
+{
+	while (reply_count) {
+		struct reply *reply = &replies[reply_head];
+		int64_t left = reply->due - now_us();
+		if (0 < left)
+			return left;
+		write_all(fd, reply->buf, reply->len);
+		reply_head = (reply_head + 1) %
+			     (sizeof replies / sizeof replies[0]);
+		--reply_count;
+		if (reply->baudrate) {
+			baudrate = reply->baudrate;
+			baud_deadline = now_us() + EUB_BRIDGE_BAUD_GRACE * 1000;
+			if (verbose)
+				printf("switched to %u baud\n", baudrate);
+		}
+	}
+	return -1;
+}
+
+/*
+ * Read the registers of the subscriptions that are due and queue them as
+ * snapshots. Returns the microseconds until the next one, or -1 if there
+ * is no subscription.
+ */
+static int64_t send_pushes(void)
+{
+	static uint8_t data[LEN_BUFFER + 3];
+	static uint8_t buf[REPLY_SIZE];
+	int64_t now = now_us();
+	int64_t next = -1;
+	unsigned int i;
+
+	for (i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
+		struct subscription *sub = &subscriptions[i];
+		struct device *dev = &devices[sub->addr];
+
+		if (!sub->period_us)
+			continue;
+		if (now < sub->due) {
+			if (next < 0 || sub->due - now < next)
+				next = sub->due - now;
+			continue;
+		}
+		sub->due += sub->period_us;
+		if (sub->due <= now)
+			sub->due = now + sub->period_us;
+		if (next < 0 || sub->due - now < next)
+			next = sub->due - now;
+
+		/* the register write and the read take the bus in turn */
+		bus_free = max64(now, bus_free) + 2 * service_us;
+		if (!dev->present)
+			continue;
+		data[0] = EUB_FRAME_PUSH;
+		data[1] = i;
+		dev->ptr = sub->reg;
+		for (size_t j = 0; j < sub->count; ++j)
+			data[2 + j] = dev->regs[dev->ptr++];
+		queue_reply(buf, encode_reply(data, 2 + sub->count, buf),
+			    bus_free, 0);
+	}
+	return next;
+}
+
+static void handle_frame(int fd, uint8_t *frame, size_t count)
+{
+	static uint8_t data[LEN_BUFFER + 3];
+	static uint8_t reply[LEN_BUFFER + 5];
+	static uint8_t buf[REPLY_SIZE];
+	struct termios ti;
+	struct actions actions = { 0 };
+
+	/* a frame sent at a different rate arrives as line noise */
+	if (tcgetattr(fd, &ti) == 0 &&
+	    cfgetospeed(&ti) != uart_speed(baudrate)) {
+		if (verbose)
+			printf("dropped frame at mismatched rate\n");
+		if (baudrate != BAUDRATE) {
+			baudrate = BAUDRATE;
+			baud_deadline = 0;
+		}
+		return;
+	}
+	baud_deadline = 0;
+
+	/* the frame has to arrive through the UART receiver */
+	rx_free = max64(now_us(), rx_free) + line_us(count + 1);
+	int64_t ready = rx_free;
+
+	if (sizeof data < count)
+		return;
+	memcpy(data, frame, count);
+	corrupt(data, count);
+	size_t len = cobs_decode(data, count);
+	if (len == 0 || max_frame < len) {
+		if (verbose)
+			printf("malformed frame (%zu bytes)\n", count);
+		if (features & EUB_BRIDGE_FEAT_CRC)
+			send_nak(0, ready);
+		return;
+	}
+
+	/* control bytes never have bit 7 set; see eub_i2c.h */
+	int ext = features && !(data[0] & 0x80);
+	size_t hdr = ext ? 1 : 0;
+	int crc = ext && (features & EUB_BRIDGE_FEAT_CRC);
+	if (crc) {
+		hdr = 2;
+		if (len < 4 || crc16(EUB_BRIDGE_CRC16_INIT, data, len - 2) !=
+			       (data[len - 2] | (data[len - 1] << 8))) {
+			if (verbose)
+				printf("bad crc\n");
+			send_nak(data[1], ready);
+			return;
+		}
+		len -= 2;
+		struct cached *entry = cache_find(data[1]);
+		if (entry) {
+			if (verbose)
+				printf("replaying reply %u\n", data[1]);
+			queue_reply(entry->buf, entry->len, ready, 0);
+			return;
+		}
+	}
+
+	int format = ext ? bridge_format(features) : EUB_I2C_FORMAT_RAW;
+	size_t out_len;
+	int n = execute(data + hdr, len - hdr, format, reply + hdr, &out_len,
+			&actions);
+	if (n < 0) {
+		if (verbose)
+			printf("malformed frame (%zu bytes)\n", count);
+		return;
+	}
+
+	/* with SPLIT, the reply is the status and the read data */
+	uint8_t *payload = data;
+	if (format & EUB_I2C_FORMAT_SPLIT) {
+		memcpy(reply, data, hdr);
+		payload = reply;
+		len = hdr + out_len;
+	}
+
+	/* the I2C bus runs one frame at a time, in the order they arrive */
+	bus_free = max64(ready, bus_free) + n * service_us;
+	size_t reply_len = encode_reply(payload, len, buf);
+	if (crc)
+		cache_reply(data[1], buf, reply_len);
+	queue_reply(buf, reply_len, bus_free, actions.baudrate);
+
+	if (features && !ext) {
+		/* the host has restarted and speaks the legacy framing */
+		features = 0;
+	}
+	if (actions.set_mode) {
+		features = actions.features;
+		cache_clear();
+		memset(subscriptions, 0, sizeof subscriptions);
+		if (verbose)
+			printf("framing features 0x%04x\n", features);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-l link] [-m baudrate] [-s usec] [-F bytes] [-W n] "
+		"[-c n] [-D n] [-L] [-v]\n"
+		"  -l link      create a symbolic link to the pty slave\n"
+		"  -m baudrate  highest baud rate to accept (default %u)\n"
+		"  -s usec      I2C bus time per message (default %u)\n"
+		"  -F bytes     largest frame to accept (default %u)\n"
+		"  -W n         frames to buffer with PIPELINE (default %u)\n"
+		"  -c n         corrupt 1 in n frames in each direction\n"
+		"  -D n         lose 1 in n replies once CRC is enabled\n"
+		"  -L           emulate firmware without bridge control\n"
+		"  -v           print every frame\n",
+		name, max_baudrate, service_us, max_frame, window);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *link_path = NULL;
+	static uint8_t frame[COBS_SIZE(LEN_BUFFER + 1)];
+	size_t count = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:m:s:F:W:c:D:Lvh")) != -1) {
+		switch (opt) {
+		case 'l':
+			link_path = optarg;
+			break;
+		case 'm':
+			max_baudrate = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			service_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			max_frame = strtoul(optarg, NULL, 0);
+			if (max_frame < LEN_LEGACY)
+				max_frame = LEN_LEGACY;
+			if (UINT16_MAX < max_frame)
+				max_frame = UINT16_MAX;
+			break;
+		case 'W':
+			window = strtoul(optarg, NULL, 0);
+			if (window < 1)
+				window = 1;
+			if (MAX_WINDOW < window)
+				window = MAX_WINDOW;
+			break;
+		case 'c':
+			corrupt_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			drop_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			legacy = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (legacy)
+		max_frame = LEN_LEGACY;
+
+	struct sigaction act;
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = quit_handler;
+	act.sa_flags = 0;
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		perror("posix_openpt");
+		return 1;
+	}
+	const char *name = ptsname(fd);
+
+	/* keep the slave open so the master never sees a hangup */
+	int slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(name);
+		return 1;
+	}
+	struct termios ti;
+	tcgetattr(slave, &ti);
+	cfmakeraw(&ti);
+	cfsetispeed(&ti, uart_speed(BAUDRATE));
+	cfsetospeed(&ti, uart_speed(BAUDRATE));
+	tcsetattr(slave, TCSANOW, &ti);
+
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(name, link_path) < 0) {
+			perror(link_path);
+			return 1;
+		}
+	}
+	printf("%s\n", name);
+	fflush(stdout);
+
+	init_devices();
+	for (unsigned int i = 0; i < sizeof replies / sizeof replies[0]; ++i) {
+		replies[i].buf = malloc(REPLY_SIZE);
+		if (i < MAX_WINDOW)
+			cache[i].buf = malloc(REPLY_SIZE);
+		if (!replies[i].buf || (i < MAX_WINDOW && !cache[i].buf)) {
+			perror("malloc");
+			return 1;
+		}
+	}
+	cache_clear();
+
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while (!quit_flag) {
+		int64_t timeout = send_pushes();
+		int64_t due = send_replies(fd);
+		if (0 <= due && (timeout < 0 || due < timeout))
+			timeout = due;
+		if (baud_deadline) {
+			int64_t left = baud_deadline - now_us();
+			if (left <= 0) {
+				baudrate = BAUDRATE;
+				baud_deadline = 0;
+				if (verbose)
+					printf("reverted to %u baud\n",
+					       baudrate);
+				continue;
+			}
+			if (timeout < 0 || left < timeout)
+				timeout = left;
+		}
+		struct timespec ts = {
+			.tv_sec = timeout / 1000000,
+			.tv_nsec = (timeout % 1000000) * 1000,
+		};
+		int ret = ppoll(&pfd, 1, (timeout < 0) ? NULL : &ts, NULL);
+		if (ret <= 0)
+			continue;
+
+		uint8_t buf[256];
+		ssize_t len = read(fd, buf, sizeof buf);
+		if (len <= 0)
+			continue;
+		for (ssize_t i = 0; i < len; ++i) {
+			if (buf[i] != 0) {
+				if (count < sizeof frame)
+					frame[count++] = buf[i];
+				continue;
+			}
+			if (0 < count && count < sizeof frame)
+				handle_frame(fd, frame, count);
+			count = 0;
+		}
+	}
+
+	if (link_path)
+		unlink(link_path);
+	close(slave);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * Esrille Unbrick I2C Bridge Frame Trace
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "eub_i2c.h"
+
+#define REC_SIZE	sizeof(struct eub_trace_rec)
+#define DATA_OFFSET	64	/* the ring starts after the header */
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t align8(uint64_t n)
+{
+	return (n + 7) & ~(uint64_t) 7;
+}
+
+/* Returns the bytes the record at pos takes in the ring, padding included. */
+static uint64_t trace_rec_size(struct eub_trace *trace, uint64_t pos)
+{
+	uint64_t size = trace->hdr->size;
+	uint64_t left = size - pos % size;
+	struct eub_trace_rec *rec;
+
+	// too little room at the end for a record counts as padding
+	if (left < REC_SIZE)
+		return left;
+	rec = (struct eub_trace_rec *) (trace->ring + pos % size);
+	return align8(REC_SIZE + rec->len);
+}
+
+/* Make room for n more bytes by dropping the oldest records. */
+static void trace_reserve(struct eub_trace *trace, uint64_t n)
+{
+	struct eub_trace_hdr *hdr = trace->hdr;
+
+	while (hdr->size < hdr->head + n - hdr->tail)
+		hdr->tail += trace_rec_size(trace, hdr->tail);
+}
+
+static int trace_map(struct eub_trace *trace, int fd, size_t map_size,
+		     int prot)
+{
+	void *map = mmap(NULL, map_size, prot, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED)
+		return -1;
+	trace->hdr = map;
+	trace->ring = (uint8_t *) map + DATA_OFFSET;
+	trace->map_size = map_size;
+	return 0;
+}
+
+/*
+ * Create the trace file at path with a ring of about size bytes, and map
+ * it for trace_record().
+ */
+int trace_create(struct eub_trace *trace, const char *path, size_t size)
+{
+	size = align8(size);
+	if (size < 4096)
+		size = 4096;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	int ret = -1;
+	if (ftruncate(fd, DATA_OFFSET + size) == 0)
+		ret = trace_map(trace, fd, DATA_OFFSET + size,
+				PROT_READ | PROT_WRITE);
+	close(fd);
+	if (ret < 0)
+		return -1;
+	struct eub_trace_hdr *hdr = trace->hdr;
+	memcpy(hdr->magic, EUB_TRACE_MAGIC, sizeof hdr->magic);
+	hdr->version = EUB_TRACE_VERSION;
+	hdr->data_offset = DATA_OFFSET;
+	hdr->size = size;
+	return 0;
+}
+
+/* Map the trace file at path for reading with trace_next(). */
+int trace_open(struct eub_trace *trace, const char *path)
+{
+	struct stat st;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	int ret = -1;
+	if (fstat(fd, &st) == 0 && DATA_OFFSET <= st.st_size)
+		ret = trace_map(trace, fd, st.st_size, PROT_READ);
+	close(fd);
+	if (ret < 0)
+		return -1;
+	struct eub_trace_hdr *hdr = trace->hdr;
+	if (memcmp(hdr->magic, EUB_TRACE_MAGIC, sizeof hdr->magic) ||
+	    hdr->version != EUB_TRACE_VERSION ||
+	    hdr->data_offset != DATA_OFFSET ||
+	    st.st_size < DATA_OFFSET + hdr->size ||
+	    hdr->head < hdr->tail || hdr->size < hdr->head - hdr->tail) {
+		trace_close(trace);
+		return -1;
+	}
+	return 0;
+}
+
+void trace_close(struct eub_trace *trace)
+{
+	if (trace->hdr)
+		munmap(trace->hdr, trace->map_size);
+	trace->hdr = NULL;
+}
+
+/*
+ * Append the len bytes of frame to the ring. A record never wraps; the end
+ * of the ring is padded instead. The head moves only once the record is in
+ * place, so that a reader of the live file sees whole records.
+ */
+void trace_record(struct eub_trace *trace, uint8_t dir, uint16_t features,
+		  const uint8_t *frame, size_t len)
+{
+	struct eub_trace_hdr *hdr = trace->hdr;
+	uint64_t n = align8(REC_SIZE + len);
+	uint64_t left = hdr->size - hdr->head % hdr->size;
+	struct eub_trace_rec *rec;
+
+	if (hdr->size / 2 < n) {
+		++hdr->dropped;
+		return;
+	}
+	if (left < n) {
+		trace_reserve(trace, left);
+		if (REC_SIZE <= left) {
+			rec = (struct eub_trace_rec *) (trace->ring +
+							hdr->head % hdr->size);
+			memset(rec, 0, REC_SIZE);
+			rec->len = left - REC_SIZE;
+			rec->dir = EUB_TRACE_PAD;
+		}
+		__atomic_store_n(&hdr->head, hdr->head + left,
+				 __ATOMIC_RELEASE);
+	}
+	trace_reserve(trace, n);
+	rec = (struct eub_trace_rec *) (trace->ring + hdr->head % hdr->size);
+	rec->time_us = now_us();
+	rec->len = len;
+	rec->dir = dir;
+	rec->reserved = 0;
+	rec->features = features;
+	memcpy(rec + 1, frame, len);
+	__atomic_store_n(&hdr->head, hdr->head + n, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the record at *pos, which starts at the tail, and moves *pos on
+ * to the next one. Returns NULL at the head.
+ */
+const struct eub_trace_rec *trace_next(struct eub_trace *trace,
+				       uint64_t *pos)
+{
+	struct eub_trace_hdr *hdr = trace->hdr;
+	uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	while (*pos < head) {
+		uint64_t left = hdr->size - *pos % hdr->size;
+		const struct eub_trace_rec *rec;
+
+		if (left < REC_SIZE) {
+			*pos += left;
+			continue;
+		}
+		rec = (const struct eub_trace_rec *) (trace->ring +
+						      *pos % hdr->size);
+		if (left < REC_SIZE + rec->len)
+			return NULL;	// damaged
+		*pos += align8(REC_SIZE + rec->len);
+		if (rec->dir != EUB_TRACE_PAD)
+			return rec;
+	}
+	return NULL;
+}
@@ -29,6 +29,9 @@
 
 #include <linux/mfd/eub_power.h>
 
+#define CREATE_TRACE_POINTS
+#include "eub_battery_trace.h"
+
 #define DRIVER_NAME		"eub_battery"
 
 #define BATTERY_LEVELS_SIZE	100	/* from 2.00 (200) to 2.99 (299) */
@@ -160,7 +163,10 @@ static void eub_battery_work(struct work_struct *work)
 	if (rated_capacity != eub_battery->rated_capacity)
 		eub_battery->rated_capacity = rated_capacity;
 
+	trace_eub_battery_work_start(eub_battery->rated_capacity);
 	eub_battery_update_status(eub_battery);
+	trace_eub_battery_work_end(eub_battery->voltage_uV,
+				   eub_battery->rem_capacity);
 	mod_delayed_work(system_wq, &eub_battery->dwork, SCAN_DELAY);
 }
 
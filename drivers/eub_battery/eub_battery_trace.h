@@ -0,0 +1,64 @@
+/*
+ * Esrille Unbrick Battery Driver
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM eub_battery
+
+#if !defined(_EUB_BATTERY_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EUB_BATTERY_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A poll of the battery begins, against the rated capacity set */
+TRACE_EVENT(eub_battery_work_start,
+	TP_PROTO(int rated_capacity),
+	TP_ARGS(rated_capacity),
+	TP_STRUCT__entry(
+		__field(int, rated_capacity)
+	),
+	TP_fast_assign(
+		__entry->rated_capacity = rated_capacity;
+	),
+	TP_printk("rated_capacity=%d", __entry->rated_capacity)
+);
+
+/* A poll of the battery ends, with the filtered status it has come to */
+TRACE_EVENT(eub_battery_work_end,
+	TP_PROTO(int voltage_uV, int rem_capacity),
+	TP_ARGS(voltage_uV, rem_capacity),
+	TP_STRUCT__entry(
+		__field(int, voltage_uV)
+		__field(int, rem_capacity)
+	),
+	TP_fast_assign(
+		__entry->voltage_uV = voltage_uV;
+		__entry->rem_capacity = rem_capacity;
+	),
+	TP_printk("voltage_uV=%d rem_capacity=%d",
+		  __entry->voltage_uV, __entry->rem_capacity)
+);
+
+#endif /* _EUB_BATTERY_TRACE_H */
+
+/* the header is not in include/trace/events; see the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE eub_battery_trace
+#include <trace/define_trace.h>
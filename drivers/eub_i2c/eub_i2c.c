@@ -31,351 +31,2085 @@
 #include <linux/interrupt.h>
 #include <linux/sched.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/rtmutex.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
+#include <linux/list.h>
+#include <linux/idr.h>
+#include <linux/math64.h>
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/serdev.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <asm/unaligned.h>
+#include <linux/eub_i2c.h>
+
+#define CREATE_TRACE_POINTS
+#include "eub_i2c_trace.h"
 
 #define DRV_NAME		"eub_i2c"
-#define LEN_BUFFER		32
+#define DEFAULT_BUFFER_SIZE	4096
+#define MIN_BUFFER_SIZE		32
+#define MAX_BUFFER_SIZE		65536	/* the bridge daemon's limit */
 #define I2C_MSG_HDR_SIZE	6
-#define MINOR_NUM		1
+#define EUB_I2C_MINORS		8	/* bridges one module serves */
+
+#define COBS_SIZE(n)		((n) + (n) / 254 + 2)
+#define FRAME_RETRIES		1	/* sends after a NAK, as the daemon */
+
+#define I2C_BYTE_TIME_NS	100000	/* a byte on a 100 kHz I2C bus */
+#define SERDEV_SLACK_US		22000	/* as eub_i2cattach's before timing */
+#define SERDEV_BAUD_TOLERANCE	2	/* percent a UART rate may be off */
+
+/* scheduling classes of the devices on the bridge, by 7 bit address */
+#define EUB_I2C_PRIO_INPUT	0	/* polled input, ahead of the rest */
+#define EUB_I2C_PRIO_NORMAL	1
+#define EUB_I2C_PRIO_BULK	2	/* RTC, codec set up and the like */
+#define EUB_I2C_PRIO_ADDRS	0x80
+#define EUB_I2C_MAX_PASSED	4	/* times a request may be overtaken */
+
+/* transfer statistics, by 7 bit address and one slot for the rest */
+#define EUB_I2C_STATS_OTHER	EUB_I2C_PRIO_ADDRS
+#define EUB_I2C_STATS_ADDRS	(EUB_I2C_PRIO_ADDRS + 1)
+#define EUB_I2C_LATENCY_SLOTS	21	/* under 1 us, then from 2^(n-1) us */
+
+/*
+ * An i2c_transfer() or SMBus op waiting for the bridge daemon. It sits in
+ * queue until the daemon reads it, and in pending until the daemon
+ * answers it.
+ */
+struct eub_i2c_req {
+	struct list_head list;
+	struct i2c_msg *msgs;
+	int num;
+	int op;			/* EUB_I2C_SMBUS_* in place of msgs, or -1 */
+	u8 command;		/* and its arguments */
+	union i2c_smbus_data *data;
+	u16 addr;		/* of the first message, or of the op */
+	u16 flags;		/* likewise */
+	u32 id;
+	char *buffer;		/* the packed messages */
+	size_t len;
+	size_t answer_len;	/* bytes the daemon answers with */
+	u32 format;		/* of the packed messages */
+	size_t offset;		/* bytes read so far in the legacy mode */
+	bool framed;		/* handed out as a frame; seq is set */
+	bool inflight;		/* and in pending, counted in inflight */
+	u8 seq;
+	int attempts;		/* NAKs taken in the framed mode */
+	u8 prio;		/* EUB_I2C_PRIO_* of the first message */
+	u8 passed;		/* by requests of a higher class */
+	int err;
+	bool done;
+	unsigned long deadline;	/* in jiffies */
+	wait_queue_head_t wait;	/* for done or an earlier deadline */
+};
+
+/*
+ * What the transfers to one address have done, kept under the mutex of
+ * the adapter and shown in debugfs.
+ */
+struct eub_i2c_stats {
+	u64 transfers;
+	u64 messages;		/* an SMBus op counts as one */
+	u64 bytes_out;		/* written to the device, its registers too */
+	u64 bytes_in;		/* read from it */
+	u64 errors;		/* failed but for timeouts */
+	u64 timeouts;
+	u32 depth;		/* transfers waiting now */
+	u32 depth_max;
+	u32 latency[EUB_I2C_LATENCY_SLOTS];	/* by the log2 of us */
+};
 
 struct eub_i2c_dev {
 	struct device *dev;
 	struct i2c_adapter adapter;
-	struct completion completion;
-	struct i2c_msg *curr_msgs;
-	int num_msgs;
-	int msg_err;
+	struct serdev_device *serdev;	/* the UART, or NULL for the proxy */
 
 	struct cdev proxy_cdev;
-	unsigned int proxy_major;
-	struct class *proxy_class;
+	int proxy_minor;
+	unsigned long proxy_busy;	/* bit 0 while the proxy is open */
 
-	char buffer[LEN_BUFFER];
-	size_t len;
-	size_t offset;
+	size_t buffer_size;	/* largest packed transfer */
+	u32 mode;		/* EUB_I2C_MODE_* */
+	u32 format;		/* EUB_I2C_FORMAT_* */
+	struct eub_i2c_timeout timeout;	/* once read; 0 for the adapter's */
+	struct eub_i2c_framing framing;	/* in EUB_I2C_MODE_FRAMED */
+	unsigned int inflight;	/* frames handed out and not answered */
+	u8 *frame;		/* a frame being encoded */
+	u8 *tx;			/* the frame encoded for proxy_read() */
+	u8 *rx;			/* bytes from the UART not decoded yet */
+	size_t rx_size;
+	size_t rx_count;
+	struct eub_i2c_ring *ring;	/* the daemon maps, or NULL */
+	size_t ring_size;
+	u32 ring_entries;
+	u32 ring_entry_size;
+	u32 sq_off;
+	u32 cq_off;
+	u32 sq_tail;		/* the driver's indices, as it has set them */
+	u32 cq_head;
+	size_t tx_len;		/* of the frame in tx going to the serdev */
+	size_t tx_done;
+	struct work_struct tx_work;
+	u32 next_id;
+	struct list_head queue;
+	struct list_head pending;
+	u8 prio[EUB_I2C_PRIO_ADDRS];	/* EUB_I2C_PRIO_* by address */
+	struct eub_i2c_stats *stats;	/* EUB_I2C_STATS_ADDRS of them */
+	u32 depth;		/* transfers waiting, to any address */
+	u32 depth_max;
+	struct dentry *debugfs;
 
 	struct mutex mutex;
-	wait_queue_head_t inq;
+	struct rw_semaphore xfer_lock;	/* see eub_i2c_lock_bus() */
 	wait_queue_head_t outq;
 };
 
+/* shared by the proxies of all the bridges, see eub_i2c_init() */
+static dev_t eub_i2c_devt;
+static struct class *eub_i2c_class;
+static DEFINE_IDA(eub_i2c_minors);
+static struct dentry *eub_i2c_debugfs;
+
 /*
- * I2C Proxy inode
+ * Message headers
  */
 
-static int proxy_open(struct inode *inode, struct file *file)
+static size_t eub_i2c_varint_size(u32 v)
 {
-	struct eub_i2c_dev *i2c_dev;
-	i2c_dev = container_of(inode->i_cdev, struct eub_i2c_dev, proxy_cdev);
-	if (i2c_dev  == NULL) {
-		pr_err("%s: container_of\n", __func__);
-		return -EFAULT;
+	size_t n = 1;
+
+	while (0x80 <= v) {
+		v >>= 7;
+		++n;
 	}
-	file->private_data = i2c_dev;
-	return 0;
+	return n;
 }
 
-static int proxy_close(struct inode *inode, struct file *file)
+static char *eub_i2c_put_varint(char *p, u32 v)
 {
-	return 0;
+	while (0x80 <= v) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
 }
 
-static ssize_t proxy_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Whether the compact header of msg carries a 16 bit address, as it does
+ * for the addresses whose headers would read as SMBus ops.
+ */
+static bool eub_i2c_addr16(u32 format, struct i2c_msg *msg)
 {
-	struct eub_i2c_dev *i2c_dev = filp->private_data;
-	ssize_t ret;
+	if (format & EUB_I2C_FORMAT_SMBUS)
+		return EUB_I2C_SMBUS_OP >> 1 <= msg->addr;
+	return 0x7f < msg->addr;
+}
 
-	if (mutex_lock_interruptible(&i2c_dev->mutex))
-		return -ERESTARTSYS;
+static size_t eub_i2c_hdr_size(u32 format, struct i2c_msg *msg)
+{
+	u16 flags = msg->flags & ~I2C_M_RD;
+	bool addr16 = eub_i2c_addr16(format, msg);
+	size_t size;
 
-	while (i2c_dev->len == i2c_dev->offset) {
-		mutex_unlock(&i2c_dev->mutex);
-		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		if (wait_event_interruptible(i2c_dev->outq, (i2c_dev->len != i2c_dev->offset)))
-			return -ERESTARTSYS;
-		if (mutex_lock_interruptible(&i2c_dev->mutex))
-			return -ERESTARTSYS;
+	if (!(format & EUB_I2C_FORMAT_COMPACT))
+		return I2C_MSG_HDR_SIZE;
+	size = 1 + eub_i2c_varint_size(msg->len << 1);
+	if (flags || addr16)
+		size += eub_i2c_varint_size(flags << 1) + (addr16 ? 2 : 0);
+	return size;
+}
+
+/* See linux/eub_i2c.h for the formats. */
+static char *eub_i2c_put_hdr(char *p, u32 format, struct i2c_msg *msg)
+{
+	u16 flags = msg->flags & ~I2C_M_RD;
+	bool addr16 = eub_i2c_addr16(format, msg);
+
+	if (!(format & EUB_I2C_FORMAT_COMPACT)) {
+		memcpy(p, msg, I2C_MSG_HDR_SIZE);
+		return p + I2C_MSG_HDR_SIZE;
 	}
-	ssize_t len = i2c_dev->len - i2c_dev->offset;
-	if (len < count)
-		count = len;
-	if (copy_to_user(buf, i2c_dev->buffer + i2c_dev->offset, count) != 0) {
-		i2c_dev->msg_err = -EIO;
-		ret = -EFAULT;
-	} else {
-		i2c_dev->offset += count;
-		ret = count;
+	*p++ = (addr16 ? 0 : msg->addr << 1) |
+	       ((msg->flags & I2C_M_RD) ? EUB_I2C_COMPACT_RD : 0);
+	if (!flags && !addr16)
+		return eub_i2c_put_varint(p, msg->len << 1);
+	p = eub_i2c_put_varint(p, msg->len << 1 | EUB_I2C_COMPACT_FLAGS);
+	p = eub_i2c_put_varint(p, flags << 1 |
+			       (addr16 ? EUB_I2C_COMPACT_ADDR16 : 0));
+	if (addr16) {
+		*p++ = msg->addr & 0xff;
+		*p++ = msg->addr >> 8;
 	}
+	return p;
+}
 
-	mutex_unlock(&i2c_dev->mutex);
-	if (ret < 0)
-		complete(&i2c_dev->completion);
+/* Whether the data of msg travels to the daemon in the format. */
+static bool eub_i2c_has_data(u32 format, struct i2c_msg *msg)
+{
+	return !(format & EUB_I2C_FORMAT_SPLIT) || !(msg->flags & I2C_M_RD);
+}
 
-	return ret;
+/* Returns the most data the SMBus op reads. */
+static size_t eub_i2c_smbus_read_len(int op)
+{
+	switch (op) {
+	case EUB_I2C_SMBUS_READ_BYTE_DATA:
+		return 1;
+	case EUB_I2C_SMBUS_READ_WORD_DATA:
+		return 2;
+	case EUB_I2C_SMBUS_READ_BLOCK_DATA:
+		return 1 + EUB_I2C_SMBUS_BLOCK_MAX;
+	default:
+		return 0;
+	}
 }
 
-static ssize_t proxy_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Pack the messages of req into a new buffer in the current format, or
+ * its SMBus op, which the format has to allow. Without it the I2C core
+ * emulates the op with messages on -EOPNOTSUPP, except for the block
+ * read, which would take I2C_M_RECV_LEN the bridge cannot carry. Called
+ * with the mutex held.
+ */
+static int eub_i2c_pack(struct eub_i2c_dev *i2c_dev, struct eub_i2c_req *req)
 {
-	struct eub_i2c_dev *i2c_dev = filp->private_data;
+	u32 format = i2c_dev->format;
+	size_t len = 0;
+	size_t rd_len = 0;
+	char *p;
 	int i;
-	ssize_t ret;
 
-	if (mutex_lock_interruptible(&i2c_dev->mutex))
-		return -ERESTARTSYS;
+	if (0 <= req->op) {
+		if (!(format & EUB_I2C_FORMAT_SMBUS))
+			return (req->op == EUB_I2C_SMBUS_READ_BLOCK_DATA) ?
+			       -EPROTONOSUPPORT : -EOPNOTSUPP;
+		len = (req->op == EUB_I2C_SMBUS_WRITE_BYTE_DATA) ? 4 : 3;
+		rd_len = eub_i2c_smbus_read_len(req->op);
+	}
+	for (i = 0; i < req->num; i++) {
+		struct i2c_msg *msg = &req->msgs[i];
 
-	if (i2c_dev->len != count) {
-		i2c_dev->msg_err = ret = -EIO;
-	} else if (copy_from_user(i2c_dev->buffer, buf, count) != 0) {
-		i2c_dev->msg_err = -EIO;
-		ret = -EFAULT;
-	} else {
-		ret = count;
-		char* p = i2c_dev->buffer;
-		for (i = 0; i < i2c_dev->num_msgs; ++i) {
-			struct i2c_msg *to = &i2c_dev->curr_msgs[i];
-			if (0 < to->len && (to->flags & I2C_M_RD)) {
-				memcpy(to->buf,
-				       p + I2C_MSG_HDR_SIZE, to->len);
-			}
-			p += I2C_MSG_HDR_SIZE + to->len;
+		len += eub_i2c_hdr_size(format, msg);
+		if (eub_i2c_has_data(format, msg))
+			len += msg->len;
+		if (msg->flags & I2C_M_RD)
+			rd_len += msg->len;
+	}
+	if (i2c_dev->buffer_size < len ||
+	    ((format & EUB_I2C_FORMAT_SPLIT) && i2c_dev->buffer_size < rd_len))
+		return -EIO;
+	/* a frame each way, as there is no fragmentation in the driver */
+	if (i2c_dev->mode == EUB_I2C_MODE_FRAMED &&
+	    (i2c_dev->framing.max_frame < len ||
+	     ((format & EUB_I2C_FORMAT_SPLIT) &&
+	      i2c_dev->framing.max_frame < 1 + rd_len)))
+		return -EIO;
+
+	p = kmalloc(len, GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+	kfree(req->buffer);
+	req->buffer = p;
+	req->len = len;
+	req->answer_len = (format & EUB_I2C_FORMAT_SPLIT) ? rd_len : len;
+	req->format = format;
+	if (0 <= req->op) {
+		*p++ = EUB_I2C_SMBUS_OP | req->op;
+		*p++ = req->addr;
+		*p++ = req->command;
+		if (req->op == EUB_I2C_SMBUS_WRITE_BYTE_DATA)
+			*p++ = req->data->byte;
+	}
+	for (i = 0; i < req->num; i++) {
+		struct i2c_msg *msg = &req->msgs[i];
+
+		p = eub_i2c_put_hdr(p, format, msg);
+		if (eub_i2c_has_data(format, msg)) {
+			memcpy(p, msg->buf, msg->len);
+			p += msg->len;
 		}
 	}
-	mutex_unlock(&i2c_dev->mutex);
-	complete(&i2c_dev->completion);
+	return 0;
+}
 
-	return ret;
+/*
+ * Frames, as the bridge daemon sends and receives them, for
+ * EUB_I2C_MODE_FRAMED; see eub-utils/eub_i2c.c
+ */
+
+/* CRC-16/CCITT-FALSE, computed without a table as the firmware does */
+static u16 eub_i2c_crc16(u16 crc, const u8 *data, size_t len)
+{
+	while (len--) {
+		crc = (u8) (crc >> 8) | (crc << 8);
+		crc ^= *data++;
+		crc ^= (u8) (crc & 0xff) >> 4;
+		crc ^= (crc << 8) << 4;
+		crc ^= ((crc & 0xff) << 4) << 1;
+	}
+	return crc;
 }
 
-struct file_operations proxy_fops = {
-	.open    = proxy_open,
-	.release = proxy_close,
-	.read    = proxy_read,
-	.write   = proxy_write,
-};
+/* Encode len bytes at src into dst, followed by the delimiter. */
+static size_t eub_i2c_cobs_encode(const u8 *src, size_t len, u8 *dst)
+{
+	u8 *code = dst;
+	u8 *p = dst + 1;
+	u8 c = 1;
+	size_t i;
 
-static int proxy_init(struct eub_i2c_dev *i2c_dev)
+	for (i = 0; i < len; ++i) {
+		if (src[i]) {
+			*p++ = src[i];
+			if (++c < 0xff)
+				continue;
+		}
+		*code = c;
+		code = p++;
+		c = 1;
+	}
+	*code = c;
+	*p++ = 0;
+	return p - dst;
+}
+
+/*
+ * Decode a frame without its delimiter in place. Returns the length of the
+ * decoded data, or 0 if the frame is malformed.
+ */
+static size_t eub_i2c_cobs_decode(u8 *buf, size_t len)
 {
-	int nr = i2c_dev->adapter.nr;
-	int ret;
-	dev_t dev;
+	size_t in = 0;
+	size_t out = 0;
 
-	ret = alloc_chrdev_region(&dev, nr, MINOR_NUM, DRV_NAME);
-	if (ret) {
-		pr_err("failed to allocate device number\n");
-		return ret;
+	while (in < len) {
+		u8 code = buf[in++];
+
+		if (code == 0 || len < in + code - 1)
+			return 0;
+		memmove(buf + out, buf + in, code - 1);
+		out += code - 1;
+		in += code - 1;
+		if (code < 0xff && in < len)
+			buf[out++] = 0;
 	}
-	i2c_dev->proxy_major = MAJOR(dev);
+	return out;
+}
 
-	cdev_init(&i2c_dev->proxy_cdev, &proxy_fops);
-	i2c_dev->proxy_cdev.owner = THIS_MODULE;
-	ret = cdev_add(&i2c_dev->proxy_cdev, dev, MINOR_NUM);
-	if (ret) {
-		pr_err("failed to register device\n");
-		unregister_chrdev_region(dev, MINOR_NUM);
-		return ret;
+static size_t eub_i2c_frame_hdr_size(struct eub_i2c_dev *i2c_dev)
+{
+	if (!i2c_dev->framing.features)
+		return 0;
+	return (i2c_dev->framing.features & EUB_I2C_FRAMING_CRC) ? 2 : 1;
+}
+
+static size_t eub_i2c_frame_trailer_size(struct eub_i2c_dev *i2c_dev)
+{
+	return (i2c_dev->framing.features & EUB_I2C_FRAMING_CRC) ? 2 : 0;
+}
+
+/*
+ * Encode req as a frame into i2c_dev->tx, under the sequence number it
+ * went out with before if it goes out again, or else the next one, which
+ * eub_i2c_send() takes once the frame has been handed out. Returns the
+ * bytes to send. Called with the mutex held.
+ */
+static size_t eub_i2c_encode(struct eub_i2c_dev *i2c_dev,
+			     struct eub_i2c_req *req)
+{
+	u8 *frame = i2c_dev->frame;
+	size_t hdr = eub_i2c_frame_hdr_size(i2c_dev);
+	size_t len = hdr + req->len;
+
+	if (hdr)
+		frame[0] = 0;
+	if (1 < hdr)
+		frame[1] = req->framed ? req->seq : i2c_dev->framing.seq + 1;
+	memcpy(frame + hdr, req->buffer, req->len);
+	if (eub_i2c_frame_trailer_size(i2c_dev)) {
+		u16 crc = eub_i2c_crc16(EUB_BRIDGE_CRC16_INIT, frame, len);
+
+		frame[len++] = crc;
+		frame[len++] = crc >> 8;
 	}
+	return eub_i2c_cobs_encode(frame, len, i2c_dev->tx);
+}
 
-	/*
-	 * Create sysfs entries at /sys/class/eub_i2c/
-	 */
-	i2c_dev->proxy_class = class_create(THIS_MODULE, DRV_NAME);
-	if (IS_ERR(i2c_dev->proxy_class)) {
-		ret = PTR_ERR(i2c_dev->proxy_class);
-		pr_err("failed to create class\n");
-		cdev_del(&i2c_dev->proxy_cdev);
-		unregister_chrdev_region(dev, MINOR_NUM);
-		return ret;
+/*
+ * I2C Proxy inode
+ */
+
+/* Take req off its list. Called with the mutex held. */
+static void eub_i2c_unlink(struct eub_i2c_dev *i2c_dev,
+			   struct eub_i2c_req *req)
+{
+	list_del(&req->list);
+	if (req->inflight) {
+		req->inflight = false;
+		--i2c_dev->inflight;
 	}
+}
 
-	struct device *sysfs_dev =
-		device_create(i2c_dev->proxy_class, NULL, dev, NULL,
-			      "i2c-proxy%d", nr);
-	if (IS_ERR(sysfs_dev)) {
-		ret = PTR_ERR(sysfs_dev);
-		pr_err("failed to create device\n");
-		class_destroy(i2c_dev->proxy_class);
-		cdev_del(&i2c_dev->proxy_cdev);
-		unregister_chrdev_region(dev, MINOR_NUM);
-		return ret;
+/* Called with the mutex held. */
+static void eub_i2c_complete(struct eub_i2c_dev *i2c_dev,
+			     struct eub_i2c_req *req, int err)
+{
+	trace_eub_i2c_reply(dev_name(i2c_dev->dev), req->id, req->addr,
+			    req->answer_len, err);
+	eub_i2c_unlink(i2c_dev, req);
+	req->err = err;
+	req->done = true;
+	wake_up(&req->wait);
+}
+
+/*
+ * The daemon, or the UART, has taken req; give it as long as the daemon
+ * says it needs for a transfer of this size. Called with the mutex held.
+ */
+static void eub_i2c_arm(struct eub_i2c_dev *i2c_dev, struct eub_i2c_req *req)
+{
+	struct eub_i2c_timeout *timeout = &i2c_dev->timeout;
+	unsigned long deadline;
+	u64 us;
+
+	trace_eub_i2c_handoff(dev_name(i2c_dev->dev), req->id, req->addr,
+			      req->len);
+	if (!timeout->base_us && !timeout->byte_ns)
+		return;
+	us = timeout->base_us +
+	     div_u64((u64) timeout->byte_ns * (req->len + req->answer_len),
+		     1000);
+	/* a jiffy more, as the current one is partly over */
+	deadline = jiffies + usecs_to_jiffies(us) + 1;
+	if (time_before(deadline, req->deadline)) {
+		req->deadline = deadline;
+		wake_up(&req->wait);
 	}
-	return 0;
 }
 
-static void proxy_exit(struct eub_i2c_dev *i2c_dev)
+/* Called with the mutex held. */
+static void eub_i2c_fail_pending(struct eub_i2c_dev *i2c_dev)
 {
-	int nr = i2c_dev->adapter.nr;
+	struct eub_i2c_req *req, *tmp;
 
-	dev_t dev = MKDEV(i2c_dev->proxy_major, nr);
-	device_destroy(i2c_dev->proxy_class, dev);
-	class_destroy(i2c_dev->proxy_class);
-	cdev_del(&i2c_dev->proxy_cdev);
-	unregister_chrdev_region(dev, MINOR_NUM);
+	list_for_each_entry_safe(req, tmp, &i2c_dev->pending, list)
+		eub_i2c_complete(i2c_dev, req, -EIO);
+	wake_up_interruptible(&i2c_dev->outq);
+}
+
+/* Called with the mutex held, after the format has changed. */
+static void eub_i2c_repack(struct eub_i2c_dev *i2c_dev)
+{
+	struct eub_i2c_req *req, *tmp;
+	int err;
+
+	list_for_each_entry_safe(req, tmp, &i2c_dev->queue, list) {
+		err = eub_i2c_pack(i2c_dev, req);
+		if (err)
+			eub_i2c_complete(i2c_dev, req, err);
+	}
 }
 
 /*
- * I2C bus
+ * Forget the frames handed out, once the transfers in flight have failed;
+ * the transfers waiting to go out again get new sequence numbers. Called
+ * with the mutex held.
  */
+static void eub_i2c_reset_frames(struct eub_i2c_dev *i2c_dev)
+{
+	struct eub_i2c_req *req;
 
-static void __maybe_unused eub_i2c_debug_print_msg(
-	struct eub_i2c_dev *i2c_dev,
-	struct i2c_msg *msg, int i, int total, const char *fname)
+	list_for_each_entry(req, &i2c_dev->queue, list) {
+		req->framed = false;
+		req->attempts = 0;
+	}
+	i2c_dev->rx_count = 0;
+	i2c_dev->tx_len = i2c_dev->tx_done = 0;
+}
+
+static void eub_i2c_free_frames(struct eub_i2c_dev *i2c_dev)
 {
-	pr_info("%s: msg(%d/%d) %s addr=0x%02x, len=%u flags=%s%s%s%s%s%s%s [i2c%d]\n",
-		fname, i, total,
-		msg->flags & I2C_M_RD ? "read" : "write", msg->addr, msg->len,
-		msg->flags & I2C_M_TEN ? "TEN" : "",
-		msg->flags & I2C_M_RECV_LEN ? "RECV_LEN" : "",
-		msg->flags & I2C_M_NO_RD_ACK ? "NO_RD_ACK" : "",
-		msg->flags & I2C_M_IGNORE_NAK ? "IGNORE_NAK" : "",
-		msg->flags & I2C_M_REV_DIR_ADDR ? "REV_DIR_ADDR" : "",
-		msg->flags & I2C_M_NOSTART ? "NOSTART" : "",
-		msg->flags & I2C_M_STOP ? "STOP" : "",
-		i2c_dev->adapter.nr);
+	kvfree(i2c_dev->frame);
+	kvfree(i2c_dev->tx);
+	kvfree(i2c_dev->rx);
+	i2c_dev->frame = i2c_dev->tx = i2c_dev->rx = NULL;
+	i2c_dev->rx_size = i2c_dev->rx_count = 0;
 }
 
-static int eub_i2c_xfer(struct i2c_adapter *adap, struct i2c_msg msgs[],
-			int num)
+/*
+ * Returns the request the daemon reads next, or NULL. In the legacy mode
+ * a request is handed out only when no other one is pending, except for
+ * the rest of a request already partly read, in the framed mode only
+ * while the window has room, and with a ring only while sq_tail is short
+ * of the sq_limit the daemon has set.
+ */
+static struct eub_i2c_req *proxy_next(struct eub_i2c_dev *i2c_dev)
 {
-	struct eub_i2c_dev *i2c_dev = i2c_get_adapdata(adap);
-	unsigned long time_left;
-	int i;
-	int ret = num;
+	struct eub_i2c_req *req;
 
-	if (num <= 0)
-		return -EBADMSG;
+	if (i2c_dev->mode == EUB_I2C_MODE_FRAMED &&
+	    i2c_dev->framing.window <= i2c_dev->inflight)
+		return NULL;
 
-	mutex_lock(&i2c_dev->mutex);
+	if (i2c_dev->mode == EUB_I2C_MODE_TAGGED && i2c_dev->ring &&
+	    (s32)(READ_ONCE(i2c_dev->ring->sq_limit) - i2c_dev->sq_tail) <= 0)
+		return NULL;
 
-	while (i2c_dev->curr_msgs) {	/* busy */
-		mutex_unlock(&i2c_dev->mutex);
-		if (wait_event_interruptible(i2c_dev->inq,
-					     (i2c_dev->curr_msgs == 0)))
-			return -ERESTARTSYS;
-		if (mutex_lock_interruptible(&i2c_dev->mutex))
-			return -ERESTARTSYS;
+	if (i2c_dev->mode == EUB_I2C_MODE_LEGACY &&
+	    !list_empty(&i2c_dev->pending)) {
+		req = list_first_entry(&i2c_dev->pending, struct eub_i2c_req,
+				       list);
+		return (req->offset < req->len) ? req : NULL;
 	}
+	return list_first_entry_or_null(&i2c_dev->queue, struct eub_i2c_req,
+					list);
+}
 
-	i2c_dev->curr_msgs = msgs;
-	i2c_dev->num_msgs = 0;
-	i2c_dev->len = i2c_dev->offset = 0;
-	i2c_dev->msg_err = 0;
-
-	char* p = i2c_dev->buffer;
-	for (i = 0; i < num; i++) {
-		struct i2c_msg *msg = &msgs[i];
+/*
+ * Queue req behind the requests of its class or a higher one, ahead of
+ * those of a lower class, unless they have been overtaken often enough
+ * already or have gone out once. Called with the mutex held.
+ */
+static void eub_i2c_enqueue(struct eub_i2c_dev *i2c_dev,
+			    struct eub_i2c_req *req)
+{
+	struct eub_i2c_req *pos;
 
-		int len = LEN_BUFFER - i2c_dev->len;
-		if (len < I2C_MSG_HDR_SIZE + msg->len) {
-			ret = i2c_dev->msg_err = -EIO;
+	req->prio = (req->addr < EUB_I2C_PRIO_ADDRS &&
+		     !(req->flags & I2C_M_TEN)) ?
+		    i2c_dev->prio[req->addr] : EUB_I2C_PRIO_NORMAL;
+	req->passed = 0;
+	list_for_each_entry_reverse(pos, &i2c_dev->queue, list) {
+		if (pos->prio <= req->prio || pos->framed ||
+		    EUB_I2C_MAX_PASSED <= pos->passed)
 			break;
-		}
-		memcpy(p, msg, I2C_MSG_HDR_SIZE);
-		memcpy(p + I2C_MSG_HDR_SIZE, msg->buf, msg->len);
-		p += I2C_MSG_HDR_SIZE + msg->len;
-		i2c_dev->len += I2C_MSG_HDR_SIZE + msg->len;
-		++i2c_dev->num_msgs;
 	}
+	list_add(&req->list, &pos->list);
+	pos = req;
+	list_for_each_entry_continue(pos, &i2c_dev->queue, list)
+		++pos->passed;
+}
 
-	if (!i2c_dev->msg_err) {
-		reinit_completion(&i2c_dev->completion);
-		mutex_unlock(&i2c_dev->mutex);
+/* A lockless check for wait_event(); proxy_next() has the final say. */
+static bool proxy_readable(struct eub_i2c_dev *i2c_dev)
+{
+	struct eub_i2c_ring *ring;
 
-		/* awake any reader and wait for the completion */
-		wake_up_interruptible(&i2c_dev->outq);
-		time_left = wait_for_completion_timeout(&i2c_dev->completion,
-							adap->timeout);
+	if (list_empty(&i2c_dev->queue))
+		return false;
+	switch (READ_ONCE(i2c_dev->mode)) {
+	case EUB_I2C_MODE_TAGGED:
+		ring = READ_ONCE(i2c_dev->ring);
+		return !ring || (s32)(READ_ONCE(ring->sq_limit) -
+				      READ_ONCE(i2c_dev->sq_tail)) > 0;
+	case EUB_I2C_MODE_FRAMED:
+		return READ_ONCE(i2c_dev->inflight) < i2c_dev->framing.window;
+	default:
+		return list_empty(&i2c_dev->pending);
+	}
+}
 
-		mutex_lock(&i2c_dev->mutex);
-		if (!time_left) {
-			ret = -ETIMEDOUT;
-			pr_info("%s: i2c transfer timed out (%d)\n", __func__,
-				adap->timeout);
-		} else if (i2c_dev->msg_err) {
-			ret = i2c_dev->msg_err;
-			pr_info("%s: i2c transfer error\n", __func__);
-		}
+/*
+ * Count req as in flight once the frame eub_i2c_encode() made of it has
+ * gone out, and if for the first time, give it the sequence number the
+ * frame carries. Called with the mutex held.
+ */
+static void eub_i2c_send(struct eub_i2c_dev *i2c_dev, struct eub_i2c_req *req)
+{
+	list_move_tail(&req->list, &i2c_dev->pending);
+	req->inflight = true;
+	++i2c_dev->inflight;
+	if (!req->framed) {
+		req->framed = true;
+		req->seq = ++i2c_dev->framing.seq;
+		eub_i2c_arm(i2c_dev, req);
 	}
+}
 
-	i2c_dev->curr_msgs = 0;
-	i2c_dev->len = i2c_dev->offset = 0;
-	mutex_unlock(&i2c_dev->mutex);
+/* Copy the read data of the transfer echoed at p into the read messages. */
+static void eub_i2c_scatter(struct eub_i2c_req *req, const u8 *p)
+{
+	int i;
 
-	wake_up_interruptible(&i2c_dev->inq);
-	return ret;
+	for (i = 0; i < req->num; ++i) {
+		struct i2c_msg *to = &req->msgs[i];
+		p += eub_i2c_hdr_size(req->format, to);
+		if (0 < to->len && (to->flags & I2C_M_RD))
+			memcpy(to->buf, p, to->len);
+		p += to->len;
+	}
 }
 
-static u32 eub_i2c_functionality(struct i2c_adapter *adap)
+/* Check the answer of len bytes at p to an SMBus op and store its data. */
+static int eub_i2c_smbus_answer(struct eub_i2c_req *req, const u8 *p,
+				size_t len)
 {
-	return I2C_FUNC_I2C /* | I2C_FUNC_SMBUS_EMUL; */;
+	switch (req->op) {
+	case EUB_I2C_SMBUS_READ_BYTE_DATA:
+		if (len != 1)
+			return -EIO;
+		req->data->byte = p[0];
+		return 0;
+	case EUB_I2C_SMBUS_READ_WORD_DATA:
+		if (len != 2)
+			return -EIO;
+		req->data->word = get_unaligned_le16(p);
+		return 0;
+	case EUB_I2C_SMBUS_READ_BLOCK_DATA:
+		if (len < 1 || EUB_I2C_SMBUS_BLOCK_MAX < p[0] ||
+		    len != 1 + p[0])
+			return -EPROTO;
+		memcpy(req->data->block, p, len);
+		return 0;
+	default:
+		return len ? -EIO : 0;
+	}
 }
 
-static struct i2c_algorithm eub_i2c_algorithm = {
-	.master_xfer = eub_i2c_xfer,
-	.functionality = eub_i2c_functionality,
-};
-
-static int eub_i2c_probe(struct platform_device *pdev)
+/*
+ * Copy the read data of an answer of len bytes at p into the read
+ * messages of req, or the data of its SMBus op.
+ */
+static int eub_i2c_answer_data(struct eub_i2c_req *req, const u8 *p,
+			       size_t len)
 {
-	struct eub_i2c_dev *i2c_dev;
-	int err = -ENOMEM;
-	struct i2c_adapter *adap;
-
-	i2c_dev = devm_kzalloc(&pdev->dev, sizeof(*i2c_dev), GFP_KERNEL);
-	if (!i2c_dev)
-		return -ENOMEM;
-	platform_set_drvdata(pdev, i2c_dev);
-	i2c_dev->dev = &pdev->dev;
-	init_completion(&i2c_dev->completion);
+	int i;
 
-	adap = &i2c_dev->adapter;
-	i2c_set_adapdata(adap, i2c_dev);
-	adap->owner = THIS_MODULE;
-	adap->class = I2C_CLASS_DEPRECATED;
-	adap->algo = &eub_i2c_algorithm;
-	adap->dev.parent = &pdev->dev;
-	adap->dev.of_node = pdev->dev.of_node;
-	strlcpy(adap->name, dev_name(&pdev->dev), sizeof(adap->name));
+	if (0 <= req->op)
+		return eub_i2c_smbus_answer(req, p, len);
+	if (len != req->answer_len)
+		return -EIO;
+	if (!(req->format & EUB_I2C_FORMAT_SPLIT)) {
+		eub_i2c_scatter(req, p);
+		return 0;
+	}
+	for (i = 0; i < req->num; ++i) {
+		struct i2c_msg *to = &req->msgs[i];
 
-	err = i2c_add_adapter(adap);
-	if (err < 0) {
-		dev_err(&pdev->dev, "could not add I2C adapter: %d\n", err);
-		return err;
+		if (!(to->flags & I2C_M_RD) || to->len == 0)
+			continue;
+		memcpy(to->buf, p, to->len);
+		p += to->len;
 	}
+	return 0;
+}
 
-	if (proxy_init(i2c_dev) < 0)
-		return -ENOMEM;
+static struct eub_i2c_req *proxy_find(struct eub_i2c_dev *i2c_dev, u32 id)
+{
+	struct eub_i2c_req *req;
+
+	list_for_each_entry(req, &i2c_dev->pending, list) {
+		if (req->id == id)
+			return req;
+	}
+	return NULL;
+}
 
-	i2c_dev->curr_msgs = 0;
-	i2c_dev->len = i2c_dev->offset = 0;
+/*
+ * The status an answer from the daemon fails its transfer with: one of the
+ * ways a transfer on the bridge fails, or else -EINVAL.
+ */
+static int proxy_status(s32 status)
+{
+	switch (status) {
+	case -EIO:
+	case -ENXIO:
+	case -ETIMEDOUT:
+		return status;
+	default:
+		return -EINVAL;
+	}
+}
 
-	init_waitqueue_head(&i2c_dev->inq);
-	init_waitqueue_head(&i2c_dev->outq);
-	mutex_init(&i2c_dev->mutex);
+/*
+ * The rings of EUB_I2C_IOC_SET_RING
+ */
 
-	return 0;
+static struct eub_i2c_proxy_hdr *eub_i2c_ring_entry(
+	struct eub_i2c_dev *i2c_dev, u32 off, u32 index)
+{
+	index &= i2c_dev->ring_entries - 1;
+	return (void *) i2c_dev->ring + off + index * i2c_dev->ring_entry_size;
 }
 
-static int eub_i2c_remove(struct platform_device *pdev)
+/*
+ * Hand out the queued transfers through the submission ring, in order,
+ * as proxy_read() would, while they fit in an entry, the ring has room
+ * and the daemon can send them. Called with the mutex held.
+ */
+static void eub_i2c_ring_post(struct eub_i2c_dev *i2c_dev)
 {
-	struct eub_i2c_dev *i2c_dev = platform_get_drvdata(pdev);
+	struct eub_i2c_ring *ring = i2c_dev->ring;
+	struct eub_i2c_proxy_hdr *hdr;
+	struct eub_i2c_req *req;
+	u32 tail = i2c_dev->sq_tail;
+	u32 limit = READ_ONCE(ring->sq_limit);
 
-	proxy_exit(i2c_dev);
-	platform_set_drvdata(pdev, NULL);
-	i2c_del_adapter(&i2c_dev->adapter);
-	return 0;
+	while ((req = proxy_next(i2c_dev)) &&
+	       sizeof(*hdr) + req->len <= i2c_dev->ring_entry_size &&
+	       (s32)(limit - tail) > 0 &&
+	       tail - smp_load_acquire(&ring->sq_head) <
+	       i2c_dev->ring_entries) {
+		hdr = eub_i2c_ring_entry(i2c_dev, i2c_dev->sq_off, tail++);
+		hdr->id = req->id;
+		hdr->len = req->len;
+		hdr->status = 0;
+		hdr->flags = 0;
+		memcpy(hdr + 1, req->buffer, req->len);
+		list_move_tail(&req->list, &i2c_dev->pending);
+		eub_i2c_arm(i2c_dev, req);
+	}
+	if (tail != i2c_dev->sq_tail) {
+		i2c_dev->sq_tail = tail;
+		smp_store_release(&ring->sq_tail, tail);
+	}
 }
 
-static const struct of_device_id eub_i2c_of_match[] = {
-        { .compatible = "esrille,eub_i2c" },
-        {},
-};
-MODULE_DEVICE_TABLE(of, eub_i2c_of_match);
+/*
+ * Take in the answers in the completion ring, as proxy_write() takes
+ * them. Called with the mutex held.
+ */
+static void eub_i2c_ring_reap(struct eub_i2c_dev *i2c_dev)
+{
+	struct eub_i2c_ring *ring = i2c_dev->ring;
+	u32 head = i2c_dev->cq_head;
+	u32 tail = smp_load_acquire(&ring->cq_tail);
+	size_t room = i2c_dev->ring_entry_size -
+		      sizeof(struct eub_i2c_proxy_hdr);
 
-static struct platform_driver eub_i2c_driver = {
-	.driver		= {
+	/* no more than a ring full, whatever the daemon has stored */
+	if (i2c_dev->ring_entries < tail - head)
+		tail = head + i2c_dev->ring_entries;
+	for (; head != tail; ++head) {
+		struct eub_i2c_proxy_hdr *entry =
+			eub_i2c_ring_entry(i2c_dev, i2c_dev->cq_off, head);
+		struct eub_i2c_proxy_hdr hdr = *entry;
+		struct eub_i2c_req *req = proxy_find(i2c_dev, hdr.id);
+
+		/* timed out while the bridge was busy with it */
+		if (!req)
+			continue;
+		if (hdr.status)
+			eub_i2c_complete(i2c_dev, req,
+					 proxy_status(hdr.status));
+		else if (room < hdr.len)
+			eub_i2c_complete(i2c_dev, req, -EIO);
+		else
+			eub_i2c_complete(i2c_dev, req,
+					 eub_i2c_answer_data(req,
+						(u8 *) (entry + 1), hdr.len));
+	}
+	if (head != i2c_dev->cq_head) {
+		i2c_dev->cq_head = head;
+		smp_store_release(&ring->cq_head, head);
+	}
+}
+
+/* Called with the mutex held. */
+static void eub_i2c_ring_update(struct eub_i2c_dev *i2c_dev)
+{
+	if (!i2c_dev->ring || i2c_dev->mode != EUB_I2C_MODE_TAGGED)
+		return;
+	eub_i2c_ring_reap(i2c_dev);
+	eub_i2c_ring_post(i2c_dev);
+}
+
+/* A lockless check for proxy_poll(). */
+static bool eub_i2c_ring_readable(struct eub_i2c_dev *i2c_dev)
+{
+	struct eub_i2c_ring *ring = READ_ONCE(i2c_dev->ring);
+
+	return ring && READ_ONCE(ring->sq_tail) != READ_ONCE(ring->sq_head);
+}
+
+/* Empty the rings, once the transfers in them have failed. */
+static void eub_i2c_ring_reset(struct eub_i2c_dev *i2c_dev)
+{
+	struct eub_i2c_ring *ring = i2c_dev->ring;
+
+	if (!ring)
+		return;
+	i2c_dev->sq_tail = i2c_dev->cq_head = 0;
+	WRITE_ONCE(ring->sq_head, 0);
+	WRITE_ONCE(ring->sq_limit, 0);
+	WRITE_ONCE(ring->sq_tail, 0);
+	WRITE_ONCE(ring->cq_head, 0);
+	WRITE_ONCE(ring->cq_tail, 0);
+}
+
+static int eub_i2c_set_ring(struct eub_i2c_dev *i2c_dev,
+			    struct eub_i2c_ring_setup *setup)
+{
+	size_t ring_size;
+	void *ring;
+
+	if (!is_power_of_2(setup->entries) ||
+	    EUB_I2C_RING_ENTRIES_MAX < setup->entries ||
+	    setup->entry_size % 8 || PAGE_SIZE < setup->entry_size ||
+	    setup->entry_size < sizeof(struct eub_i2c_proxy_hdr) +
+	    MIN_BUFFER_SIZE)
+		return -EINVAL;
+	setup->sq_off = sizeof(struct eub_i2c_ring);
+	setup->cq_off = setup->sq_off + setup->entries * setup->entry_size;
+	setup->size = setup->cq_off + setup->entries * setup->entry_size;
+	ring_size = PAGE_ALIGN(setup->size);
+
+	ring = vmalloc_user(ring_size);
+	if (!ring)
+		return -ENOMEM;
+	mutex_lock(&i2c_dev->mutex);
+	if (i2c_dev->ring) {
+		mutex_unlock(&i2c_dev->mutex);
+		vfree(ring);
+		return -EBUSY;
+	}
+	i2c_dev->ring_entries = setup->entries;
+	i2c_dev->ring_entry_size = setup->entry_size;
+	i2c_dev->sq_off = setup->sq_off;
+	i2c_dev->cq_off = setup->cq_off;
+	i2c_dev->ring_size = ring_size;
+	i2c_dev->sq_tail = i2c_dev->cq_head = 0;
+	WRITE_ONCE(i2c_dev->ring, ring);
+	eub_i2c_ring_update(i2c_dev);
+	mutex_unlock(&i2c_dev->mutex);
+	wake_up_interruptible(&i2c_dev->outq);
+	return 0;
+}
+
+/* Called with the mutex held, once the daemon has unmapped the rings. */
+static void eub_i2c_free_ring(struct eub_i2c_dev *i2c_dev)
+{
+	vfree(i2c_dev->ring);
+	WRITE_ONCE(i2c_dev->ring, NULL);
+	i2c_dev->ring_size = 0;
+}
+
+static int proxy_open(struct inode *inode, struct file *file)
+{
+	struct eub_i2c_dev *i2c_dev;
+	i2c_dev = container_of(inode->i_cdev, struct eub_i2c_dev, proxy_cdev);
+	if (i2c_dev  == NULL) {
+		pr_err("%s: container_of\n", __func__);
+		return -EFAULT;
+	}
+	/* the daemon's session would not survive a second opener's close */
+	if (test_and_set_bit(0, &i2c_dev->proxy_busy))
+		return -EBUSY;
+	file->private_data = i2c_dev;
+	return 0;
+}
+
+static int proxy_close(struct inode *inode, struct file *file)
+{
+	struct eub_i2c_dev *i2c_dev = file->private_data;
+
+	/* nobody is going to answer what the daemon has read */
+	mutex_lock(&i2c_dev->mutex);
+	eub_i2c_fail_pending(i2c_dev);
+	eub_i2c_reset_frames(i2c_dev);
+	eub_i2c_free_frames(i2c_dev);
+	eub_i2c_free_ring(i2c_dev);
+	i2c_dev->mode = EUB_I2C_MODE_LEGACY;
+	i2c_dev->timeout.base_us = 0;
+	i2c_dev->timeout.byte_ns = 0;
+	if (i2c_dev->format != EUB_I2C_FORMAT_RAW) {
+		i2c_dev->format = EUB_I2C_FORMAT_RAW;
+		eub_i2c_repack(i2c_dev);
+	}
+	mutex_unlock(&i2c_dev->mutex);
+	clear_bit(0, &i2c_dev->proxy_busy);
+	return 0;
+}
+
+static ssize_t proxy_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct eub_i2c_dev *i2c_dev = filp->private_data;
+	struct eub_i2c_req *req;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&i2c_dev->mutex))
+		return -ERESTARTSYS;
+	eub_i2c_ring_update(i2c_dev);
+
+	while (!(req = proxy_next(i2c_dev))) {
+		mutex_unlock(&i2c_dev->mutex);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(i2c_dev->outq,
+					     proxy_readable(i2c_dev)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&i2c_dev->mutex))
+			return -ERESTARTSYS;
+	}
+
+	if (i2c_dev->mode == EUB_I2C_MODE_TAGGED) {
+		struct eub_i2c_proxy_hdr hdr = {
+			.id = req->id,
+			.len = req->len,
+		};
+
+		if (count < sizeof(hdr) + req->len) {
+			ret = -EMSGSIZE;
+		} else if (copy_to_user(buf, &hdr, sizeof(hdr)) ||
+			   copy_to_user(buf + sizeof(hdr), req->buffer,
+					req->len)) {
+			ret = -EFAULT;
+		} else {
+			list_move_tail(&req->list, &i2c_dev->pending);
+			eub_i2c_arm(i2c_dev, req);
+			ret = sizeof(hdr) + req->len;
+		}
+	} else if (i2c_dev->mode == EUB_I2C_MODE_FRAMED) {
+		size_t len = eub_i2c_encode(i2c_dev, req);
+
+		if (count < len) {
+			ret = -EMSGSIZE;
+		} else if (copy_to_user(buf, i2c_dev->tx, len)) {
+			ret = -EFAULT;
+		} else {
+			eub_i2c_send(i2c_dev, req);
+			ret = len;
+		}
+	} else {
+		ssize_t len = req->len - req->offset;
+		if (len < count)
+			count = len;
+		if (copy_to_user(buf, req->buffer + req->offset, count) != 0) {
+			eub_i2c_complete(i2c_dev, req, -EIO);
+			ret = -EFAULT;
+		} else {
+			if (req->offset == 0) {
+				list_move_tail(&req->list, &i2c_dev->pending);
+				eub_i2c_arm(i2c_dev, req);
+			}
+			req->offset += count;
+			ret = count;
+		}
+	}
+
+	mutex_unlock(&i2c_dev->mutex);
+	return ret;
+}
+
+/*
+ * Copy the read data of an answer in EUB_I2C_FORMAT_SPLIT straight into
+ * the read messages. Called with the mutex held.
+ */
+static ssize_t proxy_answer_split(struct eub_i2c_dev *i2c_dev,
+				  struct eub_i2c_req *req,
+				  const char __user *buf, size_t count)
+{
+	int i;
+
+	for (i = 0; i < req->num; ++i) {
+		struct i2c_msg *to = &req->msgs[i];
+
+		if (!(to->flags & I2C_M_RD) || to->len == 0)
+			continue;
+		if (copy_from_user(to->buf, buf, to->len) != 0) {
+			eub_i2c_complete(i2c_dev, req, -EIO);
+			return -EFAULT;
+		}
+		buf += to->len;
+	}
+	eub_i2c_complete(i2c_dev, req, 0);
+	return count;
+}
+
+/* Called with the mutex held. */
+static ssize_t proxy_answer_smbus(struct eub_i2c_dev *i2c_dev,
+				  struct eub_i2c_req *req,
+				  const char __user *buf, size_t count)
+{
+	u8 data[1 + EUB_I2C_SMBUS_BLOCK_MAX];
+	int err;
+
+	if (sizeof(data) < count) {
+		eub_i2c_complete(i2c_dev, req, -EIO);
+		return -EIO;
+	}
+	if (copy_from_user(data, buf, count) != 0) {
+		eub_i2c_complete(i2c_dev, req, -EIO);
+		return -EFAULT;
+	}
+	err = eub_i2c_smbus_answer(req, data, count);
+	eub_i2c_complete(i2c_dev, req, err);
+	return err ? err : count;
+}
+
+/* Called with the mutex held. */
+static ssize_t proxy_answer(struct eub_i2c_dev *i2c_dev,
+			    struct eub_i2c_req *req, const char __user *buf,
+			    size_t count)
+{
+	if (0 <= req->op)
+		return proxy_answer_smbus(i2c_dev, req, buf, count);
+	if (req->answer_len != count) {
+		eub_i2c_complete(i2c_dev, req, -EIO);
+		return -EIO;
+	}
+	if (req->format & EUB_I2C_FORMAT_SPLIT)
+		return proxy_answer_split(i2c_dev, req, buf, count);
+	if (copy_from_user(req->buffer, buf, count) != 0) {
+		eub_i2c_complete(i2c_dev, req, -EIO);
+		return -EFAULT;
+	}
+	eub_i2c_scatter(req, (u8 *) req->buffer);
+	eub_i2c_complete(i2c_dev, req, 0);
+	return count;
+}
+
+/*
+ * Returns the framed transfer in flight under seq, or without CRC, where
+ * seq is -1, the only one.
+ */
+static struct eub_i2c_req *eub_i2c_find_frame(struct eub_i2c_dev *i2c_dev,
+					      int seq)
+{
+	struct eub_i2c_req *req;
+
+	list_for_each_entry(req, &i2c_dev->pending, list) {
+		if (req->inflight && (seq < 0 || req->seq == seq))
+			return req;
+	}
+	return NULL;
+}
+
+/* Check the reply payload of len bytes at p and pass its data to req. */
+static int eub_i2c_answer_frame(struct eub_i2c_req *req, const u8 *p,
+				size_t len)
+{
+	if (!(req->format & EUB_I2C_FORMAT_SPLIT))
+		return eub_i2c_answer_data(req, p, len);
+	if (len < 1)
+		return -EIO;
+	if (p[0] != EUB_BRIDGE_STATUS_OK)
+		return (p[0] == EUB_BRIDGE_STATUS_NAK) ? -ENXIO : -EIO;
+	return eub_i2c_answer_data(req, p + 1, len - 1);
+}
+
+/*
+ * Take in one frame from the UART, count bytes at buf without the
+ * delimiter, as link_reap() does in the daemon. A damaged frame is dropped
+ * with CRC, and fails the transfer in flight without. A transfer the
+ * firmware has received damaged goes out once more. Called with the mutex
+ * held.
+ */
+static void eub_i2c_receive(struct eub_i2c_dev *i2c_dev, u8 *buf,
+			    size_t count)
+{
+	size_t hdr = eub_i2c_frame_hdr_size(i2c_dev);
+	size_t trailer = eub_i2c_frame_trailer_size(i2c_dev);
+	struct eub_i2c_req *req;
+	size_t len;
+	int seq = -1;
+	u8 ctl = 0;
+
+	if (!count)
+		return;
+	len = eub_i2c_cobs_decode(buf, count);
+	if (len == 0 || len < hdr + trailer ||
+	    (trailer &&
+	     eub_i2c_crc16(EUB_BRIDGE_CRC16_INIT, buf, len - trailer) !=
+	     (buf[len - 2] | (buf[len - 1] << 8)))) {
+		if (!trailer && (req = eub_i2c_find_frame(i2c_dev, -1)))
+			eub_i2c_complete(i2c_dev, req, -EIO);
+		return;
+	}
+	len -= trailer;
+	if (hdr)
+		ctl = buf[0];
+	if (1 < hdr)
+		seq = buf[1];
+	if (ctl == EUB_FRAME_PUSH)
+		return;
+
+	req = eub_i2c_find_frame(i2c_dev, seq);
+	if (!req && (ctl & EUB_FRAME_NAK) && i2c_dev->inflight == 1)
+		req = eub_i2c_find_frame(i2c_dev, -1);
+	if (!req)
+		return;
+	if (ctl & EUB_FRAME_NAK) {
+		if (FRAME_RETRIES <= req->attempts++) {
+			eub_i2c_complete(i2c_dev, req, -EIO);
+			return;
+		}
+		eub_i2c_unlink(i2c_dev, req);
+		list_add(&req->list, &i2c_dev->queue);
+		return;
+	}
+	eub_i2c_complete(i2c_dev, req, ctl ? -EIO :
+			 eub_i2c_answer_frame(req, buf + hdr, len - hdr));
+}
+
+/* Returns the bytes rx has room for after those not decoded yet. */
+static size_t eub_i2c_rx_room(struct eub_i2c_dev *i2c_dev)
+{
+	return i2c_dev->rx_size - i2c_dev->rx_count;
+}
+
+/*
+ * Take in n bytes from the UART placed in rx after those not decoded yet,
+ * and the frames they complete. Called with the mutex held.
+ */
+static void eub_i2c_take(struct eub_i2c_dev *i2c_dev, size_t n)
+{
+	u8 *start = i2c_dev->rx;
+	u8 *p = start + i2c_dev->rx_count;
+	u8 *end = p + n;
+
+	while ((p = memchr(p, 0, end - p))) {
+		eub_i2c_receive(i2c_dev, start, p - start);
+		start = ++p;
+	}
+	i2c_dev->rx_count = end - start;
+	memmove(i2c_dev->rx, start, i2c_dev->rx_count);
+	/* no frame is that long; it was line noise */
+	if (i2c_dev->rx_count == i2c_dev->rx_size)
+		i2c_dev->rx_count = 0;
+}
+
+/*
+ * Take in count bytes the daemon has received from the UART, split
+ * anywhere. Called with the mutex held.
+ */
+static ssize_t proxy_receive(struct eub_i2c_dev *i2c_dev,
+			     const char __user *buf, size_t count)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		size_t n = min(count - done, eub_i2c_rx_room(i2c_dev));
+
+		if (copy_from_user(i2c_dev->rx + i2c_dev->rx_count,
+				   buf + done, n) != 0)
+			return done ? done : -EFAULT;
+		eub_i2c_take(i2c_dev, n);
+		done += n;
+	}
+	return count;
+}
+
+/*
+ * Switch to EUB_I2C_MODE_FRAMED with framing, and the format it implies.
+ * Called with the mutex held.
+ */
+static int eub_i2c_set_framing(struct eub_i2c_dev *i2c_dev,
+			       const struct eub_i2c_framing *framing)
+{
+	size_t frame_size = framing->max_frame + 4;	/* header and CRC */
+	size_t rx_size = COBS_SIZE(frame_size);
+	u8 *frame, *tx, *rx;
+
+	frame = kvmalloc(frame_size, GFP_KERNEL);
+	tx = kvmalloc(rx_size, GFP_KERNEL);
+	rx = kvmalloc(rx_size, GFP_KERNEL);
+	if (!frame || !tx || !rx) {
+		kvfree(frame);
+		kvfree(tx);
+		kvfree(rx);
+		return -ENOMEM;
+	}
+	eub_i2c_fail_pending(i2c_dev);
+	eub_i2c_free_frames(i2c_dev);
+	eub_i2c_reset_frames(i2c_dev);
+	i2c_dev->frame = frame;
+	i2c_dev->tx = tx;
+	i2c_dev->rx = rx;
+	i2c_dev->rx_size = rx_size;
+	i2c_dev->mode = EUB_I2C_MODE_FRAMED;
+	i2c_dev->framing = *framing;
+	i2c_dev->format =
+		((framing->features & EUB_I2C_FRAMING_COMPACT) ?
+		 EUB_I2C_FORMAT_COMPACT : 0) |
+		((framing->features & EUB_I2C_FRAMING_SPLIT) ?
+		 EUB_I2C_FORMAT_SPLIT : 0) |
+		((framing->features & EUB_I2C_FRAMING_SMBUS) ?
+		 EUB_I2C_FORMAT_SMBUS : 0);
+	eub_i2c_repack(i2c_dev);
+	return 0;
+}
+
+static ssize_t proxy_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct eub_i2c_dev *i2c_dev = filp->private_data;
+	struct eub_i2c_proxy_hdr hdr;
+	struct eub_i2c_req *req;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&i2c_dev->mutex))
+		return -ERESTARTSYS;
+	eub_i2c_ring_update(i2c_dev);
+
+	if (i2c_dev->mode == EUB_I2C_MODE_TAGGED) {
+		if (count < sizeof(hdr)) {
+			ret = -EINVAL;
+		} else if (copy_from_user(&hdr, buf, sizeof(hdr)) != 0) {
+			ret = -EFAULT;
+		} else if (!(req = proxy_find(i2c_dev, hdr.id))) {
+			/* timed out while the bridge was busy with it */
+			ret = -ENOENT;
+		} else if (hdr.status) {
+			eub_i2c_complete(i2c_dev, req,
+					 proxy_status(hdr.status));
+			ret = count;
+		} else {
+			ret = proxy_answer(i2c_dev, req, buf + sizeof(hdr),
+					   count - sizeof(hdr));
+			if (0 <= ret)
+				ret = count;
+		}
+	} else if (i2c_dev->mode == EUB_I2C_MODE_FRAMED) {
+		ret = proxy_receive(i2c_dev, buf, count);
+	} else {
+		req = list_first_entry_or_null(&i2c_dev->pending,
+					       struct eub_i2c_req, list);
+		ret = req ? proxy_answer(i2c_dev, req, buf, count) : -EIO;
+	}
+
+	mutex_unlock(&i2c_dev->mutex);
+	wake_up_interruptible(&i2c_dev->outq);
+
+	return ret;
+}
+
+static long proxy_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct eub_i2c_dev *i2c_dev = filp->private_data;
+	struct eub_i2c_framing framing;
+	struct eub_i2c_ring_setup setup;
+	struct eub_i2c_timeout timeout;
+	u32 mode, format;
+	int ret;
+
+	switch (cmd) {
+	case EUB_I2C_IOC_SET_FORMAT:
+		if (get_user(format, (u32 __user *) arg))
+			return -EFAULT;
+		if ((format & ~(EUB_I2C_FORMAT_COMPACT | EUB_I2C_FORMAT_SPLIT |
+				EUB_I2C_FORMAT_SMBUS)) ||
+		    ((format & EUB_I2C_FORMAT_SMBUS) &&
+		     (~format & (EUB_I2C_FORMAT_COMPACT |
+				 EUB_I2C_FORMAT_SPLIT))))
+			return -EINVAL;
+		mutex_lock(&i2c_dev->mutex);
+		/* the framing decides the format in the framed mode */
+		if (((format & EUB_I2C_FORMAT_SPLIT) &&
+		     i2c_dev->mode != EUB_I2C_MODE_TAGGED) ||
+		    i2c_dev->mode == EUB_I2C_MODE_FRAMED) {
+			mutex_unlock(&i2c_dev->mutex);
+			return -EINVAL;
+		}
+		eub_i2c_fail_pending(i2c_dev);
+		i2c_dev->format = format;
+		eub_i2c_repack(i2c_dev);
+		mutex_unlock(&i2c_dev->mutex);
+		return 0;
+	case EUB_I2C_IOC_SET_MODE:
+		if (get_user(mode, (u32 __user *) arg))
+			return -EFAULT;
+		if (mode != EUB_I2C_MODE_LEGACY && mode != EUB_I2C_MODE_TAGGED)
+			return -EINVAL;
+		mutex_lock(&i2c_dev->mutex);
+		eub_i2c_fail_pending(i2c_dev);
+		eub_i2c_reset_frames(i2c_dev);
+		eub_i2c_ring_reset(i2c_dev);
+		i2c_dev->mode = mode;
+		if (mode == EUB_I2C_MODE_LEGACY)
+			i2c_dev->format &= ~(EUB_I2C_FORMAT_SPLIT |
+					     EUB_I2C_FORMAT_SMBUS);
+		/* without the limit of max_frame */
+		eub_i2c_repack(i2c_dev);
+		mutex_unlock(&i2c_dev->mutex);
+		return 0;
+	case EUB_I2C_IOC_SET_TIMEOUT:
+		if (copy_from_user(&timeout, (void __user *) arg,
+				   sizeof(timeout)))
+			return -EFAULT;
+		mutex_lock(&i2c_dev->mutex);
+		i2c_dev->timeout = timeout;
+		mutex_unlock(&i2c_dev->mutex);
+		return 0;
+	case EUB_I2C_IOC_SET_FRAMING:
+		if (copy_from_user(&framing, (void __user *) arg,
+				   sizeof(framing)))
+			return -EFAULT;
+		if ((framing.features & ~EUB_I2C_FRAMING_ALL) ||
+		    ((framing.features & EUB_I2C_FRAMING_SMBUS) &&
+		     (~framing.features & (EUB_I2C_FRAMING_COMPACT |
+					   EUB_I2C_FRAMING_SPLIT))) ||
+		    framing.reserved || framing.max_frame < MIN_BUFFER_SIZE ||
+		    framing.window < 1 ||
+		    EUB_I2C_FRAMING_WINDOW_MAX < framing.window ||
+		    (1 < framing.window &&
+		     !(framing.features & EUB_I2C_FRAMING_CRC)))
+			return -EINVAL;
+		mutex_lock(&i2c_dev->mutex);
+		ret = eub_i2c_set_framing(i2c_dev, &framing);
+		mutex_unlock(&i2c_dev->mutex);
+		wake_up_interruptible(&i2c_dev->outq);
+		return ret;
+	case EUB_I2C_IOC_SET_RING:
+		if (copy_from_user(&setup, (void __user *) arg, sizeof(setup)))
+			return -EFAULT;
+		ret = eub_i2c_set_ring(i2c_dev, &setup);
+		if (!ret && copy_to_user((void __user *) arg, &setup,
+					 sizeof(setup)))
+			return -EFAULT;
+		return ret;
+	case EUB_I2C_IOC_RING_UPDATE:
+		mutex_lock(&i2c_dev->mutex);
+		ret = i2c_dev->ring ? 0 : -ENODEV;
+		eub_i2c_ring_update(i2c_dev);
+		mutex_unlock(&i2c_dev->mutex);
+		return ret;
+	case EUB_I2C_IOC_GET_FRAMING:
+		mutex_lock(&i2c_dev->mutex);
+		framing = i2c_dev->framing;
+		mutex_unlock(&i2c_dev->mutex);
+		if (copy_to_user((void __user *) arg, &framing,
+				 sizeof(framing)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * The proxy is readable while proxy_read() has a transfer to hand out, and
+ * writable while an answer is expected; in the framed mode bytes from the
+ * UART are taken at any time.
+ */
+static __poll_t proxy_poll(struct file *filp, poll_table *wait)
+{
+	struct eub_i2c_dev *i2c_dev = filp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &i2c_dev->outq, wait);
+	if (proxy_readable(i2c_dev) || eub_i2c_ring_readable(i2c_dev))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(i2c_dev->mode) == EUB_I2C_MODE_FRAMED ||
+	    !list_empty(&i2c_dev->pending))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+static int proxy_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct eub_i2c_dev *i2c_dev = filp->private_data;
+	int ret;
+
+	mutex_lock(&i2c_dev->mutex);
+	if (!i2c_dev->ring)
+		ret = -ENODEV;
+	else if (vma->vm_pgoff ||
+		 i2c_dev->ring_size < vma->vm_end - vma->vm_start)
+		ret = -EINVAL;
+	else
+		ret = remap_vmalloc_range(vma, i2c_dev->ring, 0);
+	mutex_unlock(&i2c_dev->mutex);
+	return ret;
+}
+
+struct file_operations proxy_fops = {
+	.open    = proxy_open,
+	.release = proxy_close,
+	.read    = proxy_read,
+	.write   = proxy_write,
+	.poll    = proxy_poll,
+	.mmap    = proxy_mmap,
+	.unlocked_ioctl = proxy_ioctl,
+};
+
+/*
+ * Create /dev/i2c-proxyN, N being the number of the adapter, on a minor of
+ * its own under the class every bridge shares.
+ */
+static int proxy_init(struct eub_i2c_dev *i2c_dev)
+{
+	int nr = i2c_dev->adapter.nr;
+	struct device *sysfs_dev;
+	dev_t dev;
+	int ret;
+
+	ret = ida_simple_get(&eub_i2c_minors, 0, EUB_I2C_MINORS, GFP_KERNEL);
+	if (ret < 0) {
+		dev_err(i2c_dev->dev, "no free proxy minor\n");
+		return ret;
+	}
+	i2c_dev->proxy_minor = ret;
+	dev = MKDEV(MAJOR(eub_i2c_devt), i2c_dev->proxy_minor);
+
+	cdev_init(&i2c_dev->proxy_cdev, &proxy_fops);
+	i2c_dev->proxy_cdev.owner = THIS_MODULE;
+	ret = cdev_add(&i2c_dev->proxy_cdev, dev, 1);
+	if (ret) {
+		pr_err("failed to register device\n");
+		goto err_minor;
+	}
+
+	sysfs_dev = device_create(eub_i2c_class, i2c_dev->dev, dev, NULL,
+				  "i2c-proxy%d", nr);
+	if (IS_ERR(sysfs_dev)) {
+		ret = PTR_ERR(sysfs_dev);
+		pr_err("failed to create device\n");
+		goto err_cdev;
+	}
+	return 0;
+
+err_cdev:
+	cdev_del(&i2c_dev->proxy_cdev);
+err_minor:
+	ida_simple_remove(&eub_i2c_minors, i2c_dev->proxy_minor);
+	return ret;
+}
+
+static void proxy_exit(struct eub_i2c_dev *i2c_dev)
+{
+	dev_t dev = MKDEV(MAJOR(eub_i2c_devt), i2c_dev->proxy_minor);
+
+	device_destroy(eub_i2c_class, dev);
+	cdev_del(&i2c_dev->proxy_cdev);
+	ida_simple_remove(&eub_i2c_minors, i2c_dev->proxy_minor);
+}
+
+/*
+ * Serial device
+ */
+
+#if IS_ENABLED(CONFIG_SERIAL_DEV_BUS)
+/*
+ * Send the transfers the window has room for straight to the UART, as
+ * proxy_read() hands them to the daemon, after the rest of a frame the
+ * UART had no room for before. Called with the mutex held.
+ */
+static void eub_i2c_serdev_push(struct eub_i2c_dev *i2c_dev)
+{
+	struct eub_i2c_req *req;
+	int n;
+
+	for (;;) {
+		if (i2c_dev->tx_done < i2c_dev->tx_len) {
+			n = serdev_device_write_buf(i2c_dev->serdev,
+				i2c_dev->tx + i2c_dev->tx_done,
+				i2c_dev->tx_len - i2c_dev->tx_done);
+			/* a frame that cannot be sent times out */
+			if (n < 0)
+				n = i2c_dev->tx_len - i2c_dev->tx_done;
+			i2c_dev->tx_done += n;
+			/* on in eub_i2c_serdev_tx_work() */
+			if (i2c_dev->tx_done < i2c_dev->tx_len)
+				return;
+		}
+		req = proxy_next(i2c_dev);
+		if (!req)
+			return;
+		i2c_dev->tx_len = eub_i2c_encode(i2c_dev, req);
+		i2c_dev->tx_done = 0;
+		eub_i2c_send(i2c_dev, req);
+	}
+}
+
+static void eub_i2c_serdev_tx_work(struct work_struct *work)
+{
+	struct eub_i2c_dev *i2c_dev = container_of(work, struct eub_i2c_dev,
+						   tx_work);
+
+	mutex_lock(&i2c_dev->mutex);
+	eub_i2c_serdev_push(i2c_dev);
+	mutex_unlock(&i2c_dev->mutex);
+}
+
+/* The UART has room again; called in atomic context. */
+static void eub_i2c_serdev_write_wakeup(struct serdev_device *serdev)
+{
+	struct eub_i2c_dev *i2c_dev = serdev_device_get_drvdata(serdev);
+
+	schedule_work(&i2c_dev->tx_work);
+}
+
+/* Take in bytes from the UART, as proxy_receive() takes the daemon's. */
+static int eub_i2c_serdev_receive_buf(struct serdev_device *serdev,
+				      const unsigned char *data, size_t count)
+{
+	struct eub_i2c_dev *i2c_dev = serdev_device_get_drvdata(serdev);
+	size_t done = 0;
+
+	mutex_lock(&i2c_dev->mutex);
+	/* before eub_i2c_serdev_negotiate() has set the framing, noise */
+	while (i2c_dev->rx && done < count) {
+		size_t n = min(count - done, eub_i2c_rx_room(i2c_dev));
+
+		memcpy(i2c_dev->rx + i2c_dev->rx_count, data + done, n);
+		eub_i2c_take(i2c_dev, n);
+		done += n;
+	}
+	/* the window may have room, or a NAK left a transfer to send */
+	eub_i2c_serdev_push(i2c_dev);
+	mutex_unlock(&i2c_dev->mutex);
+	return count;
+}
+
+static const struct serdev_device_ops eub_i2c_serdev_ops = {
+	.receive_buf = eub_i2c_serdev_receive_buf,
+	.write_wakeup = eub_i2c_serdev_write_wakeup,
+};
+#else
+static void eub_i2c_serdev_push(struct eub_i2c_dev *i2c_dev)
+{
+}
+#endif
+
+/*
+ * I2C bus
+ */
+
+/*
+ * The I2C core holds the bus lock across master_xfer(), which cannot
+ * return before the transfer has been answered, so with the default lock
+ * there would never be more than one transfer for the bridge daemon to
+ * pipeline. The board firmware runs transfers one at a time in the order
+ * it receives them, so the segment lock i2c_transfer() takes is shared,
+ * and i2c_transfer() calls from several clients can be in flight at
+ * once. Locking the root adapter takes the bus lock and waits for those
+ * to be answered, and keeps the bus to itself until it is unlocked; a
+ * client that needs several transfers to follow each other with nothing
+ * in between, such as a mux, locks it that way.
+ */
+static void eub_i2c_lock_bus(struct i2c_adapter *adap, unsigned int flags)
+{
+	struct eub_i2c_dev *i2c_dev = i2c_get_adapdata(adap);
+
+	if (!(flags & I2C_LOCK_ROOT_ADAPTER)) {
+		down_read(&i2c_dev->xfer_lock);
+		return;
+	}
+	rt_mutex_lock(&adap->bus_lock);
+	down_write(&i2c_dev->xfer_lock);
+}
+
+static int eub_i2c_trylock_bus(struct i2c_adapter *adap, unsigned int flags)
+{
+	struct eub_i2c_dev *i2c_dev = i2c_get_adapdata(adap);
+
+	if (!(flags & I2C_LOCK_ROOT_ADAPTER))
+		return down_read_trylock(&i2c_dev->xfer_lock);
+	if (!rt_mutex_trylock(&adap->bus_lock))
+		return 0;
+	if (down_write_trylock(&i2c_dev->xfer_lock))
+		return 1;
+	rt_mutex_unlock(&adap->bus_lock);
+	return 0;
+}
+
+static void eub_i2c_unlock_bus(struct i2c_adapter *adap, unsigned int flags)
+{
+	struct eub_i2c_dev *i2c_dev = i2c_get_adapdata(adap);
+
+	if (!(flags & I2C_LOCK_ROOT_ADAPTER)) {
+		up_read(&i2c_dev->xfer_lock);
+		return;
+	}
+	up_write(&i2c_dev->xfer_lock);
+	rt_mutex_unlock(&adap->bus_lock);
+}
+
+static const struct i2c_lock_operations eub_i2c_lock_ops = {
+	.lock_bus = eub_i2c_lock_bus,
+	.trylock_bus = eub_i2c_trylock_bus,
+	.unlock_bus = eub_i2c_unlock_bus,
+};
+
+static struct eub_i2c_stats *eub_i2c_stats(struct eub_i2c_dev *i2c_dev,
+					   struct eub_i2c_req *req)
+{
+	if (req->addr < EUB_I2C_PRIO_ADDRS && !(req->flags & I2C_M_TEN))
+		return &i2c_dev->stats[req->addr];
+	return &i2c_dev->stats[EUB_I2C_STATS_OTHER];
+}
+
+/* Count req as waiting for the bridge. Called with the mutex held. */
+static void eub_i2c_stats_queue(struct eub_i2c_dev *i2c_dev,
+				struct eub_i2c_req *req)
+{
+	struct eub_i2c_stats *stats = eub_i2c_stats(i2c_dev, req);
+
+	++stats->depth;
+	stats->depth_max = max(stats->depth_max, stats->depth);
+	++i2c_dev->depth;
+	i2c_dev->depth_max = max(i2c_dev->depth_max, i2c_dev->depth);
+}
+
+/*
+ * Count req as done with ret, us microseconds after it was made. Called
+ * with the mutex held.
+ */
+static void eub_i2c_stats_done(struct eub_i2c_dev *i2c_dev,
+			       struct eub_i2c_req *req, int ret, s64 us)
+{
+	struct eub_i2c_stats *stats = eub_i2c_stats(i2c_dev, req);
+	int i;
+
+	--stats->depth;
+	--i2c_dev->depth;
+	/* counted again as the messages the I2C core emulates it with */
+	if (ret == -EOPNOTSUPP)
+		return;
+	++stats->transfers;
+	stats->messages += (0 <= req->op) ? 1 : req->num;
+	if (ret == -ETIMEDOUT) {
+		++stats->timeouts;
+		return;
+	}
+	stats->latency[min_t(int, fls64(max_t(s64, us, 0)),
+			     EUB_I2C_LATENCY_SLOTS - 1)]++;
+	if (ret) {
+		++stats->errors;
+		return;
+	}
+	if (0 <= req->op) {
+		stats->bytes_out += (req->op == EUB_I2C_SMBUS_WRITE_BYTE_DATA) ?
+				    2 : 1;
+		stats->bytes_in += (req->op == EUB_I2C_SMBUS_READ_BLOCK_DATA) ?
+				   1 + req->data->block[0] :
+				   eub_i2c_smbus_read_len(req->op);
+		return;
+	}
+	for (i = 0; i < req->num; i++) {
+		if (req->msgs[i].flags & I2C_M_RD)
+			stats->bytes_in += req->msgs[i].len;
+		else
+			stats->bytes_out += req->msgs[i].len;
+	}
+}
+
+/*
+ * Queue req, its messages or SMBus op set, for the bridge and wait for the
+ * answer. Returns 0 or a negative errno.
+ */
+static int eub_i2c_submit(struct eub_i2c_dev *i2c_dev,
+			  struct eub_i2c_req *req)
+{
+	ktime_t start = ktime_get();
+	unsigned long deadline;
+	s64 us;
+	int ret;
+
+	req->buffer = NULL;
+	req->offset = 0;
+	req->framed = false;
+	req->inflight = false;
+	req->attempts = 0;
+	req->err = 0;
+	req->done = false;
+	req->deadline = jiffies + i2c_dev->adapter.timeout;
+	init_waitqueue_head(&req->wait);
+
+	mutex_lock(&i2c_dev->mutex);
+	ret = eub_i2c_pack(i2c_dev, req);
+	if (ret) {
+		mutex_unlock(&i2c_dev->mutex);
+		return ret;
+	}
+	req->id = i2c_dev->next_id++;
+	eub_i2c_enqueue(i2c_dev, req);
+	eub_i2c_stats_queue(i2c_dev, req);
+	trace_eub_i2c_enqueue(dev_name(i2c_dev->dev), req->id, req->addr,
+			      req->len, req->prio, i2c_dev->depth);
+	if (i2c_dev->serdev)
+		eub_i2c_serdev_push(i2c_dev);
+	eub_i2c_ring_update(i2c_dev);
+	mutex_unlock(&i2c_dev->mutex);
+
+	/*
+	 * Awake any reader and wait for the answer. The deadline moves
+	 * closer once the daemon has read the transfer, see eub_i2c_arm().
+	 */
+	wake_up_interruptible(&i2c_dev->outq);
+	do {
+		deadline = READ_ONCE(req->deadline);
+		wait_event_timeout(req->wait,
+				   READ_ONCE(req->done) ||
+				   READ_ONCE(req->deadline) != deadline,
+				   max_t(long, (long) (deadline - jiffies), 0));
+	} while (!READ_ONCE(req->done) &&
+		 time_before(jiffies, READ_ONCE(req->deadline)));
+
+	mutex_lock(&i2c_dev->mutex);
+	if (!req->done) {
+		eub_i2c_unlink(i2c_dev, req);
+		if (i2c_dev->serdev)
+			eub_i2c_serdev_push(i2c_dev);
+		ret = -ETIMEDOUT;
+	} else {
+		/* -EOPNOTSUPP or -EPROTONOSUPPORT if repacked for a format
+		 * without SMBus ops */
+		ret = req->err;
+	}
+	us = ktime_us_delta(ktime_get(), start);
+	eub_i2c_stats_done(i2c_dev, req, ret, us);
+	trace_eub_i2c_done(dev_name(i2c_dev->dev), req->id, req->addr, ret,
+			   us);
+	mutex_unlock(&i2c_dev->mutex);
+
+	/* a timed out request no longer holds back the legacy mode */
+	if (ret == -ETIMEDOUT)
+		wake_up_interruptible(&i2c_dev->outq);
+	kfree(req->buffer);
+	return ret;
+}
+
+static int eub_i2c_xfer(struct i2c_adapter *adap, struct i2c_msg msgs[],
+			int num)
+{
+	struct eub_i2c_req req;
+	int ret;
+
+	if (num <= 0)
+		return -EBADMSG;
+
+	req.msgs = msgs;
+	req.num = num;
+	req.op = -1;
+	req.addr = msgs[0].addr;
+	req.flags = msgs[0].flags;
+	ret = eub_i2c_submit(i2c_get_adapdata(adap), &req);
+	return ret ? ret : num;
+}
+
+/*
+ * The register accesses the bridge runs as SMBus ops, in a frame shorter
+ * than the messages they stand for; the I2C core emulates the rest with
+ * messages, as it does all of them but the block read while the daemon
+ * or the firmware does not know the ops.
+ */
+static int eub_i2c_smbus_xfer(struct i2c_adapter *adap, u16 addr,
+			      unsigned short flags, char read_write,
+			      u8 command, int size,
+			      union i2c_smbus_data *data)
+{
+	struct eub_i2c_dev *i2c_dev = i2c_get_adapdata(adap);
+	struct eub_i2c_req req;
+
+	if (flags & (I2C_CLIENT_PEC | I2C_CLIENT_TEN))
+		return (read_write == I2C_SMBUS_READ &&
+			size == I2C_SMBUS_BLOCK_DATA) ?
+		       -EPROTONOSUPPORT : -EOPNOTSUPP;
+	if (read_write == I2C_SMBUS_READ && size == I2C_SMBUS_BYTE_DATA)
+		req.op = EUB_I2C_SMBUS_READ_BYTE_DATA;
+	else if (read_write == I2C_SMBUS_READ && size == I2C_SMBUS_WORD_DATA)
+		req.op = EUB_I2C_SMBUS_READ_WORD_DATA;
+	else if (read_write == I2C_SMBUS_READ && size == I2C_SMBUS_BLOCK_DATA)
+		req.op = EUB_I2C_SMBUS_READ_BLOCK_DATA;
+	else if (read_write == I2C_SMBUS_WRITE &&
+		 size == I2C_SMBUS_BYTE_DATA)
+		req.op = EUB_I2C_SMBUS_WRITE_BYTE_DATA;
+	else
+		return -EOPNOTSUPP;
+
+	req.msgs = NULL;
+	req.num = 0;
+	req.command = command;
+	req.data = data;
+	req.addr = addr;
+	req.flags = flags;
+	return eub_i2c_submit(i2c_dev, &req);
+}
+
+static u32 eub_i2c_functionality(struct i2c_adapter *adap)
+{
+	/*
+	 * The same whatever the format, for clients that check at probe; the
+	 * block read fails with -EPROTONOSUPPORT while the format has no
+	 * SMBus ops.
+	 */
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL |
+	       I2C_FUNC_SMBUS_READ_BLOCK_DATA;
+}
+
+static struct i2c_algorithm eub_i2c_algorithm = {
+	.master_xfer = eub_i2c_xfer,
+	.smbus_xfer = eub_i2c_smbus_xfer,
+	.functionality = eub_i2c_functionality,
+};
+
+static const char * const eub_i2c_prio_names[] = {
+	[EUB_I2C_PRIO_INPUT] = "input",
+	[EUB_I2C_PRIO_NORMAL] = "normal",
+	[EUB_I2C_PRIO_BULK] = "bulk",
+};
+
+/*
+ * /sys/bus/i2c/devices/i2c-N/priority lists the devices on the bridge
+ * not in the normal class; writing "addr class" moves one, the class as
+ * a name or a number.
+ */
+static ssize_t priority_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct eub_i2c_dev *i2c_dev = i2c_get_adapdata(to_i2c_adapter(dev));
+	ssize_t len = 0;
+	int addr;
+
+	mutex_lock(&i2c_dev->mutex);
+	for (addr = 0; addr < EUB_I2C_PRIO_ADDRS; ++addr) {
+		u8 prio = i2c_dev->prio[addr];
+
+		if (prio != EUB_I2C_PRIO_NORMAL)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "0x%02x %s\n", addr,
+					 eub_i2c_prio_names[prio]);
+	}
+	mutex_unlock(&i2c_dev->mutex);
+	return len;
+}
+
+static ssize_t priority_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct eub_i2c_dev *i2c_dev = i2c_get_adapdata(to_i2c_adapter(dev));
+	char name[8];
+	u32 addr;
+	int prio;
+
+	if (sscanf(buf, "%i %7s", &addr, name) != 2 ||
+	    EUB_I2C_PRIO_ADDRS <= addr)
+		return -EINVAL;
+	prio = sysfs_match_string(eub_i2c_prio_names, name);
+	if (prio < 0 && (kstrtoint(name, 0, &prio) ||
+			 prio < EUB_I2C_PRIO_INPUT || EUB_I2C_PRIO_BULK < prio))
+		return -EINVAL;
+
+	mutex_lock(&i2c_dev->mutex);
+	i2c_dev->prio[addr] = prio;
+	mutex_unlock(&i2c_dev->mutex);
+	return count;
+}
+static DEVICE_ATTR_RW(priority);
+
+static struct attribute *eub_i2c_attrs[] = {
+	&dev_attr_priority.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(eub_i2c);
+
+/*
+ * debugfs: eub_i2c/i2c-N/stats shows a line of counters and one of the
+ * latency histogram for each address that has seen a transfer, each slot
+ * as the microseconds it starts from and its count, and writing to reset
+ * clears them. The latency runs from the call into the adapter to the
+ * answer, or the failure other than a timeout.
+ */
+static int eub_i2c_stats_show(struct seq_file *s, void *unused)
+{
+	struct eub_i2c_dev *i2c_dev = s->private;
+	struct eub_i2c_stats *stats;
+	char name[8];
+	int addr, i;
+
+	mutex_lock(&i2c_dev->mutex);
+	seq_printf(s, "depth %u depth_max %u\n", i2c_dev->depth,
+		   i2c_dev->depth_max);
+	for (addr = 0; addr < EUB_I2C_STATS_ADDRS; addr++) {
+		stats = &i2c_dev->stats[addr];
+		if (!stats->transfers && !stats->depth)
+			continue;
+		if (addr == EUB_I2C_STATS_OTHER)
+			strlcpy(name, "other", sizeof(name));
+		else
+			scnprintf(name, sizeof(name), "0x%02x", addr);
+		seq_printf(s, "%s transfers %llu messages %llu bytes_out %llu"
+			   " bytes_in %llu errors %llu timeouts %llu"
+			   " depth_max %u\n", name, stats->transfers,
+			   stats->messages, stats->bytes_out,
+			   stats->bytes_in, stats->errors, stats->timeouts,
+			   stats->depth_max);
+		seq_printf(s, "%s latency_us", name);
+		for (i = 0; i < EUB_I2C_LATENCY_SLOTS; i++) {
+			if (stats->latency[i])
+				seq_printf(s, " %u:%u", i ? 1u << (i - 1) : 0,
+					   stats->latency[i]);
+		}
+		seq_puts(s, "\n");
+	}
+	mutex_unlock(&i2c_dev->mutex);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(eub_i2c_stats);
+
+static int eub_i2c_stats_reset(void *data, u64 val)
+{
+	struct eub_i2c_dev *i2c_dev = data;
+	struct eub_i2c_stats *stats;
+	u32 depth;
+	int addr;
+
+	mutex_lock(&i2c_dev->mutex);
+	/* the transfers waiting now stay counted until they are done */
+	for (addr = 0; addr < EUB_I2C_STATS_ADDRS; addr++) {
+		stats = &i2c_dev->stats[addr];
+		depth = stats->depth;
+		memset(stats, 0, sizeof(*stats));
+		stats->depth = stats->depth_max = depth;
+	}
+	i2c_dev->depth_max = i2c_dev->depth;
+	mutex_unlock(&i2c_dev->mutex);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(eub_i2c_reset_fops, NULL, eub_i2c_stats_reset,
+			 "%llu\n");
+
+static void eub_i2c_debugfs_init(struct eub_i2c_dev *i2c_dev)
+{
+	i2c_dev->debugfs = debugfs_create_dir(dev_name(&i2c_dev->adapter.dev),
+					      eub_i2c_debugfs);
+	debugfs_create_file("stats", 0400, i2c_dev->debugfs, i2c_dev,
+			    &eub_i2c_stats_fops);
+	debugfs_create_file_unsafe("reset", 0200, i2c_dev->debugfs, i2c_dev,
+				   &eub_i2c_reset_fops);
+}
+
+/*
+ * Take the class of each device on the bridge from the esrille,priority
+ * property of its node, if it has one.
+ */
+static void eub_i2c_setup_prio(struct eub_i2c_dev *i2c_dev,
+			       struct device_node *np)
+{
+	struct device_node *child;
+	u32 addr, prio;
+
+	memset(i2c_dev->prio, EUB_I2C_PRIO_NORMAL, sizeof(i2c_dev->prio));
+	for_each_available_child_of_node(np, child) {
+		if (of_property_read_u32(child, "reg", &addr) ||
+		    EUB_I2C_PRIO_ADDRS <= addr ||
+		    of_property_read_u32(child, "esrille,priority", &prio))
+			continue;
+		i2c_dev->prio[addr] = min_t(u32, prio, EUB_I2C_PRIO_BULK);
+	}
+}
+
+/* Set up i2c_dev for the bridge described by the node of dev. */
+static int eub_i2c_setup(struct eub_i2c_dev *i2c_dev, struct device *dev)
+{
+	struct i2c_adapter *adap;
+	u32 size = DEFAULT_BUFFER_SIZE;
+
+	i2c_dev->dev = dev;
+	i2c_dev->stats = devm_kcalloc(dev, EUB_I2C_STATS_ADDRS,
+				      sizeof(*i2c_dev->stats), GFP_KERNEL);
+	if (!i2c_dev->stats)
+		return -ENOMEM;
+
+	/*
+	 * A whole i2c_transfer() is packed into a buffer of at most this
+	 * size and goes over the bridge as a single exchange.
+	 */
+	of_property_read_u32(dev->of_node, "esrille,buffer-size", &size);
+	i2c_dev->buffer_size = clamp_t(u32, size, MIN_BUFFER_SIZE,
+				       MAX_BUFFER_SIZE);
+
+	i2c_dev->mode = EUB_I2C_MODE_LEGACY;
+	i2c_dev->format = EUB_I2C_FORMAT_RAW;
+	INIT_LIST_HEAD(&i2c_dev->queue);
+	INIT_LIST_HEAD(&i2c_dev->pending);
+	eub_i2c_setup_prio(i2c_dev, dev->of_node);
+
+	init_waitqueue_head(&i2c_dev->outq);
+	mutex_init(&i2c_dev->mutex);
+	init_rwsem(&i2c_dev->xfer_lock);
+
+	adap = &i2c_dev->adapter;
+	i2c_set_adapdata(adap, i2c_dev);
+	adap->owner = THIS_MODULE;
+	adap->class = I2C_CLASS_DEPRECATED;
+	adap->algo = &eub_i2c_algorithm;
+	adap->lock_ops = &eub_i2c_lock_ops;
+	/* as i2c_add_adapter() would, for transfers made before it */
+	adap->timeout = HZ;
+	adap->dev.parent = dev;
+	adap->dev.of_node = dev->of_node;
+	adap->dev.groups = eub_i2c_groups;
+	strlcpy(adap->name, dev_name(dev), sizeof(adap->name));
+	return 0;
+}
+
+static int eub_i2c_add_adapter(struct eub_i2c_dev *i2c_dev)
+{
+	int err = i2c_add_adapter(&i2c_dev->adapter);
+
+	if (err < 0) {
+		dev_err(i2c_dev->dev, "could not add I2C adapter: %d\n", err);
+		return err;
+	}
+	eub_i2c_debugfs_init(i2c_dev);
+	return 0;
+}
+
+static void eub_i2c_del_adapter(struct eub_i2c_dev *i2c_dev)
+{
+	debugfs_remove_recursive(i2c_dev->debugfs);
+	i2c_del_adapter(&i2c_dev->adapter);
+}
+
+static int eub_i2c_probe(struct platform_device *pdev)
+{
+	struct eub_i2c_dev *i2c_dev;
+	int err;
+
+	i2c_dev = devm_kzalloc(&pdev->dev, sizeof(*i2c_dev), GFP_KERNEL);
+	if (!i2c_dev)
+		return -ENOMEM;
+	platform_set_drvdata(pdev, i2c_dev);
+	err = eub_i2c_setup(i2c_dev, &pdev->dev);
+	if (err)
+		return err;
+
+	err = eub_i2c_add_adapter(i2c_dev);
+	if (err < 0)
+		return err;
+
+	err = proxy_init(i2c_dev);
+	if (err < 0) {
+		eub_i2c_del_adapter(i2c_dev);
+		return err;
+	}
+
+	return 0;
+}
+
+static int eub_i2c_remove(struct platform_device *pdev)
+{
+	struct eub_i2c_dev *i2c_dev = platform_get_drvdata(pdev);
+
+	proxy_exit(i2c_dev);
+	eub_i2c_free_frames(i2c_dev);
+	platform_set_drvdata(pdev, NULL);
+	eub_i2c_del_adapter(i2c_dev);
+	return 0;
+}
+
+static const struct of_device_id eub_i2c_of_match[] = {
+        { .compatible = "esrille,eub_i2c" },
+        {},
+};
+MODULE_DEVICE_TABLE(of, eub_i2c_of_match);
+
+static struct platform_driver eub_i2c_driver = {
+	.driver		= {
 		.name	= DRV_NAME,
 		.owner	= THIS_MODULE,
 		.of_match_table = eub_i2c_of_match,
@@ -384,7 +2118,347 @@ static struct platform_driver eub_i2c_driver = {
 	.remove		= eub_i2c_remove,
 };
 
-module_platform_driver(eub_i2c_driver);
+/*
+ * An esrille,eub_i2c node under the node of a UART is a serial device the
+ * driver talks to directly in EUB_I2C_MODE_FRAMED, without a proxy or a
+ * daemon; it negotiates the link with the firmware as eub_i2cattach does,
+ * without fragmentation or pushed snapshots.
+ */
+#if IS_ENABLED(CONFIG_SERIAL_DEV_BUS)
+/* Run a bridge control command as a transfer to EUB_BRIDGE_ADDR. */
+static int eub_i2c_bridge_command(struct eub_i2c_dev *i2c_dev, u8 *cmd,
+				  u16 cmd_len, void *reply, u16 reply_len)
+{
+	struct i2c_msg msgs[2] = {
+		{ .addr = EUB_BRIDGE_ADDR, .len = cmd_len, .buf = cmd },
+		{ .addr = EUB_BRIDGE_ADDR, .flags = I2C_M_RD,
+		  .len = reply_len, .buf = reply },
+	};
+	int ret = eub_i2c_xfer(&i2c_dev->adapter, msgs, 2);
+
+	return (ret < 0) ? ret : 0;
+}
+
+static int eub_i2c_bridge_hello(struct eub_i2c_dev *i2c_dev,
+				struct eub_bridge_hello *hello)
+{
+	u8 cmd = EUB_BRIDGE_CMD_HELLO;
+	int ret;
+
+	ret = eub_i2c_bridge_command(i2c_dev, &cmd, 1, hello, sizeof(*hello));
+	if (ret)
+		return ret;
+	if (hello->magic[0] != EUB_BRIDGE_MAGIC0 ||
+	    hello->magic[1] != EUB_BRIDGE_MAGIC1 || hello->version == 0)
+		return -EPROTO;
+	return 0;
+}
+
+/* the rates above EUB_BRIDGE_BAUDRATE that eub_i2cattach tries, too */
+static const u32 eub_i2c_speeds[] = {
+	4000000, 3000000, 2000000, 1500000, 1152000, 1000000, 921600, 576000,
+	500000, 460800, 230400,
+};
+
+/*
+ * Whether the UART, which sets the rate nearest to speed it can divide
+ * its clock down to, comes close enough to speed for the firmware.
+ */
+static bool eub_i2c_baud_ok(u32 speed, unsigned int rate)
+{
+	u32 diff = (rate < speed) ? speed - rate : rate - speed;
+
+	return (u64)diff * 100 <= (u64)speed * SERDEV_BAUD_TOLERANCE;
+}
+
+/* Returns 0 once the firmware and the UART have switched to speed. */
+static int eub_i2c_bridge_baud(struct eub_i2c_dev *i2c_dev, u32 speed)
+{
+	struct serdev_device *serdev = i2c_dev->serdev;
+	struct eub_bridge_hello hello;
+	u8 cmd[6] = { EUB_BRIDGE_CMD_BAUD };
+	unsigned int rate;
+	u8 status;
+
+	/* leave the firmware alone if the UART cannot get near speed */
+	rate = serdev_device_set_baudrate(serdev, speed);
+	serdev_device_set_baudrate(serdev, EUB_BRIDGE_BAUDRATE);
+	if (!eub_i2c_baud_ok(speed, rate))
+		return -ERANGE;
+
+	put_unaligned_le32(speed, cmd + 1);
+	if (eub_i2c_bridge_command(i2c_dev, cmd, sizeof(cmd), &status, 1) ||
+	    status != EUB_BRIDGE_STATUS_OK)
+		return -EIO;
+	serdev_device_set_baudrate(serdev, speed);
+	if (!eub_i2c_bridge_hello(i2c_dev, &hello))
+		return 0;
+
+	/* let the firmware time out and return to the default rate */
+	serdev_device_set_baudrate(serdev, EUB_BRIDGE_BAUDRATE);
+	msleep(EUB_BRIDGE_BAUD_GRACE * 2);
+	return -EIO;
+}
+
+static int eub_i2c_bridge_mode(struct eub_i2c_dev *i2c_dev, u16 features)
+{
+	u8 cmd[3] = { EUB_BRIDGE_CMD_MODE };
+	u8 status;
+
+	put_unaligned_le16(features, cmd + 1);
+	if (eub_i2c_bridge_command(i2c_dev, cmd, sizeof(cmd), &status, 1) ||
+	    status != EUB_BRIDGE_STATUS_OK)
+		return -EIO;
+	return 0;
+}
+
+/* Switch to framing, which the firmware has taken. */
+static int eub_i2c_serdev_framing(struct eub_i2c_dev *i2c_dev,
+				  struct eub_i2c_framing *framing)
+{
+	int ret;
+
+	mutex_lock(&i2c_dev->mutex);
+	framing->seq = i2c_dev->framing.seq;
+	ret = eub_i2c_set_framing(i2c_dev, framing);
+	mutex_unlock(&i2c_dev->mutex);
+	return ret;
+}
+
+/*
+ * Bring the link up to speed and the framing features both sides support,
+ * starting from the framing every firmware understands, as
+ * bridge_negotiate() does in eub_i2cattach, and set the timeouts as
+ * link_answer_timeout() does before it has timed any reply.
+ */
+static int eub_i2c_serdev_negotiate(struct eub_i2c_dev *i2c_dev, u32 speed)
+{
+	struct eub_i2c_framing framing = {
+		.max_frame = EUB_BRIDGE_LEGACY_FRAME,
+		.window = 1,
+	};
+	struct eub_bridge_hello hello;
+	unsigned int baudrate = EUB_BRIDGE_BAUDRATE;
+	unsigned int frames;
+	u16 features;
+	size_t overhead;
+	int ret;
+	int i;
+
+	ret = eub_i2c_serdev_framing(i2c_dev, &framing);
+	if (ret)
+		return ret;
+	serdev_device_set_baudrate(i2c_dev->serdev, EUB_BRIDGE_BAUDRATE);
+	serdev_device_set_flow_control(i2c_dev->serdev, false);
+
+	/* the first attempt resets firmware left at another rate or framing */
+	if (eub_i2c_bridge_hello(i2c_dev, &hello) &&
+	    eub_i2c_bridge_hello(i2c_dev, &hello)) {
+		dev_info(i2c_dev->dev, "no bridge control support; using %u\n",
+			 EUB_BRIDGE_BAUDRATE);
+		return 0;
+	}
+
+	/* the highest rate up to speed both sides accept, as the daemon */
+	if (EUB_BRIDGE_BAUDRATE < speed) {
+		for (i = 0; i < ARRAY_SIZE(eub_i2c_speeds); ++i) {
+			if (speed < eub_i2c_speeds[i])
+				continue;
+			if (!eub_i2c_bridge_baud(i2c_dev, eub_i2c_speeds[i])) {
+				baudrate = eub_i2c_speeds[i];
+				break;
+			}
+		}
+		if (baudrate == EUB_BRIDGE_BAUDRATE)
+			dev_info(i2c_dev->dev, "falling back to %u\n",
+				 EUB_BRIDGE_BAUDRATE);
+	}
+
+	features = le16_to_cpu(hello.features) &
+		   (EUB_I2C_FRAMING_CRC | EUB_I2C_FRAMING_PIPELINE |
+		    EUB_I2C_FRAMING_COMPACT | EUB_I2C_FRAMING_SPLIT |
+		    EUB_I2C_FRAMING_SMBUS);
+	if (!(features & EUB_I2C_FRAMING_CRC) || hello.window < 2)
+		features &= ~EUB_I2C_FRAMING_PIPELINE;
+	if (~features & (EUB_I2C_FRAMING_COMPACT | EUB_I2C_FRAMING_SPLIT))
+		features &= ~EUB_I2C_FRAMING_SMBUS;
+	if (features && !eub_i2c_bridge_mode(i2c_dev, features)) {
+		/* the frame control byte, the sequence number and CRC */
+		overhead = (features & EUB_I2C_FRAMING_CRC) ? 4 : 1;
+		framing.features = features;
+		framing.max_frame = le16_to_cpu(hello.max_frame) - overhead;
+		if (features & EUB_I2C_FRAMING_PIPELINE)
+			framing.window = min_t(unsigned int, hello.window,
+					       EUB_I2C_FRAMING_WINDOW_MAX);
+	} else {
+		framing.max_frame = le16_to_cpu(hello.max_frame);
+	}
+	framing.max_frame = clamp_t(u16, framing.max_frame,
+				    EUB_BRIDGE_LEGACY_FRAME, MAX_BUFFER_SIZE - 1);
+	ret = eub_i2c_serdev_framing(i2c_dev, &framing);
+	if (ret)
+		return ret;
+
+	/* without CRC a late reply would be taken for the next one's */
+	if (features & EUB_I2C_FRAMING_CRC) {
+		frames = framing.window + 1 + FRAME_RETRIES;
+		i2c_dev->timeout.base_us = frames * SERDEV_SLACK_US;
+		i2c_dev->timeout.byte_ns = frames *
+			(10 * NSEC_PER_SEC / baudrate + I2C_BYTE_TIME_NS +
+			 SERDEV_SLACK_US * 1000 / framing.max_frame);
+	}
+	dev_info(i2c_dev->dev, "%u baud, features 0x%x, window %u\n",
+		 baudrate, framing.features, framing.window);
+	return 0;
+}
+
+static int eub_i2c_serdev_probe(struct serdev_device *serdev)
+{
+	struct eub_i2c_dev *i2c_dev;
+	u32 speed = EUB_BRIDGE_BAUDRATE;
+	int err;
+
+	i2c_dev = devm_kzalloc(&serdev->dev, sizeof(*i2c_dev), GFP_KERNEL);
+	if (!i2c_dev)
+		return -ENOMEM;
+	serdev_device_set_drvdata(serdev, i2c_dev);
+	err = eub_i2c_setup(i2c_dev, &serdev->dev);
+	if (err)
+		return err;
+	i2c_dev->serdev = serdev;
+	INIT_WORK(&i2c_dev->tx_work, eub_i2c_serdev_tx_work);
+	of_property_read_u32(serdev->dev.of_node, "current-speed", &speed);
+
+	serdev_device_set_client_ops(serdev, &eub_i2c_serdev_ops);
+	err = serdev_device_open(serdev);
+	if (err) {
+		dev_err(&serdev->dev, "could not open the UART: %d\n", err);
+		return err;
+	}
+
+	/* the devices on the bridge probe once the link is up */
+	err = eub_i2c_serdev_negotiate(i2c_dev, speed);
+	if (!err)
+		err = eub_i2c_add_adapter(i2c_dev);
+	if (err) {
+		serdev_device_close(serdev);
+		cancel_work_sync(&i2c_dev->tx_work);
+		eub_i2c_free_frames(i2c_dev);
+	}
+	return err;
+}
+
+static void eub_i2c_serdev_remove(struct serdev_device *serdev)
+{
+	struct eub_i2c_dev *i2c_dev = serdev_device_get_drvdata(serdev);
+	struct eub_i2c_framing legacy = {
+		.max_frame = EUB_BRIDGE_LEGACY_FRAME,
+		.window = 1,
+	};
+
+	/*
+	 * Leave the firmware in the framing eub_i2cattach starts from while
+	 * the adapter can still carry the command, with the bus to ourselves
+	 * so that no frame of a client goes out in between.
+	 */
+	i2c_lock_bus(&i2c_dev->adapter, I2C_LOCK_ROOT_ADAPTER);
+	if (i2c_dev->framing.features && !eub_i2c_bridge_mode(i2c_dev, 0))
+		eub_i2c_serdev_framing(i2c_dev, &legacy);
+	i2c_unlock_bus(&i2c_dev->adapter, I2C_LOCK_ROOT_ADAPTER);
+	eub_i2c_del_adapter(i2c_dev);
+	serdev_device_close(serdev);
+	cancel_work_sync(&i2c_dev->tx_work);
+	eub_i2c_free_frames(i2c_dev);
+}
+
+static struct serdev_device_driver eub_i2c_serdev_driver = {
+	.driver		= {
+		.name	= DRV_NAME,
+		.owner	= THIS_MODULE,
+		.of_match_table = eub_i2c_of_match,
+	},
+	.probe		= eub_i2c_serdev_probe,
+	.remove		= eub_i2c_serdev_remove,
+};
+
+static int eub_i2c_serdev_register(void)
+{
+	return serdev_device_driver_register(&eub_i2c_serdev_driver);
+}
+
+static void eub_i2c_serdev_unregister(void)
+{
+	serdev_device_driver_unregister(&eub_i2c_serdev_driver);
+}
+#else
+static int eub_i2c_serdev_register(void)
+{
+	return 0;
+}
+
+static void eub_i2c_serdev_unregister(void)
+{
+}
+#endif
+
+/*
+ * Every esrille,eub_i2c node gets an adapter and a proxy of its own, so
+ * that the devices can be spread over several bridges, each with a UART
+ * and a daemon of its own. The proxies share one class and one range of
+ * minors.
+ */
+static int __init eub_i2c_init(void)
+{
+	int ret;
+
+	ret = alloc_chrdev_region(&eub_i2c_devt, 0, EUB_I2C_MINORS, DRV_NAME);
+	if (ret) {
+		pr_err("failed to allocate device numbers\n");
+		return ret;
+	}
+
+	/*
+	 * Create sysfs entries at /sys/class/eub_i2c/
+	 */
+	eub_i2c_class = class_create(THIS_MODULE, DRV_NAME);
+	if (IS_ERR(eub_i2c_class)) {
+		ret = PTR_ERR(eub_i2c_class);
+		pr_err("failed to create class\n");
+		goto err_region;
+	}
+
+	/* a directory for each adapter, see eub_i2c_debugfs_init() */
+	eub_i2c_debugfs = debugfs_create_dir(DRV_NAME, NULL);
+
+	ret = platform_driver_register(&eub_i2c_driver);
+	if (ret)
+		goto err_class;
+	ret = eub_i2c_serdev_register();
+	if (ret)
+		goto err_platform;
+	return 0;
+
+err_platform:
+	platform_driver_unregister(&eub_i2c_driver);
+err_class:
+	debugfs_remove_recursive(eub_i2c_debugfs);
+	class_destroy(eub_i2c_class);
+err_region:
+	unregister_chrdev_region(eub_i2c_devt, EUB_I2C_MINORS);
+	return ret;
+}
+module_init(eub_i2c_init);
+
+static void __exit eub_i2c_exit(void)
+{
+	eub_i2c_serdev_unregister();
+	platform_driver_unregister(&eub_i2c_driver);
+	debugfs_remove_recursive(eub_i2c_debugfs);
+	class_destroy(eub_i2c_class);
+	unregister_chrdev_region(eub_i2c_devt, EUB_I2C_MINORS);
+	ida_destroy(&eub_i2c_minors);
+}
+module_exit(eub_i2c_exit);
 
 MODULE_DESCRIPTION("Esrille Unbrick I2C Bridge Kernel Driver");
 MODULE_AUTHOR("Esrille Inc. <info@esrille.com>");
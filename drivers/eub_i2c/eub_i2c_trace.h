@@ -0,0 +1,133 @@
+/*
+ * Esrille Unbrick I2C Bridge Kernel Driver
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM eub_i2c
+
+#if !defined(_EUB_I2C_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EUB_I2C_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * The life of a transfer on the bridge of device dev, by the id the proxy
+ * gives it: queued for the bridge, handed to the daemon or the UART,
+ * answered or failed, and back with the caller. addr is that of the first
+ * message or the SMBus op, and len the bytes packed for the bridge. The
+ * bridge goes by its device rather than its adapter, which the serdev
+ * driver adds only once it has negotiated the link.
+ */
+TRACE_EVENT(eub_i2c_enqueue,
+	TP_PROTO(const char *dev, u32 id, u16 addr, size_t len, u8 prio,
+		 u32 depth),
+	TP_ARGS(dev, id, addr, len, prio, depth),
+	TP_STRUCT__entry(
+		__string(dev, dev)
+		__field(u32, id)
+		__field(u16, addr)
+		__field(size_t, len)
+		__field(u8, prio)
+		__field(u32, depth)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev);
+		__entry->id = id;
+		__entry->addr = addr;
+		__entry->len = len;
+		__entry->prio = prio;
+		__entry->depth = depth;
+	),
+	TP_printk("%s id=%u addr=0x%02x len=%zu prio=%u depth=%u",
+		  __get_str(dev), __entry->id, __entry->addr, __entry->len,
+		  __entry->prio, __entry->depth)
+);
+
+TRACE_EVENT(eub_i2c_handoff,
+	TP_PROTO(const char *dev, u32 id, u16 addr, size_t len),
+	TP_ARGS(dev, id, addr, len),
+	TP_STRUCT__entry(
+		__string(dev, dev)
+		__field(u32, id)
+		__field(u16, addr)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev);
+		__entry->id = id;
+		__entry->addr = addr;
+		__entry->len = len;
+	),
+	TP_printk("%s id=%u addr=0x%02x len=%zu",
+		  __get_str(dev), __entry->id, __entry->addr, __entry->len)
+);
+
+/* len is the most the answer holds */
+TRACE_EVENT(eub_i2c_reply,
+	TP_PROTO(const char *dev, u32 id, u16 addr, size_t len, int err),
+	TP_ARGS(dev, id, addr, len, err),
+	TP_STRUCT__entry(
+		__string(dev, dev)
+		__field(u32, id)
+		__field(u16, addr)
+		__field(size_t, len)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev);
+		__entry->id = id;
+		__entry->addr = addr;
+		__entry->len = len;
+		__entry->err = err;
+	),
+	TP_printk("%s id=%u addr=0x%02x len=%zu err=%d",
+		  __get_str(dev), __entry->id, __entry->addr, __entry->len,
+		  __entry->err)
+);
+
+/* us since the caller came into the adapter */
+TRACE_EVENT(eub_i2c_done,
+	TP_PROTO(const char *dev, u32 id, u16 addr, int ret, s64 us),
+	TP_ARGS(dev, id, addr, ret, us),
+	TP_STRUCT__entry(
+		__string(dev, dev)
+		__field(u32, id)
+		__field(u16, addr)
+		__field(int, ret)
+		__field(s64, us)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev);
+		__entry->id = id;
+		__entry->addr = addr;
+		__entry->ret = ret;
+		__entry->us = us;
+	),
+	TP_printk("%s id=%u addr=0x%02x ret=%d us=%lld",
+		  __get_str(dev), __entry->id, __entry->addr, __entry->ret,
+		  __entry->us)
+);
+
+#endif /* _EUB_I2C_TRACE_H */
+
+/* the header is not in include/trace/events; see the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE eub_i2c_trace
+#include <trace/define_trace.h>
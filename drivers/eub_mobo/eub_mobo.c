@@ -27,6 +27,7 @@
 #include <linux/mfd/core.h>
 
 #include <linux/mfd/eub_mobo.h>
+#include <linux/mfd/eub_regs.h>
 
 static const struct mfd_cell eub_mobo_devs[] = {
 	{
@@ -39,59 +40,18 @@ static const struct mfd_cell eub_mobo_devs[] = {
 	},
 };
 
-static int i2c_client_read_device(struct i2c_client *i2c, char reg,
-				  int bytes, void *dest)
-{
-	struct i2c_msg xfer[2];
-	int ret;
-
-	/* Write register */
-	xfer[0].addr = i2c->addr;
-	xfer[0].flags = 0;
-	xfer[0].len = 1;
-	xfer[0].buf = &reg;
-
-	/* Read data */
-	xfer[1].addr = i2c->addr;
-	xfer[1].flags = I2C_M_RD;
-	xfer[1].len = bytes;
-	xfer[1].buf = dest;
-
-	ret = i2c_transfer(i2c->adapter, xfer, 2);
-	if (ret == 2)
-		ret = 0;
-	else if (ret >= 0)
-		ret = -EIO;
-
-	return ret;
-}
-
 static int eub_mobo_i2c_read_device(struct eub_mobo_dev *eub_mobo, char reg,
 				    int bytes, void *dest)
 {
-	return i2c_client_read_device(eub_mobo->i2c_client, reg, bytes, dest);
+	return eub_regs_read(eub_mobo->i2c_client, reg, bytes, dest);
 }
 
 static int eub_mobo_i2c_write_device(struct eub_mobo_dev *eub_mobo, char reg,
 				   int bytes, void *src)
 {
-	struct i2c_client *i2c = eub_mobo->i2c_client;
-	/* we add 1 byte for device register */
-	u8 msg[EUB_MOBO_REG_MAX + 1];
-	int ret;
-
 	if (EUB_MOBO_REG_MAX < bytes)
 		return -EINVAL;
-
-	msg[0] = reg;
-	memcpy(&msg[1], src, bytes);
-
-	ret = i2c_master_send(i2c, msg, bytes + 1);
-	if (ret < 0)
-		return ret;
-	if (ret != bytes + 1)
-		return -EIO;
-	return 0;
+	return eub_regs_write(eub_mobo->i2c_client, reg, bytes, src);
 }
 
 static int eub_mobo_i2c_probe(struct i2c_client *i2c,
@@ -102,7 +62,7 @@ static int eub_mobo_i2c_probe(struct i2c_client *i2c,
 	int ret;
 
 	/* sync up with eub-i2c service */
-	ret = i2c_client_read_device(i2c, 0, 1, &val);
+	ret = eub_regs_read(i2c, 0, 1, &val);
 	if (ret < 0) {
 		dev_info(&i2c->dev, "%s: will retry\n", __func__);
 		return -EPROBE_DEFER;
@@ -27,6 +27,9 @@
 
 #include <linux/mfd/eub_power.h>
 
+#define CREATE_TRACE_POINTS
+#include "eub_mouse_trace.h"
+
 #define DRIVER_NAME		"eub_mouse"
 
 /* GPIO Pins */
@@ -168,8 +171,10 @@ static void eub_mouse_work_handler(struct work_struct *work)
 	unsigned long delay;
 
 	eub_mouse_check_params(joystick);
+	trace_eub_mouse_work_start(joystick->scan_ms);
 
 	have_data = eub_mouse_get_input(joystick);
+	trace_eub_mouse_work_end(have_data);
 	delay = eub_mouse_adjust_delay(joystick, have_data);
 
 	eub_mouse_reschedule_work(joystick, delay);
@@ -225,12 +230,11 @@ static void eub_mouse_configure(struct eub_mouse *joystick)
 	if (0 <= err) {
 		joystick->x_orig = val[0];
 		joystick->y_orig = val[1];
-		pr_info("%s: ver=%d, x=%d, y=%d, stick_play=%u.\n",
-			__func__,
-			joystick->input->id.version,
-			joystick->x_orig,
-			joystick->y_orig,
-			stick_play);
+		dev_info(joystick->dev, "ver=%d, x=%d, y=%d, stick_play=%u\n",
+			 joystick->input->id.version,
+			 joystick->x_orig,
+			 joystick->y_orig,
+			 stick_play);
 	}
 }
 
@@ -0,0 +1,61 @@
+/*
+ * Esrille Unbrick Mouse Driver
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM eub_mouse
+
+#if !defined(_EUB_MOUSE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EUB_MOUSE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Each poll, from the work handler starting to the input being synced */
+TRACE_EVENT(eub_mouse_work_start,
+	TP_PROTO(int scan_ms),
+	TP_ARGS(scan_ms),
+	TP_STRUCT__entry(
+		__field(int, scan_ms)
+	),
+	TP_fast_assign(
+		__entry->scan_ms = scan_ms;
+	),
+	TP_printk("scan_ms=%d", __entry->scan_ms)
+);
+
+/* have_data if the stick has moved or a button is down */
+TRACE_EVENT(eub_mouse_work_end,
+	TP_PROTO(bool have_data),
+	TP_ARGS(have_data),
+	TP_STRUCT__entry(
+		__field(bool, have_data)
+	),
+	TP_fast_assign(
+		__entry->have_data = have_data;
+	),
+	TP_printk("have_data=%d", __entry->have_data)
+);
+
+#endif /* _EUB_MOUSE_TRACE_H */
+
+/* the header is not in include/trace/events; see the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE eub_mouse_trace
+#include <trace/define_trace.h>
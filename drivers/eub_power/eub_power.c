@@ -27,6 +27,7 @@
 #include <linux/mfd/core.h>
 
 #include <linux/mfd/eub_power.h>
+#include <linux/mfd/eub_regs.h>
 
 static const struct mfd_cell eub_power_devs[] = {
 	{
@@ -42,51 +43,15 @@ static const struct mfd_cell eub_power_devs[] = {
 static int eub_power_i2c_read_device(struct eub_power_dev *eub_power, char reg,
 				     int bytes, void *dest)
 {
-	struct i2c_client *i2c = eub_power->i2c_client;
-	struct i2c_msg xfer[2];
-	int ret;
-
-	/* Write register */
-	xfer[0].addr = i2c->addr;
-	xfer[0].flags = 0;
-	xfer[0].len = 1;
-	xfer[0].buf = &reg;
-
-	/* Read data */
-	xfer[1].addr = i2c->addr;
-	xfer[1].flags = I2C_M_RD;
-	xfer[1].len = bytes;
-	xfer[1].buf = dest;
-
-	ret = i2c_transfer(i2c->adapter, xfer, 2);
-	if (ret == 2)
-		ret = 0;
-	else if (ret >= 0)
-		ret = -EIO;
-
-	return ret;
+	return eub_regs_read(eub_power->i2c_client, reg, bytes, dest);
 }
 
 static int eub_power_i2c_write_device(struct eub_power_dev *eub_power, char reg,
 				      int bytes, void *src)
 {
-	struct i2c_client *i2c = eub_power->i2c_client;
-	/* we add 1 byte for device register */
-	u8 msg[EUB_POWER_REG_MAX + 1];
-	int ret;
-
 	if (EUB_POWER_REG_MAX < bytes)
 		return -EINVAL;
-
-	msg[0] = reg;
-	memcpy(&msg[1], src, bytes);
-
-	ret = i2c_master_send(i2c, msg, bytes + 1);
-	if (ret < 0)
-		return ret;
-	if (ret != bytes + 1)
-		return -EIO;
-	return 0;
+	return eub_regs_write(eub_power->i2c_client, reg, bytes, src);
 }
 
 static int eub_power_i2c_probe(struct i2c_client *i2c,
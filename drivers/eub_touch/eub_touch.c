@@ -24,9 +24,14 @@
 #include <linux/workqueue.h>
 #include <linux/slab.h>
 #include <linux/gpio.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
 
 #include <linux/mfd/eub_mobo.h>
 
+#define CREATE_TRACE_POINTS
+#include "eub_touch_trace.h"
+
 #define DRIVER_NAME		"eub_touch"
 
 #define MIN_X	26
@@ -39,6 +44,12 @@ static int scan_rate = 60;
 module_param(scan_rate, int, 0644);
 MODULE_PARM_DESC(scan_rate, "Polling rate in times/sec. Default = 60");
 
+/* Sampling rate of the touch FIFO; each poll drains it in one read */
+static int sample_rate;
+module_param(sample_rate, int, 0644);
+MODULE_PARM_DESC(sample_rate,
+		 "Samples/sec buffered by the firmware. Default = 0 (off)");
+
 /* The main device structure */
 struct eub_touch {
 	struct eub_mobo_dev	*mfd;
@@ -48,6 +59,8 @@ struct eub_touch {
 	spinlock_t		lock;
 	int			scan_rate_param;
 	int			scan_ms;
+	int			sample_rate_param;
+	int			fifo_samples;	// per read, or 0 without FIFO
 
 	int			x;
 	int			y;
@@ -71,26 +84,15 @@ static int eub_touch_reg_get(struct eub_touch *touch, u8 reg)
 	return val;
 }
 
-static int __maybe_unused eub_touch_reg_set(struct eub_touch *touch, u8 reg,
-					    u8 val)
+static int eub_touch_reg_set(struct eub_touch *touch, u8 reg, u8 val)
 {
 	return touch->mfd->write_dev(touch->mfd, reg, 1, &val);
 }
 
-static bool eub_touch_get_input(struct eub_touch *touch)
+static void eub_touch_report(struct eub_touch *touch, s32 x, s32 y, s32 z)
 {
 	struct input_dev *input = touch->input;
-	u8 val[6];
-	s32 x, y, z;
-	int ret;
 
-	ret = touch->mfd->read_dev(touch->mfd, EUB_MOBO_REG_X_LOW, 6, val);
-	if (ret < 0)
-		return false;
-
-	x = val[0] | (val[1] << 8);
-	y = val[2] | (val[3] << 8);
-	z = val[4] | (val[5] << 8);
 	if (x < MIN_X || MAX_X < x || y < MIN_Y || MAX_Y < y)
 		z = 0x3ff;
 
@@ -121,9 +123,94 @@ static bool eub_touch_get_input(struct eub_touch *touch)
 		input_report_key(input, BTN_TOUCH, 0);
 	}
 	input_sync(input);
+}
+
+static bool eub_touch_get_input(struct eub_touch *touch)
+{
+	u8 val[6];
+	int ret;
+
+	ret = touch->mfd->read_dev(touch->mfd, EUB_MOBO_REG_X_LOW, 6, val);
+	if (ret < 0)
+		return false;
+
+	eub_touch_report(touch, val[0] | (val[1] << 8), val[2] | (val[3] << 8),
+			 val[4] | (val[5] << 8));
 	return true;
 }
 
+/*
+ * Drain the touch FIFO in one read and report every sample with the time
+ * it was taken, estimated from its age at the middle of the read.
+ */
+static bool eub_touch_get_fifo(struct eub_touch *touch)
+{
+	u8 buf[sizeof(struct eub_mobo_fifo_hdr) +
+	       EUB_MOBO_FIFO_DEPTH * sizeof(struct eub_mobo_fifo_sample)];
+	struct eub_mobo_fifo_hdr *hdr = (void *)buf;
+	struct eub_mobo_fifo_sample *sample = (void *)(hdr + 1);
+	ktime_t start, read_time;
+	int i, ret;
+
+	start = ktime_get();
+	ret = touch->mfd->read_dev(touch->mfd, EUB_MOBO_REG_FIFO,
+				   sizeof(*hdr) + touch->fifo_samples *
+				   sizeof(*sample), buf);
+	if (ret < 0)
+		return false;
+	read_time = ktime_add_ns(start,
+				 ktime_to_ns(ktime_sub(ktime_get(), start)) / 2);
+
+	if (touch->fifo_samples < hdr->count)
+		return false;
+	for (i = 0; i < hdr->count; ++i, ++sample) {
+		u16 age = le16_to_cpu(hdr->now) - le16_to_cpu(sample->time);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+		input_set_timestamp(touch->input,
+				    ktime_sub_us(read_time,
+						 age * EUB_MOBO_FIFO_TICK_US));
+#endif
+		eub_touch_report(touch, le16_to_cpu(sample->x),
+				 le16_to_cpu(sample->y),
+				 le16_to_cpu(sample->z));
+	}
+	return true;
+}
+
+/*
+ * Have the firmware buffer samples at sample_rate, and size the reads to
+ * take in what a poll finds with room to spare. Falls back to a single
+ * sample per poll if the firmware has no FIFO.
+ */
+static void eub_touch_set_sample_rate(struct eub_touch *touch,
+				      int sample_rate)
+{
+	int period, ret;
+
+	touch->sample_rate_param = sample_rate;
+	if (sample_rate <= 0) {
+		// leave the register alone unless the FIFO has been on
+		if (touch->fifo_samples)
+			eub_touch_reg_set(touch, EUB_MOBO_REG_FIFO_PERIOD, 0);
+		touch->fifo_samples = 0;
+		return;
+	}
+	touch->fifo_samples = 0;
+	period = clamp_t(int, USEC_PER_SEC / EUB_MOBO_FIFO_TICK_US /
+			 sample_rate, 1, 255);
+	if (eub_touch_reg_set(touch, EUB_MOBO_REG_FIFO_PERIOD, period) < 0)
+		return;
+	ret = eub_touch_reg_get(touch, EUB_MOBO_REG_FIFO_PERIOD);
+	if (ret != period) {
+		dev_info(touch->dev, "no touch FIFO; one sample per poll\n");
+		return;
+	}
+	touch->fifo_samples = min_t(int, DIV_ROUND_UP(sample_rate,
+						      touch->scan_rate_param) + 1,
+				    EUB_MOBO_FIFO_DEPTH);
+}
+
 static void eub_touch_reschedule_work(struct eub_touch *touch,
 				      unsigned long delay)
 {
@@ -138,8 +225,12 @@ static void eub_touch_reschedule_work(struct eub_touch *touch,
 
 static void eub_touch_check_params(struct eub_touch *touch)
 {
-	if (scan_rate != touch->scan_rate_param)
+	if (scan_rate != touch->scan_rate_param) {
 		set_scan_rate(touch, scan_rate);
+		touch->sample_rate_param = -1;
+	}
+	if (sample_rate != touch->sample_rate_param)
+		eub_touch_set_sample_rate(touch, sample_rate);
 }
 
 /* Control the Device polling rate / Work Handler sleep time */
@@ -161,8 +252,13 @@ static void eub_touch_work_handler(struct work_struct *work)
 	unsigned long delay;
 
 	eub_touch_check_params(touch);
+	trace_eub_touch_work_start(touch->scan_ms, touch->fifo_samples);
 
-	have_data = eub_touch_get_input(touch);
+	if (touch->fifo_samples)
+		have_data = eub_touch_get_fifo(touch);
+	else
+		have_data = eub_touch_get_input(touch);
+	trace_eub_touch_work_end(have_data, touch->touch, touch->x, touch->y);
 	delay = eub_touch_adjust_delay(touch, have_data);
 
 	eub_touch_reschedule_work(touch, delay);
@@ -172,6 +268,8 @@ static int eub_touch_open(struct input_dev *input)
 {
 	struct eub_touch *touch = input_get_drvdata(input);
 
+	// start the FIFO with the first poll, from a clean slate
+	touch->sample_rate_param = -1;
 	eub_touch_reschedule_work(touch,
 				  eub_touch_adjust_delay(touch, true));
 	return 0;
@@ -182,6 +280,8 @@ static void eub_touch_close(struct input_dev *input)
 	struct eub_touch *touch = input_get_drvdata(input);
 
 	cancel_delayed_work_sync(&touch->dwork);
+	if (touch->fifo_samples)
+		eub_touch_set_sample_rate(touch, 0);
 }
 
 static void eub_touch_set_input_params(struct eub_touch *touch)
@@ -207,8 +307,7 @@ static void eub_touch_set_input_params(struct eub_touch *touch)
 
 static void eub_touch_configure(struct eub_touch *touch)
 {
-        pr_info("eub_touch_configure: ver=%d.\n",
-		touch->input->id.version);
+	dev_info(touch->dev, "ver=%d\n", touch->input->id.version);
 	touch->x = -1;
 	touch->y = -1;
 	touch->touch = 0;
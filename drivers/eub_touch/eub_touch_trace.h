@@ -0,0 +1,74 @@
+/*
+ * Esrille Unbrick Touch Screen Driver
+ *
+ * Copyright (C) 2018, 2019 Esrille Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM eub_touch
+
+#if !defined(_EUB_TOUCH_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EUB_TOUCH_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Each poll, from the work handler starting to the samples it has taken
+ * in being reported; the bridge transfers of the read fall in between.
+ */
+TRACE_EVENT(eub_touch_work_start,
+	TP_PROTO(int scan_ms, int fifo_samples),
+	TP_ARGS(scan_ms, fifo_samples),
+	TP_STRUCT__entry(
+		__field(int, scan_ms)
+		__field(int, fifo_samples)
+	),
+	TP_fast_assign(
+		__entry->scan_ms = scan_ms;
+		__entry->fifo_samples = fifo_samples;
+	),
+	TP_printk("scan_ms=%d fifo_samples=%d",
+		  __entry->scan_ms, __entry->fifo_samples)
+);
+
+/* x, y and touch as last reported */
+TRACE_EVENT(eub_touch_work_end,
+	TP_PROTO(bool have_data, int touch, int x, int y),
+	TP_ARGS(have_data, touch, x, y),
+	TP_STRUCT__entry(
+		__field(bool, have_data)
+		__field(int, touch)
+		__field(int, x)
+		__field(int, y)
+	),
+	TP_fast_assign(
+		__entry->have_data = have_data;
+		__entry->touch = touch;
+		__entry->x = x;
+		__entry->y = y;
+	),
+	TP_printk("have_data=%d touch=%d x=%d y=%d",
+		  __entry->have_data, __entry->touch, __entry->x, __entry->y)
+);
+
+#endif /* _EUB_TOUCH_TRACE_H */
+
+/* the header is not in include/trace/events; see the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE eub_touch_trace
+#include <trace/define_trace.h>